@@ -0,0 +1,3 @@
+// The benchmarks again with CGEN_INSTRUMENTATION defined (see plus.toml);
+// they finish by printing the per-kind JSON report.
+#include "../../src/bench.cpp"
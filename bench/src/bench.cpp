@@ -0,0 +1,669 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#define CGEN_IMPLEMENTATION
+#include "cgen.hpp"
+
+// The deletes are kept out of line: inlined, GCC sees free() on what it
+// takes for a pointer from the builtin operator new and warns.
+#ifdef _MSC_VER
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE __attribute__((noinline))
+#endif
+
+static std::atomic<size_t> allocations{0};
+static std::atomic<size_t> allocated_bytes{0};
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+BENCH_NOINLINE void operator delete(void *p) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+// std::pmr::new_delete_resource allocates through the aligned forms.
+void *operator new(size_t size, std::align_val_t align)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+#ifdef _WIN32
+    if (void *p = _aligned_malloc(size ? size : 1, (size_t)align))
+#else
+    size_t alignment = std::max((size_t)align, sizeof(void *));
+    if (void *p = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment))
+#endif
+        return p;
+    throw std::bad_alloc();
+}
+
+#ifdef _WIN32
+BENCH_NOINLINE void operator delete(void *p, std::align_val_t) noexcept { _aligned_free(p); }
+BENCH_NOINLINE void operator delete(void *p, size_t, std::align_val_t) noexcept { _aligned_free(p); }
+#else
+BENCH_NOINLINE void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete(void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+#endif
+
+size_t peak_rss_kb()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize / 1024;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+template <typename F>
+double measure(F &&f, int iterations = 5)
+{
+    double best = 1e30;
+
+    for (int i = 0; i < iterations; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+
+    return best;
+}
+
+size_t count_nodes(cgen::Node *node)
+{
+    size_t count = 1;
+    cgen::for_each_child(node, [&](std::unique_ptr<cgen::Node> &child)
+                         { if (child) count += count_nodes(child.get()); });
+    return count;
+}
+
+std::unique_ptr<cgen::Node> function(size_t index, size_t statements)
+{
+    auto fn = cgen::make<cgen::Function>();
+    fn->name = "f" + std::to_string(index);
+    fn->return_type = cgen::i32();
+    fn->parameters.push_back(cgen::decl_local("a", cgen::i32()));
+    fn->parameters.push_back(cgen::decl_local("b", cgen::pointer_of(cgen::u8())));
+
+    auto body = cgen::make<cgen::Block>();
+    for (size_t s = 0; s < statements; s++)
+    {
+        body->push(cgen::call(cgen::local("g"), cgen::local("a"), cgen::literal((int)s), cgen::get_ref(cgen::local("b"))));
+    }
+
+    auto ret = cgen::make<cgen::Return>();
+    ret->node = cgen::literal(0);
+    body->push(std::move(ret));
+
+    fn->body = std::move(body);
+    return fn;
+}
+
+// Wide: many independent top-level functions.
+std::unique_ptr<cgen::Program> build_wide(size_t scale)
+{
+    auto program = cgen::make<cgen::Program>();
+    for (size_t f = 0; f < 2000 * scale; f++)
+    {
+        program->push(function(f, 20));
+    }
+    return program;
+}
+
+// Deep: blocks nested inside blocks.
+std::unique_ptr<cgen::Program> build_deep(size_t scale)
+{
+    auto program = cgen::make<cgen::Program>();
+
+    for (size_t f = 0; f < 20 * scale; f++)
+    {
+        auto fn = cgen::make<cgen::Function>();
+        fn->name = "deep" + std::to_string(f);
+        fn->return_type = cgen::i32();
+
+        std::unique_ptr<cgen::Node> inner = cgen::make<cgen::Block>();
+        for (size_t depth = 0; depth < 500; depth++)
+        {
+            auto outer = cgen::make<cgen::Block>();
+            outer->push(cgen::decl_local("v" + std::to_string(depth), cgen::i64()));
+            outer->push(std::move(inner));
+            inner = std::move(outer);
+        }
+
+        fn->body = std::move(inner);
+        program->push(std::move(fn));
+    }
+
+    return program;
+}
+
+// Many-argument calls.
+std::unique_ptr<cgen::Program> build_calls(size_t scale)
+{
+    auto program = cgen::make<cgen::Program>();
+
+    for (size_t f = 0; f < 200 * scale; f++)
+    {
+        auto fn = cgen::make<cgen::Function>();
+        fn->name = "calls" + std::to_string(f);
+        fn->return_type = cgen::i32();
+
+        auto body = cgen::make<cgen::Block>();
+        for (size_t s = 0; s < 10; s++)
+        {
+            auto c = cgen::make<cgen::Call>();
+            c->node = cgen::local("sink");
+            for (size_t a = 0; a < 100; a++)
+            {
+                c->nodes.push_back(a % 2 ? cgen::literal((long)a) : cgen::local("x"));
+            }
+            body->push(std::move(c));
+        }
+
+        fn->body = std::move(body);
+        program->push(std::move(fn));
+    }
+
+    return program;
+}
+
+// Structs with many fields.
+std::unique_ptr<cgen::Program> build_structs(size_t scale)
+{
+    auto program = cgen::make<cgen::Program>();
+
+    for (size_t t = 0; t < 200 * scale; t++)
+    {
+        auto type = cgen::make<cgen::DeclType>();
+        type->name = "S" + std::to_string(t);
+        for (size_t f = 0; f < 200; f++)
+        {
+            type->fields.push_back(cgen::decl_local("m" + std::to_string(f), f % 3 ? cgen::u32() : cgen::array_of(cgen::f64(), 4)));
+        }
+        program->push(std::move(type));
+    }
+
+    return program;
+}
+
+void report(const char *name, const char *mode, size_t nodes, double build, size_t build_allocs, size_t bytes, double emit)
+{
+    std::cout << std::left << std::setw(10) << name << std::setw(7) << mode
+              << std::right << std::fixed << std::setprecision(2)
+              << std::setw(10) << nodes / 1e6 << " Mnodes"
+              << std::setw(10) << nodes / build / 1e6 << " Mnodes/s"
+              << std::setw(8) << (double)build_allocs / nodes << " allocs/node"
+              << std::setw(10) << bytes / emit / 1e6 << " MB/s emitted"
+              << std::setw(10) << peak_rss_kb() / 1024.0 << " MB peak RSS"
+              << std::endl;
+}
+
+void bench_scenario(const char *name, std::function<std::unique_ptr<cgen::Program>(size_t)> build, size_t scale)
+{
+    size_t nodes = 0;
+    size_t bytes = 0;
+
+    for (const char *mode : {"heap", "arena"})
+    {
+        bool use_arena = mode[0] == 'a';
+        cgen::Arena arena;
+        std::unique_ptr<cgen::Program> program;
+        size_t build_allocs = 0;
+
+        double build_time = measure([&]
+                                    {
+                                        program.reset();
+                                        arena.reset();
+                                        size_t before = allocations;
+                                        if (use_arena)
+                                        {
+                                            cgen::ArenaScope scope(arena);
+                                            program = build(scale);
+                                        }
+                                        else
+                                        {
+                                            program = build(scale);
+                                        }
+                                        build_allocs = allocations - before; },
+                                    3);
+
+        nodes = count_nodes(program.get());
+
+        cgen::CodeGenVisitor visitor;
+        std::string out;
+        double emit_time = measure([&]
+                                   { out.clear(); cgen::StringSink sink(out); visitor.emit(program.get(), sink); });
+        bytes = out.size();
+
+        report(name, mode, nodes, build_time, build_allocs, bytes, emit_time);
+        program.reset();
+    }
+}
+
+// Counts nodes through Node::accept -> Visitor::visit, two virtual calls per node.
+class VirtualCounter : public cgen::Visitor
+{
+public:
+    size_t count = 0;
+
+    cgen::AcceptResult visit(cgen::Node *) override
+    {
+        count++;
+        return {};
+    }
+
+    cgen::AcceptResult visit(cgen::Program *node) override
+    {
+        count++;
+        for (auto &n : node->nodes)
+            n->accept(this);
+        return {};
+    }
+
+    cgen::AcceptResult visit(cgen::Primitive *) override { return count++, cgen::AcceptResult(); }
+    cgen::AcceptResult visit(cgen::Type *) override { return count++, cgen::AcceptResult(); }
+    cgen::AcceptResult visit(cgen::Local *) override { return count++, cgen::AcceptResult(); }
+
+    cgen::AcceptResult visit(cgen::PointerOf *node) override { return count++, node->node->accept(this); }
+    cgen::AcceptResult visit(cgen::ArrayOf *node) override { return count++, node->node->accept(this); }
+    cgen::AcceptResult visit(cgen::Static *node) override { return count++, node->node->accept(this); }
+    cgen::AcceptResult visit(cgen::DeclLocal *node) override { return count++, node->type->accept(this); }
+    cgen::AcceptResult visit(cgen::Return *node) override { return count++, node->node->accept(this); }
+    cgen::AcceptResult visit(cgen::Field *node) override { return count++, node->type->accept(this); }
+    cgen::AcceptResult visit(cgen::Deref *node) override { return count++, node->node->accept(this); }
+    cgen::AcceptResult visit(cgen::GetRef *node) override { return count++, node->node->accept(this); }
+
+    cgen::AcceptResult visit(cgen::Assign *node) override
+    {
+        count++;
+        node->lhs->accept(this);
+        node->rhs->accept(this);
+        return {};
+    }
+
+    cgen::AcceptResult visit(cgen::Block *node) override
+    {
+        count++;
+        for (auto &n : node->nodes)
+            n->accept(this);
+        return {};
+    }
+
+    cgen::AcceptResult visit(cgen::Function *node) override
+    {
+        count++;
+        node->return_type->accept(this);
+        for (auto &n : node->parameters)
+            n->accept(this);
+        node->body->accept(this);
+        return {};
+    }
+
+    cgen::AcceptResult visit(cgen::DeclType *node) override
+    {
+        count++;
+        for (auto &n : node->fields)
+            n->accept(this);
+        return {};
+    }
+
+    cgen::AcceptResult visit(cgen::Call *node) override
+    {
+        count++;
+        node->node->accept(this);
+        for (auto &n : node->nodes)
+            n->accept(this);
+        return {};
+    }
+};
+
+// Same walk through StaticVisitor: one switch per node, leaves inline.
+class StaticCounter : public cgen::StaticVisitor<StaticCounter>
+{
+public:
+    size_t count = 0;
+
+    void visit(cgen::Node *) { count++; }
+
+    void visit(cgen::Program *node)
+    {
+        count++;
+        for (auto &n : node->nodes)
+            dispatch(n.get());
+    }
+
+    void visit(cgen::PointerOf *node) { count++, dispatch(node->node.get()); }
+    void visit(cgen::ArrayOf *node) { count++, dispatch(node->node.get()); }
+    void visit(cgen::Static *node) { count++, dispatch(node->node.get()); }
+    void visit(cgen::DeclLocal *node) { count++, dispatch(node->type.get()); }
+    void visit(cgen::Return *node) { count++, dispatch(node->node.get()); }
+    void visit(cgen::Field *node) { count++, dispatch(node->type.get()); }
+    void visit(cgen::Deref *node) { count++, dispatch(node->node.get()); }
+    void visit(cgen::GetRef *node) { count++, dispatch(node->node.get()); }
+
+    void visit(cgen::Assign *node)
+    {
+        count++;
+        dispatch(node->lhs.get());
+        dispatch(node->rhs.get());
+    }
+
+    void visit(cgen::Block *node)
+    {
+        count++;
+        for (auto &n : node->nodes)
+            dispatch(n.get());
+    }
+
+    void visit(cgen::Function *node)
+    {
+        count++;
+        dispatch(node->return_type.get());
+        for (auto &n : node->parameters)
+            dispatch(n.get());
+        dispatch(node->body.get());
+    }
+
+    void visit(cgen::DeclType *node)
+    {
+        count++;
+        for (auto &n : node->fields)
+            dispatch(n.get());
+    }
+
+    void visit(cgen::Call *node)
+    {
+        count++;
+        dispatch(node->node.get());
+        for (auto &n : node->nodes)
+            dispatch(n.get());
+    }
+};
+
+void bench_dispatch(size_t scale)
+{
+    auto program = build_wide(scale * 5);
+
+    VirtualCounter virtual_counter;
+    double virtual_time = measure([&]
+                                  { virtual_counter.count = 0; program->accept(&virtual_counter); });
+
+    StaticCounter static_counter;
+    double static_time = measure([&]
+                                 { static_counter.count = 0; static_counter.dispatch(program.get()); });
+
+    size_t nodes = static_counter.count;
+    std::cout << "dispatch   virtual Visitor " << nodes / virtual_time / 1e6 << " Mnodes/s, "
+              << "StaticVisitor " << nodes / static_time / 1e6 << " Mnodes/s" << std::endl;
+}
+
+// Serial, parallel through per-chunk strings, and parallel in place; then
+// a program dominated by one function, across thread counts.
+void bench_parallel(size_t scale)
+{
+    auto program = build_wide(scale * 5);
+    cgen::CodeGenVisitor visitor;
+    std::string out;
+
+    double serial = measure([&]
+                            { out.clear(); cgen::StringSink sink(out); visitor.emit(program.get(), sink); });
+    double sized = measure([&]
+                           { out.clear(); out.shrink_to_fit(); visitor.emit_sized(program.get(), out); });
+    double chunked = measure([&]
+                             { out.clear(); cgen::StringSink sink(out); visitor.emit_parallel(program.get(), sink); });
+    double in_place = measure([&]
+                              { out.clear(); out.shrink_to_fit(); visitor.emit_parallel(program.get(), out); });
+
+    std::cout << "parallel   serial " << out.size() / serial / 1e6 << " MB/s, sized " << out.size() / sized / 1e6
+              << " MB/s, chunked " << out.size() / chunked / 1e6 << " MB/s, in place " << out.size() / in_place / 1e6
+              << " MB/s" << std::endl;
+
+    // Unbalanced: a few small functions and one holding nearly all the work.
+    auto unbalanced = cgen::make<cgen::Program>();
+    for (size_t f = 0; f < 16; f++)
+    {
+        unbalanced->push(function(f, 20));
+    }
+    unbalanced->push(function(16, 40000 * scale));
+
+    serial = measure([&]
+                     { out.clear(); cgen::StringSink sink(out); visitor.emit(unbalanced.get(), sink); });
+    std::cout << "parallel   unbalanced serial " << out.size() / serial / 1e6 << " MB/s";
+    for (unsigned threads : {2u, 4u, 0u})
+    {
+        double time = measure([&]
+                              { out.clear(); out.shrink_to_fit(); visitor.emit_parallel(unbalanced.get(), out, threads); });
+        std::cout << ", " << (threads ? std::to_string(threads) + "t " : "all ") << out.size() / time / 1e6 << " MB/s";
+    }
+    std::cout << std::endl;
+}
+
+// Pointer tree vs. FlatTree: memory, a full walk, and emission.
+void bench_flat(size_t scale)
+{
+    cgen::Arena arena;
+    std::unique_ptr<cgen::Program> program;
+    size_t heap_before = allocated_bytes;
+    {
+        cgen::ArenaScope scope(arena);
+        program = build_wide(scale * 5);
+    }
+    // Bytes allocated while building (child vectors, including growth) plus
+    // the nodes in the arena.
+    size_t tree_bytes = allocated_bytes - heap_before + arena.bytes_used();
+
+    cgen::FlatTree flat(program.get());
+    auto view = flat.view();
+
+    StaticCounter tree_counter;
+    double tree_walk = measure([&]
+                               { tree_counter.count = 0; tree_counter.dispatch(program.get()); });
+
+    size_t flat_count = 0;
+    double flat_walk = measure([&]
+                               {
+                                   std::vector<cgen::FlatView::Index> stack{view.root};
+                                   flat_count = 0;
+                                   while (!stack.empty())
+                                   {
+                                       auto node = stack.back();
+                                       stack.pop_back();
+                                       flat_count++;
+                                       for (auto child : view.children_of(node))
+                                           if (child != cgen::FlatView::none)
+                                               stack.push_back(child);
+                                   } });
+
+    cgen::CodeGenVisitor visitor;
+    std::string out;
+    double tree_emit = measure([&]
+                               { out.clear(); cgen::StringSink sink(out); visitor.emit(program.get(), sink); });
+    double flat_emit = measure([&]
+                               { out.clear(); cgen::StringSink sink(out); view.emit(sink); });
+
+    std::cout << "flat       " << flat.size() / 1e6 << " Mnodes, tree " << tree_bytes / 1e6
+              << " MB vs flat " << flat.memory_used() / 1e6 << " MB, walk "
+              << tree_counter.count / tree_walk / 1e6 << " vs " << flat_count / flat_walk / 1e6 << " Mnodes/s, emit "
+              << out.size() / tree_emit / 1e6 << " vs " << out.size() / flat_emit / 1e6 << " MB/s" << std::endl;
+}
+
+// Specializing one template function by rebuilding, cloning, and sharing
+// everything but the renamed root.
+void bench_variants(size_t scale)
+{
+    size_t count = 2000 * scale;
+    auto base = function(0, 20);
+    std::unique_ptr<cgen::Program> program;
+
+    auto run = [&](auto make_variant)
+    {
+        size_t before = allocations;
+        double time = measure([&]
+                              {
+                                  program = cgen::make<cgen::Program>();
+                                  for (size_t v = 0; v < count; v++)
+                                      program->push(make_variant(v));
+                              });
+        return std::make_pair(time, double(allocations - before) / 5 / count);
+    };
+
+    auto rebuilt = run([&](size_t v)
+                       { return function(v, 20); });
+    auto cloned = run([&](size_t v)
+                      {
+                          auto copy = cgen::clone(base.get());
+                          copy->as<cgen::Function>()->name = "f" + std::to_string(v);
+                          return copy; });
+    auto shared = run([&](size_t v)
+                      {
+                          auto variant = cgen::share(base.get());
+                          cgen::mutate(variant)->as<cgen::Function>()->name = "f" + std::to_string(v);
+                          return variant; });
+    program.reset();
+
+    std::cout << "variants   rebuild " << rebuilt.first * 1e3 << " ms (" << rebuilt.second << " allocs/variant), clone "
+              << cloned.first * 1e3 << " ms (" << cloned.second << "), share " << shared.first * 1e3 << " ms ("
+              << shared.second << ")" << std::endl;
+}
+
+// Building one program from 1..N producer threads through ProgramBuilder.
+void bench_producers(size_t scale)
+{
+    size_t count = 10000 * scale;
+    unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+
+    std::cout << "producers ";
+    for (unsigned threads = 1; threads <= hardware; threads *= 2)
+    {
+        std::unique_ptr<cgen::Program> program;
+        double time = measure([&]
+                              {
+                                  program.reset();
+                                  cgen::ProgramBuilder builder;
+                                  std::vector<std::thread> workers;
+                                  for (unsigned t = 0; t < threads; t++)
+                                  {
+                                      workers.emplace_back([&, t]
+                                                           {
+                                                               auto &producer = builder.producer();
+                                                               auto scope = producer.scope();
+                                                               for (size_t f = t; f < count; f += threads)
+                                                                   producer.attach(f, function(f, 20));
+                                                           });
+                                  }
+                                  for (auto &worker : workers)
+                                      worker.join();
+                                  program = builder.build();
+                              });
+        std::cout << " " << threads << "t " << count_nodes(program.get()) / time / 1e6 << " Mnodes/s";
+    }
+    std::cout << std::endl;
+}
+
+// Callers of one function: a walk of the whole program per query, against
+// the symbol index (built once, then a lookup per query).
+void bench_symbols(size_t scale)
+{
+    auto program = build_wide(scale);
+    const std::string name = "g";
+
+    size_t walked = 0;
+    double walk = measure([&]
+                          {
+                              walked = 0;
+                              std::vector<cgen::Node *> stack{program.get()};
+                              while (!stack.empty())
+                              {
+                                  cgen::Node *node = stack.back();
+                                  stack.pop_back();
+                                  if (auto call = node->as<cgen::Call>(); call && call->node && call->node->is<cgen::Local>() &&
+                                                                           call->node->cast<cgen::Local>()->name == name)
+                                      walked++;
+                                  cgen::for_each_child(node, [&](std::unique_ptr<cgen::Node> &child)
+                                                       { if (child) stack.push_back(child.get()); });
+                              } });
+
+    double build = measure([&]
+                           { program->index_symbols(); });
+
+    size_t found = 0;
+    cgen::Symbol symbol(name);
+    double lookup = measure([&]
+                            { found = program->symbols->lookup(symbol).calls.size(); });
+
+    std::cout << "symbols    walk " << walk * 1e3 << " ms, index build " << build * 1e3 << " ms, lookup "
+              << lookup * 1e9 << " ns (" << found << "/" << walked << " calls)" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    size_t scale = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1;
+    std::string only = argc > 2 ? argv[2] : "";
+
+    auto run = [&](const char *name, auto build)
+    {
+        if (only.empty() || only == name)
+            bench_scenario(name, build, scale);
+    };
+
+    run("wide", build_wide);
+    run("deep", build_deep);
+    run("calls", build_calls);
+    run("structs", build_structs);
+
+    if (only.empty() || only == "dispatch")
+        bench_dispatch(scale);
+
+    if (only.empty() || only == "parallel")
+        bench_parallel(scale);
+
+    if (only.empty() || only == "flat")
+        bench_flat(scale);
+
+    if (only.empty() || only == "variants")
+        bench_variants(scale);
+
+    if (only.empty() || only == "producers")
+        bench_producers(scale);
+
+    if (only.empty() || only == "symbols")
+        bench_symbols(scale);
+
+#ifdef CGEN_INSTRUMENTATION
+    // Build with -DCGEN_INSTRUMENTATION for a per node kind breakdown.
+    cgen::StreamSink report_sink(std::cout);
+    cgen::Instrumentation::global().write_json(report_sink);
+    std::cout << std::endl;
+#endif
+
+}
@@ -1,655 +1,7330 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <algorithm>
 #include <sstream>
+#include <ostream>
 #include <memory>
+#include <memory_resource>
+#include <new>
 #include <vector>
+#include <span>
+#include <bit>
+#include <optional>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <deque>
+#include <iterator>
+#include <thread>
+#include <unordered_map>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
 
 namespace cgen
 {
     class Visitor;
     using AcceptResult = std::string;
 
-    class Node
+    class Sink
     {
     public:
-        virtual AcceptResult accept(Visitor *visitor);
+        virtual ~Sink() = default;
+        virtual void write(const char *data, size_t size) = 0;
 
-        template <typename T>
-        inline T *as()
+        inline Sink &operator<<(std::string_view text)
+        {
+            write(text.data(), text.size());
+            return *this;
+        }
+
+        inline Sink &operator<<(char c)
+        {
+            write(&c, 1);
+            return *this;
+        }
+
+        inline Sink &operator<<(size_t value)
         {
-            return dynamic_cast<T *>(this);
+            char buffer[24];
+            auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+            write(buffer, result.ptr - buffer);
+            return *this;
         }
     };
 
-    class Program : public Node
+    class StringSink : public Sink
     {
     public:
-        std::vector<std::unique_ptr<Node>> nodes;
+        std::string &out;
 
-        AcceptResult accept(Visitor *visitor) override;
+        explicit StringSink(std::string &out) : out(out) {}
 
-        void push(std::unique_ptr<Node> node)
+        void write(const char *data, size_t size) override
         {
-            nodes.push_back(std::move(node));
+            out.append(data, size);
         }
     };
 
-    class PointerOf : public Node
+    // Counts bytes and drops them; used to size output before writing it.
+    class CountingSink final : public Sink
     {
     public:
-        std::unique_ptr<Node> node;
-        AcceptResult accept(Visitor *visitor) override;
-    };
+        size_t count = 0;
 
-    class ArrayOf : public Node
-    {
-    public:
-        std::unique_ptr<Node> node;
-        size_t size = 0;
-        AcceptResult accept(Visitor *visitor) override;
+        inline void write(const char *, size_t size) override { count += size; }
     };
 
-    class Primitive : public Node
+    // Writes into a fixed region, typically one sized by a counting pass.
+    class SpanSink final : public Sink
     {
     public:
-        enum Kind
-        {
-            i8,
-            i16,
-            i32,
-            i64,
-            u8,
-            u16,
-            u32,
-            u64,
-            f32,
-            f64,
-        } kind;
+        char *data;
+        size_t capacity;
+        size_t used = 0;
 
-        Primitive(Kind kind) : kind(kind) {}
+        SpanSink(char *data, size_t capacity) : data(data), capacity(capacity) {}
 
-        AcceptResult accept(Visitor *visitor) override;
+        inline void write(const char *bytes, size_t size) override
+        {
+            assert(used + size <= capacity && "output grew between measuring and writing");
+            size = std::min(size, capacity - used);
+            std::memcpy(data + used, bytes, size);
+            used += size;
+        }
     };
 
-    class Type : public Node
+    class StreamSink : public Sink
     {
     public:
-        std::string name;
-        AcceptResult accept(Visitor *visitor) override;
+        std::ostream &out;
 
-        inline std::unique_ptr<PointerOf> pointer_of()
-        {
-            auto ptr = std::make_unique<PointerOf>();
-            ptr->node = std::move(std::unique_ptr<Node>(this));
-            return ptr;
-        }
+        explicit StreamSink(std::ostream &out) : out(out) {}
 
-        inline std::unique_ptr<ArrayOf> array_of(size_t size = 0)
+        void write(const char *data, size_t size) override
         {
-            auto arr = std::make_unique<ArrayOf>();
-            arr->node = std::move(std::unique_ptr<Node>(this));
-            arr->size = size;
-            return arr;
+            out.write(data, size);
         }
     };
 
-    class Static : public Node
+    class FileSink : public Sink
     {
     public:
-        std::unique_ptr<Node> node;
-        AcceptResult accept(Visitor *visitor) override;
+        FILE *file;
+
+        explicit FileSink(FILE *file) : file(file) {}
+
+        void write(const char *data, size_t size) override;
+
+        // True once a write has failed, or the stream is in error (which
+        // may only show after the caller flushes it). Later writes are
+        // dropped.
+        inline bool failed() const { return error || ferror(file); }
+
+    private:
+        bool error = false;
     };
 
-    template <typename T>
-    class Literal : public Node
+    // Buffers writes to a raw file descriptor; flushed on destruction.
+    class FdSink : public Sink
     {
     public:
-        T value;
-        AcceptResult accept(Visitor *visitor) override
-        {
-            return std::to_string(value);
-        }
+        int fd;
+
+        explicit FdSink(int fd) : fd(fd) {}
+        ~FdSink() override { flush(); }
+
+        void write(const char *data, size_t size) override;
+        void flush();
+
+        // True once a write has failed (interrupted ones are retried);
+        // everything from then on is dropped.
+        inline bool failed() const { return error; }
+
+    private:
+        char buffer[1 << 16];
+        size_t used = 0;
+        bool error = false;
     };
 
-    template <>
-    class Literal<std::string> : public Node
+    // Streams to a file it owns through a fixed-size buffer, so memory stays
+    // bounded however large the output gets. A write that overflows the
+    // buffer goes out together with it in one writev.
+    class FileWriter : public Sink
     {
     public:
-        std::string value;
-        AcceptResult accept(Visitor *visitor) override
-        {
-            return "\"" + value + "\"";
-        }
+        explicit FileWriter(const char *path, size_t buffer_size = 1 << 20);
+        ~FileWriter() override { close(); }
+
+        FileWriter(const FileWriter &) = delete;
+        FileWriter &operator=(const FileWriter &) = delete;
+
+        void write(const char *data, size_t size) override;
+        void flush();
+        void close();
+
+        // False once opening or any write has failed.
+        inline bool ok() const { return fd >= 0 && !error; }
+        inline bool failed() const { return !ok(); }
+        inline size_t bytes_written() const { return written; }
+
+    private:
+        int fd = -1;
+        bool error = false;
+        size_t written = 0;
+        std::unique_ptr<char[]> buffer;
+        size_t capacity;
+        size_t used = 0;
+
+        void write_all(const char *head, size_t head_size, const char *tail, size_t tail_size);
     };
 
-    template <>
-    class Literal<char> : public Node
+    // Batches many small writes (one per table element, say) into few writes
+    // to the wrapped sink. final, so calls through it are devirtualized.
+    class BufferedSink final : public Sink
     {
     public:
-        char value;
-        AcceptResult accept(Visitor *visitor) override
+        Sink &out;
+
+        explicit BufferedSink(Sink &out) : out(out) {}
+        ~BufferedSink() override { flush(); }
+
+        inline void write(const char *data, size_t size) override
         {
-            return "'" + std::string(1, value) + "'";
+            if (used + size > sizeof(buffer))
+            {
+                flush();
+                if (size > sizeof(buffer))
+                {
+                    out.write(data, size);
+                    return;
+                }
+            }
+
+            std::memcpy(buffer + used, data, size);
+            used += size;
         }
-    };
 
-    class DeclLocal : public Node
-    {
-    public:
-        std::string name;
-        std::unique_ptr<Node> type;
+        // Reserves size contiguous bytes (at most 4096) to fill in place.
+        inline char *reserve(size_t size)
+        {
+            if (used + size > sizeof(buffer))
+            {
+                flush();
+            }
+            return buffer + used;
+        }
 
-        AcceptResult accept(Visitor *visitor) override;
-    };
+        inline void commit(size_t size) { used += size; }
 
-    class Assign : public Node
-    {
-    public:
-        std::unique_ptr<Node> lhs;
-        std::unique_ptr<Node> rhs;
+        inline void flush()
+        {
+            if (used > 0)
+            {
+                out.write(buffer, used);
+                used = 0;
+            }
+        }
 
-        AcceptResult accept(Visitor *visitor) override;
+    private:
+        char buffer[1 << 14];
+        size_t used = 0;
     };
 
-    class Block : public Node
+    class SymbolTable;
+
+    // Interned identifier: a pointer to a table entry, so copies are free and
+    // equality is a pointer compare. The empty symbol has no entry.
+    class Symbol
     {
     public:
-        std::vector<std::unique_ptr<Node>> nodes;
+        struct Entry
+        {
+            uint32_t id;
+            uint32_t size;
+            const char *data;
+        };
 
-        AcceptResult accept(Visitor *visitor) override;
+        Symbol() = default;
+        Symbol(std::string_view name);
+        Symbol(const char *name) : Symbol(std::string_view(name)) {}
+        Symbol(const std::string &name) : Symbol(std::string_view(name)) {}
 
-        void push(std::unique_ptr<Node> node)
+        inline std::string_view view() const
         {
-            nodes.push_back(std::move(node));
+            return entry ? std::string_view(entry->data, entry->size) : std::string_view();
         }
+
+        inline operator std::string_view() const { return view(); }
+        inline std::string str() const { return std::string(view()); }
+
+        inline const char *data() const { return entry ? entry->data : ""; }
+        inline size_t size() const { return entry ? entry->size : 0; }
+        inline bool empty() const { return entry == nullptr; }
+        inline uint32_t id() const { return entry ? entry->id : 0; }
+
+        inline bool operator==(const Symbol &other) const { return entry == other.entry; }
+        inline bool operator==(std::string_view other) const { return view() == other; }
+        inline bool operator==(const char *other) const { return view() == other; }
+        inline bool operator==(const std::string &other) const { return view() == other; }
+
+    private:
+        friend class SymbolTable;
+
+        const Entry *entry = nullptr;
+
+        explicit Symbol(const Entry *entry) : entry(entry) {}
     };
+} // namespace cgen
 
-    class Function : public Node
+template <>
+struct std::hash<cgen::Symbol>
+{
+    inline size_t operator()(const cgen::Symbol &symbol) const noexcept
     {
-    public:
-        std::string name;
-        std::vector<std::unique_ptr<Node>> parameters;
-        std::unique_ptr<Node> return_type;
-        std::unique_ptr<Node> body;
+        return std::hash<const void *>()(symbol.data());
+    }
+};
 
-        AcceptResult accept(Visitor *visitor) override;
-    };
+namespace cgen
+{
 
-    class Return : public Node
+    enum class NodeKind : uint8_t
     {
-    public:
-        std::unique_ptr<Node> node;
-        AcceptResult accept(Visitor *visitor) override;
+        Custom,
+        Program,
+        PointerOf,
+        ArrayOf,
+        Primitive,
+        Type,
+        Static,
+        Literal,
+        DeclLocal,
+        Assign,
+        Block,
+        Function,
+        Return,
+        Field,
+        DeclType,
+        Deref,
+        GetRef,
+        Local,
+        Call,
+        ArrayInit,
+        BinaryOp,
+        UnaryOp,
+        Index,
+        Cast,
     };
 
-    class Field : public Node
+    // Keep in step with the last NodeKind.
+    constexpr size_t node_kind_count = size_t(NodeKind::Cast) + 1;
+
+    std::string_view kind_name(NodeKind kind);
+
+    class Node
     {
     public:
-        std::unique_ptr<Node> type;
-        std::string name;
-        AcceptResult accept(Visitor *visitor) override;
+        enum Flags : uint8_t
+        {
+            ArenaOwned = 1 << 0,
+            Interned = 1 << 1,
+            Dirty = 1 << 2,
+            Shared = 1 << 3,
+        };
+
+        const NodeKind node_kind;
+        uint8_t flags = 0;
+
+        // Owners beyond the first, for nodes made Shared by share(); only
+        // accessed atomically.
+        uint32_t shares = 0;
+
+        // Set by push(), the builders and link_parents(); interned and
+        // shared nodes have more than one owner and no parent.
+        Node *parent = nullptr;
+
+        Node() : node_kind(NodeKind::Custom) {}
+        virtual ~Node() = default;
+        virtual AcceptResult accept(Visitor *visitor);
+
+        // Custom nodes override this to take part in clone() and mutate();
+        // the default leaves the slot empty.
+        virtual std::unique_ptr<Node> copy() const { return nullptr; }
+
+        // Flags this node and its ancestors as changed since they were last
+        // emitted by an IncrementalEmitter.
+        inline void mark_dirty()
+        {
+            for (Node *node = this; node != nullptr; node = node->parent)
+            {
+                node->flags |= Dirty;
+            }
+        }
+
+        // Arena-owned nodes are destroyed by their arena, so deleting one
+        // through a unique_ptr only drops the reference.
+        // Shared nodes are destroyed by their last owner.
+        // Past a fixed nesting depth, deletes are queued and run by the
+        // outermost one, so tearing down a deep tree cannot overflow the
+        // stack.
+        static inline void operator delete(Node *node, std::destroying_delete_t)
+        {
+            if (node->flags & ArenaOwned)
+            {
+                return;
+            }
+
+            if ((node->flags & Shared) && std::atomic_ref<uint32_t>(node->shares).fetch_sub(1, std::memory_order_acq_rel) != 0)
+            {
+                return;
+            }
+
+            static thread_local unsigned depth = 0;
+            static thread_local std::vector<Node *> deferred;
+
+            if (depth >= 256)
+            {
+                deferred.push_back(node);
+                return;
+            }
+
+            depth++;
+            node->~Node();
+            ::operator delete(node);
+
+            while (depth == 1 && !deferred.empty())
+            {
+                Node *next = deferred.back();
+                deferred.pop_back();
+                next->~Node();
+                ::operator delete(next);
+            }
+            depth--;
+        }
+
+        template <typename T>
+        inline bool is() const
+        {
+            if constexpr (std::is_same_v<T, Node>)
+            {
+                return true;
+            }
+            else
+            {
+                return T::classof(this);
+            }
+        }
+
+        template <typename T>
+        inline T *as()
+        {
+            return is<T>() ? static_cast<T *>(this) : nullptr;
+        }
+
+        template <typename T>
+        inline const T *as() const
+        {
+            return is<T>() ? static_cast<const T *>(this) : nullptr;
+        }
+
+        template <typename T>
+        inline T *cast()
+        {
+            assert(is<T>());
+            return static_cast<T *>(this);
+        }
+
+        template <typename T>
+        inline const T *cast() const
+        {
+            assert(is<T>());
+            return static_cast<const T *>(this);
+        }
+
+    protected:
+        explicit Node(NodeKind kind) : node_kind(kind) {}
     };
 
-    class DeclType : public Node
+#define __CGEN_CLASSOF(name)                             \
+    static inline bool classof(const Node *node)         \
+    {                                                    \
+        return node->node_kind == NodeKind::name;        \
+    }
+
+#define __CGEN_NODE(name)                                \
+    name() : Node(NodeKind::name) {}                     \
+    __CGEN_CLASSOF(name)
+
+    // Also a memory_resource: the child lists of nodes it creates allocate
+    // from it too, so reset() recycles their storage along with the nodes.
+    class Arena : public std::pmr::memory_resource
     {
     public:
-        std::string name;
-        std::vector<std::unique_ptr<Node>> fields;
-        AcceptResult accept(Visitor *visitor) override;
+        explicit Arena(size_t block_size = 64 * 1024) : block_size(block_size) {}
+        ~Arena() { reset(); }
+
+        Arena(const Arena &) = delete;
+        Arena &operator=(const Arena &) = delete;
+
+        void *allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+        template <typename T, typename... Args>
+        inline T *create(Args &&...args)
+        {
+            static_assert(std::is_base_of_v<Node, T> || std::is_trivially_destructible_v<T>,
+                          "arena only runs destructors for nodes");
+
+            void *memory = allocate(sizeof(T), alignof(T));
+            T *object;
+
+            if constexpr (std::is_base_of_v<Node, T>)
+            {
+                Arena *previous = building;
+                building = this;
+                object = new (memory) T(std::forward<Args>(args)...);
+                building = previous;
+
+                object->flags |= Node::ArenaOwned;
+                nodes.push_back(object);
+            }
+            else
+            {
+                object = new (memory) T(std::forward<Args>(args)...);
+            }
+
+            return object;
+        }
+
+        // Where a node under construction should put its child lists.
+        static inline std::pmr::memory_resource *resource()
+        {
+            return building != nullptr ? building : std::pmr::new_delete_resource();
+        }
+
+        // Makes room for size bytes in one block, so the next allocations
+        // that add up to it do not each claim a block.
+        void reserve(size_t size);
+
+        // Destroys every node and rewinds; blocks are kept for reuse.
+        void reset();
+
+        size_t bytes_used() const { return used; }
+
+    private:
+        struct Block
+        {
+            std::unique_ptr<char[]> data;
+            size_t size;
+        };
+
+        size_t block_size;
+        std::vector<Block> blocks;
+        std::vector<Node *> nodes;
+        size_t current = 0;
+        size_t offset = 0;
+        size_t used = 0;
+
+        static inline thread_local Arena *building = nullptr;
+
+        // Freed storage is reclaimed by reset(), not reused in between.
+        void *do_allocate(size_t size, size_t alignment) override { return allocate(size, alignment); }
+        void do_deallocate(void *, size_t, size_t) override {}
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
     };
 
-    class Deref : public Node
+    // Child list of a node; allocates from the node's arena, if it has one.
+    using NodeList = std::pmr::vector<std::unique_ptr<Node>>;
+
+    template <typename T>
+    class Scope
     {
     public:
-        std::unique_ptr<Node> node;
-        AcceptResult accept(Visitor *visitor) override;
+        explicit Scope(T &value) : previous(slot()) { slot() = &value; }
+        ~Scope() { slot() = previous; }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+        static inline T *current() { return slot(); }
+
+    private:
+        T *previous;
+
+        static inline T *&slot()
+        {
+            thread_local T *value = nullptr;
+            return value;
+        }
     };
 
-    class GetRef : public Node
+    using ArenaScope = Scope<Arena>;
+
+    // Safe to share between threads: names are spread over shards by hash,
+    // each with its own lock and storage, and lookup() takes no lock.
+    class SymbolTable
     {
     public:
-        std::unique_ptr<Node> node;
-        AcceptResult accept(Visitor *visitor) override;
+        SymbolTable() = default;
+        ~SymbolTable();
+
+        SymbolTable(const SymbolTable &) = delete;
+        SymbolTable &operator=(const SymbolTable &) = delete;
+
+        Symbol intern(std::string_view name);
+
+        // Ids start at 1; 0 is the empty symbol.
+        Symbol lookup(uint32_t id) const;
+        size_t size() const;
+
+        static SymbolTable &global();
+
+        // The table bound by a SymbolScope on this thread, else the global one.
+        static inline SymbolTable &current()
+        {
+            SymbolTable *table = Scope<SymbolTable>::current();
+            return table ? *table : global();
+        }
+
+    private:
+        static constexpr size_t shard_count = 16;
+
+        struct alignas(64) Shard
+        {
+            std::mutex mutex;
+            Arena storage;
+            std::unordered_map<std::string_view, const Symbol::Entry *> index;
+        };
+
+        using Slot = std::atomic<const Symbol::Entry *>;
+
+        Shard shards[shard_count];
+        std::atomic<uint32_t> next{1};
+
+        // Id i lives in segment bit_width(i) - 1, which holds 2^k ids, so
+        // segments never move once published.
+        mutable std::atomic<Slot *> segments[32] = {};
+
+        Slot *slot(uint32_t id, bool create) const;
     };
 
-    class Local : public Node
+    using SymbolScope = Scope<SymbolTable>;
+
+    inline Symbol::Symbol(std::string_view name) : Symbol(SymbolTable::current().intern(name)) {}
+
+#ifdef CGEN_INSTRUMENTATION
+    // Per node kind counters, filled by hooks in make() and CodeGenVisitor
+    // when CGEN_INSTRUMENTATION is defined (and compiled out otherwise).
+    // Bytes and time are inclusive of children; the self_ fields exclude
+    // them. Counters are relaxed atomics, so parallel emits add up.
+    class Instrumentation
     {
     public:
-        std::string name;
-        AcceptResult accept(Visitor *visitor) override;
+        struct Counters
+        {
+            std::atomic<uint64_t> visits{0};
+            std::atomic<uint64_t> bytes{0};
+            std::atomic<uint64_t> self_bytes{0};
+            std::atomic<uint64_t> nanoseconds{0};
+            std::atomic<uint64_t> self_nanoseconds{0};
+            std::atomic<uint64_t> allocations{0};
+            std::atomic<uint64_t> allocated_bytes{0};
+        };
+
+        Counters kinds[node_kind_count];
+
+        static Instrumentation &global();
+
+        inline void allocated(NodeKind kind, size_t size)
+        {
+            kinds[size_t(kind)].allocations.fetch_add(1, std::memory_order_relaxed);
+            kinds[size_t(kind)].allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+        }
+
+        void reset();
+
+        // {"kinds":{"Call":{"visits":...},...}}, kinds never seen omitted.
+        void write_json(Sink &out) const;
     };
+#endif
 
-    class Call : public Node
+    template <typename T, typename... Args>
+    inline std::unique_ptr<T> make(Args &&...args)
     {
-    public:
-        std::unique_ptr<Node> node;
-        std::vector<std::unique_ptr<Node>> nodes;
-        AcceptResult accept(Visitor *visitor) override;
+#ifdef CGEN_INSTRUMENTATION
+        if constexpr (std::is_base_of_v<Node, T>)
+        {
+            std::unique_ptr<T> node;
+            if (Arena *arena = ArenaScope::current())
+                node.reset(arena->create<T>(std::forward<Args>(args)...));
+            else
+                node = std::make_unique<T>(std::forward<Args>(args)...);
+            Instrumentation::global().allocated(node->node_kind, sizeof(T));
+            return node;
+        }
+#endif
+        if (Arena *arena = ArenaScope::current())
+        {
+            return std::unique_ptr<T>(arena->create<T>(std::forward<Args>(args)...));
+        }
+
+        return std::make_unique<T>(std::forward<Args>(args)...);
+    }
+
+    class Local;
+    class Call;
+    class Type;
+    class Field;
+
+    // Where each name is declared and used in a Program, so questions like
+    // "who calls f" or "is struct T used" do not walk the tree. Once a
+    // program has one (Program::index_symbols()), push() on the program or
+    // on a Block linked under it indexes the new subtree. Other edits, such
+    // as assigning a child slot or mutate(), need index_symbols() again;
+    // the optimization passes do that themselves.
+    class SymbolIndex
+    {
+    public:
+        struct Entry
+        {
+            // Function, DeclType and DeclLocal nodes with this name.
+            std::vector<Node *> definitions;
+            // Every Local naming it, and the Calls among those with it as
+            // callee.
+            std::vector<Local *> locals;
+            std::vector<Call *> calls;
+            // Struct types and field accesses by it.
+            std::vector<Type *> types;
+            std::vector<Field *> fields;
+        };
+
+        // An empty entry for names never seen. Entries stay put until
+        // clear(), additions included.
+        const Entry &lookup(Symbol name) const;
+
+        // Indexes every node of the subtree at root.
+        void add(Node *root);
+        void clear() { entries.clear(); }
+
+        size_t size() const { return entries.size(); }
+
+        // Adds node to the index of the program owner belongs to, if any.
+        static void pushed(Node *owner, Node *node);
+
+    private:
+        std::unordered_map<Symbol, Entry> entries;
     };
 
-    class Visitor
+    class Program : public Node
     {
     public:
-        virtual AcceptResult visit(class Node *node) = 0;
-        virtual AcceptResult visit(class Program *node) = 0;
-        virtual AcceptResult visit(class Primitive *node) = 0;
-        virtual AcceptResult visit(class Type *node) = 0;
-        virtual AcceptResult visit(class PointerOf *node) = 0;
-        virtual AcceptResult visit(class ArrayOf *node) = 0;
-        virtual AcceptResult visit(class Static *node) = 0;
-        virtual AcceptResult visit(class DeclLocal *node) = 0;
-        virtual AcceptResult visit(class Block *node) = 0;
-        virtual AcceptResult visit(class Function *node) = 0;
-        virtual AcceptResult visit(class Return *node) = 0;
-        virtual AcceptResult visit(class Assign *node) = 0;
-        virtual AcceptResult visit(class Field *node) = 0;
-        virtual AcceptResult visit(class Deref *node) = 0;
-        virtual AcceptResult visit(class GetRef *node) = 0;
-        virtual AcceptResult visit(class DeclType *node) = 0;
-        virtual AcceptResult visit(class Local *node) = 0;
-        virtual AcceptResult visit(class Call *node) = 0;
+        __CGEN_NODE(Program)
+
+        // Arenas handed over by a ProgramBuilder; declared first so they
+        // outlive the nodes that point into them.
+        std::vector<std::unique_ptr<Arena>> arenas;
+        NodeList nodes{Arena::resource()};
+
+        // Null until index_symbols().
+        std::unique_ptr<SymbolIndex> symbols;
+
+        AcceptResult accept(Visitor *visitor) override;
+
+        void push(std::unique_ptr<Node> node)
+        {
+            if (!(node->flags & (Interned | Shared)))
+            {
+                node->parent = this;
+            }
+            mark_dirty();
+            if (symbols)
+            {
+                symbols->add(node.get());
+            }
+            nodes.push_back(std::move(node));
+        }
+
+        // Indexes the whole program, creating symbols if needed.
+        SymbolIndex &index_symbols();
     };
 
-    class CodeGenVisitor : public Visitor
+    // Builds one Program from several threads. Each thread takes its own
+    // Producer, builds inside producer.scope() so nodes land in the
+    // producer's arena, and attaches top-level nodes without locking.
+    // build() orders them by sequence key, so the result is the same
+    // however the threads interleave; equal keys keep their attach order
+    // within a producer.
+    class ProgramBuilder
     {
     public:
-        AcceptResult visit(Node *node) override;
-        AcceptResult visit(Program *node) override;
-        AcceptResult visit(Primitive *node) override;
-        AcceptResult visit(Type *node) override;
-        AcceptResult visit(PointerOf *node) override;
-        AcceptResult visit(ArrayOf *node) override;
-        AcceptResult visit(Static *node) override;
-        AcceptResult visit(DeclLocal *node) override;
-        AcceptResult visit(Block *node) override;
-        AcceptResult visit(Function *node) override;
-        AcceptResult visit(Return *node) override;
-        AcceptResult visit(Assign *node) override;
-        AcceptResult visit(Field *node) override;
-        AcceptResult visit(Deref *node) override;
-        AcceptResult visit(GetRef *node) override;
-        AcceptResult visit(DeclType *node) override;
-        AcceptResult visit(Local *node) override;
-        AcceptResult visit(Call *node) override;
+        class Producer
+        {
+        public:
+            Producer() : arena(std::make_unique<Arena>()) {}
+
+            inline ArenaScope scope() { return ArenaScope(*arena); }
+
+            inline void attach(uint64_t key, std::unique_ptr<Node> node)
+            {
+                items.emplace_back(key, std::move(node));
+            }
+
+        private:
+            friend class ProgramBuilder;
+
+            std::unique_ptr<Arena> arena;
+            std::vector<std::pair<uint64_t, std::unique_ptr<Node>>> items;
+        };
+
+        // Locks only to register; the reference stays valid until build().
+        Producer &producer();
+
+        // Takes every attached node and the producers' arenas; the builder
+        // is empty afterwards. Not safe while producers are still attaching.
+        std::unique_ptr<Program> build();
+
+    private:
+        std::mutex mutex;
+        std::deque<Producer> producers;
     };
 
-#define __CGEN_PRIMITIVE(name) \
-    inline std::unique_ptr<Node> name() { return std::unique_ptr<Node>((Node *)new Primitive(Primitive::name)); }
+    class PointerOf : public Node
+    {
+    public:
+        __CGEN_NODE(PointerOf)
 
-    __CGEN_PRIMITIVE(i8)
-    __CGEN_PRIMITIVE(i16)
-    __CGEN_PRIMITIVE(i32)
-    __CGEN_PRIMITIVE(i64)
-    __CGEN_PRIMITIVE(u8)
-    __CGEN_PRIMITIVE(u16)
-    __CGEN_PRIMITIVE(u32)
-    __CGEN_PRIMITIVE(u64)
-    __CGEN_PRIMITIVE(f32)
-    __CGEN_PRIMITIVE(f64)
+        std::unique_ptr<Node> node;
+        AcceptResult accept(Visitor *visitor) override;
+    };
 
-    inline std::unique_ptr<Node> pointer_of(std::unique_ptr<Node> node)
+    class ArrayOf : public Node
     {
-        auto ptr = new PointerOf();
-        ptr->node = std::move(node);
-        return std::unique_ptr<Node>((Node *)ptr);
-    }
+    public:
+        __CGEN_NODE(ArrayOf)
 
-    inline std::unique_ptr<Node> array_of(std::unique_ptr<Node> node, size_t size = 0)
+        std::unique_ptr<Node> node;
+        size_t size = 0;
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    class Primitive : public Node
     {
-        auto arr = new ArrayOf();
-        arr->node = std::move(node);
-        arr->size = size;
-        return std::unique_ptr<Node>((Node *)arr);
-    }
+    public:
+        __CGEN_CLASSOF(Primitive)
+
+        enum Kind
+        {
+            i8,
+            i16,
+            i32,
+            i64,
+            u8,
+            u16,
+            u32,
+            u64,
+            f32,
+            f64,
+        } kind;
+
+        Primitive(Kind kind) : Node(NodeKind::Primitive), kind(kind) {}
+
+        // C spelling of kind.
+        static std::string_view spelling(Kind kind);
 
-    inline std::unique_ptr<Node> decl_local(std::string name, std::unique_ptr<Node> type)
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    class Type : public Node
     {
-        auto dl = new DeclLocal();
-        dl->name = name;
-        dl->type = std::move(type);
-        return std::unique_ptr<Node>((Node *)dl);
-    }
+    public:
+        __CGEN_NODE(Type)
+
+        Symbol name;
+        AcceptResult accept(Visitor *visitor) override;
+
+        // Fresh pointer/array types naming the same struct; this node is
+        // left untouched.
+        inline std::unique_ptr<Node> pointer_of() const;
+        inline std::unique_ptr<Node> array_of(size_t size = 0) const;
+    };
+
+    class Static : public Node
+    {
+    public:
+        __CGEN_NODE(Static)
 
+        std::unique_ptr<Node> node;
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    // C suffix for an integer literal of type T; types narrower than int
+    // promote and need none.
     template <typename T>
-    inline std::unique_ptr<Node> literal(T value)
+    constexpr std::string_view integer_suffix()
     {
-        auto lit = std::make_unique<Literal<T>>();
-        lit->value = value;
-        return lit;
+        if constexpr (std::is_same_v<T, unsigned int>)
+            return "u";
+        else if constexpr (std::is_same_v<T, long>)
+            return "L";
+        else if constexpr (std::is_same_v<T, unsigned long>)
+            return "UL";
+        else if constexpr (std::is_same_v<T, long long>)
+            return "LL";
+        else if constexpr (std::is_same_v<T, unsigned long long>)
+            return "ULL";
+        else
+            return "";
     }
 
-    inline std::unique_ptr<Node> local(std::string name)
+    template <typename T>
+    inline void write_integer(Sink &out, T value)
     {
-        auto l = std::make_unique<Local>();
-        l->name = name;
-        return l;
+        if constexpr (std::is_same_v<T, bool>)
+        {
+            out << (value ? '1' : '0');
+        }
+        else
+        {
+            char buffer[32];
+
+            if constexpr (std::is_signed_v<T> && sizeof(T) >= sizeof(int))
+            {
+                // -2147483648 would parse as the negation of an out-of-range
+                // constant, so spell the minimum as an expression.
+                if (value == std::numeric_limits<T>::min())
+                {
+                    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value + 1);
+                    out << '(' << std::string_view(buffer, result.ptr - buffer) << integer_suffix<T>() << "-1)";
+                    return;
+                }
+            }
+
+            auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+            out << std::string_view(buffer, result.ptr - buffer) << integer_suffix<T>();
+        }
     }
 
-    inline std::unique_ptr<Node> field(std::unique_ptr<Node> type, std::string name)
+    // text as a C literal between quote characters. Quotes, backslashes,
+    // "??" (trigraphs) and bytes outside printable ASCII are escaped, the
+    // latter as three-digit octal; string literals are split into adjacent
+    // pieces well under compiler length limits.
+    void write_quoted(Sink &out, std::string_view text, char quote = '"');
+
+    // Shortest text that round-trips, always spelled as a floating constant
+    // with an f/L suffix for float/long double.
+    template <typename T>
+    inline void write_float(Sink &out, T value)
     {
-        auto f = std::make_unique<Field>();
-        f->type = std::move(type);
-        f->name = name;
-        return f;
+        std::string_view suffix = std::is_same_v<T, float> ? "f" : std::is_same_v<T, long double> ? "L"
+                                                                                                  : "";
+
+        if (std::isnan(value))
+        {
+            out << "(0.0" << suffix << "/0.0" << suffix << ')';
+            return;
+        }
+
+        if (std::isinf(value))
+        {
+            out << (value < 0 ? "(-1.0" : "(1.0") << suffix << "/0.0" << suffix << ')';
+            return;
+        }
+
+        char buffer[64];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        std::string_view text(buffer, result.ptr - buffer);
+
+        out << text;
+        if (text.find_first_of(".e") == std::string_view::npos)
+        {
+            out << ".0";
+        }
+        out << suffix;
     }
 
-    template <typename... fields>
-    inline std::unique_ptr<Node> decl_type(std::string name, fields... fields_)
+    class LiteralBase : public Node
     {
-        auto dt = std::make_unique<DeclType>();
-        dt->name = name;
-        (dt->fields.push_back(std::move(fields_)), ...);
-        return dt;
-    }
+    public:
+        enum Kind : uint8_t
+        {
+            Bool,
+            Char,
+            SChar,
+            UChar,
+            Short,
+            UShort,
+            Int,
+            UInt,
+            Long,
+            ULong,
+            LongLong,
+            ULongLong,
+            Float,
+            Double,
+            LongDouble,
+            String,
+        };
+
+        const Kind literal_kind;
+
+        __CGEN_CLASSOF(Literal)
+
+        template <typename T>
+        static constexpr Kind kind_of()
+        {
+            if constexpr (std::is_same_v<T, bool>)
+                return Bool;
+            else if constexpr (std::is_same_v<T, char>)
+                return Char;
+            else if constexpr (std::is_same_v<T, signed char>)
+                return SChar;
+            else if constexpr (std::is_same_v<T, unsigned char>)
+                return UChar;
+            else if constexpr (std::is_same_v<T, short>)
+                return Short;
+            else if constexpr (std::is_same_v<T, unsigned short>)
+                return UShort;
+            else if constexpr (std::is_same_v<T, int>)
+                return Int;
+            else if constexpr (std::is_same_v<T, unsigned int>)
+                return UInt;
+            else if constexpr (std::is_same_v<T, long>)
+                return Long;
+            else if constexpr (std::is_same_v<T, unsigned long>)
+                return ULong;
+            else if constexpr (std::is_same_v<T, long long>)
+                return LongLong;
+            else if constexpr (std::is_same_v<T, unsigned long long>)
+                return ULongLong;
+            else if constexpr (std::is_same_v<T, float>)
+                return Float;
+            else if constexpr (std::is_same_v<T, double>)
+                return Double;
+            else if constexpr (std::is_same_v<T, long double>)
+                return LongDouble;
+            else
+            {
+                static_assert(std::is_same_v<T, std::string>, "unsupported literal type");
+                return String;
+            }
+        }
+
+    protected:
+        explicit LiteralBase(Kind kind) : Node(NodeKind::Literal), literal_kind(kind) {}
+    };
 
-    template <typename... nodes>
-    inline std::unique_ptr<Node> call(std::unique_ptr<Node> node, nodes... nodes_)
+    template <typename T>
+    class Literal : public LiteralBase
     {
-        auto c = std::make_unique<Call>();
-        c->node = std::move(node);
-        (c->nodes.push_back(std::move(nodes_)), ...);
-        return c;
-    }
+    public:
+        T value{};
 
-    inline std::unique_ptr<Node> get_ref(std::unique_ptr<Node> node)
+        Literal() : LiteralBase(kind_of<T>()) {}
+
+        static inline bool classof(const Node *node)
+        {
+            return LiteralBase::classof(node) && static_cast<const LiteralBase *>(node)->literal_kind == kind_of<T>();
+        }
+
+        inline void write(Sink &out) const { write(out, value); }
+
+        static inline void write(Sink &out, const T &value)
+        {
+            if constexpr (std::is_same_v<T, std::string>)
+            {
+                write_quoted(out, value);
+            }
+            else if constexpr (std::is_same_v<T, char>)
+            {
+                write_quoted(out, std::string_view(&value, 1), '\'');
+            }
+            else if constexpr (std::is_floating_point_v<T>)
+            {
+                write_float(out, value);
+            }
+            else
+            {
+                write_integer(out, value);
+            }
+        }
+
+        AcceptResult accept(Visitor *visitor) override
+        {
+            AcceptResult result;
+            StringSink out(result);
+            write(out);
+            return result;
+        }
+    };
+
+    class DeclLocal : public Node
     {
-        auto r = std::make_unique<GetRef>();
-        r->node = std::move(node);
-        return r;
-    }
-} // namespace cgen
+    public:
+        __CGEN_NODE(DeclLocal)
 
-#ifdef CGEN_IMPLEMENTATION
+        Symbol name;
+        std::unique_ptr<Node> type;
 
-namespace cgen
-{
-    AcceptResult Node::accept(Visitor *visitor)
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    class Assign : public Node
     {
-        return visitor->visit(this);
-    }
+    public:
+        __CGEN_NODE(Assign)
 
-    AcceptResult Program::accept(Visitor *visitor)
+        std::unique_ptr<Node> lhs;
+        std::unique_ptr<Node> rhs;
+
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    class Block : public Node
     {
-        return visitor->visit(this);
-    }
+    public:
+        __CGEN_NODE(Block)
+
+        NodeList nodes{Arena::resource()};
+
+        AcceptResult accept(Visitor *visitor) override;
+
+        void push(std::unique_ptr<Node> node)
+        {
+            if (!(node->flags & (Interned | Shared)))
+            {
+                node->parent = this;
+            }
+            mark_dirty();
+            SymbolIndex::pushed(this, node.get());
+            nodes.push_back(std::move(node));
+        }
+    };
+
+    class Function : public Node
+    {
+    public:
+        __CGEN_NODE(Function)
+
+        Symbol name;
+        NodeList parameters{Arena::resource()};
+        std::unique_ptr<Node> return_type;
+        std::unique_ptr<Node> body;
+
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    class Return : public Node
+    {
+    public:
+        __CGEN_NODE(Return)
+
+        std::unique_ptr<Node> node;
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    class Field : public Node
+    {
+    public:
+        __CGEN_NODE(Field)
+
+        std::unique_ptr<Node> type;
+        Symbol name;
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    class DeclType : public Node
+    {
+    public:
+        __CGEN_NODE(DeclType)
+
+        Symbol name;
+        NodeList fields{Arena::resource()};
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    class Deref : public Node
+    {
+    public:
+        __CGEN_NODE(Deref)
+
+        std::unique_ptr<Node> node;
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    class GetRef : public Node
+    {
+    public:
+        __CGEN_NODE(GetRef)
+
+        std::unique_ptr<Node> node;
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    class Local : public Node
+    {
+    public:
+        __CGEN_NODE(Local)
+
+        Symbol name;
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    class Call : public Node
+    {
+    public:
+        __CGEN_NODE(Call)
+
+        std::unique_ptr<Node> node;
+        NodeList nodes{Arena::resource()};
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    // Initializer for a constant table, viewing caller-owned elements (which
+    // may live in a mapped file) instead of holding one node per element.
+    // String format applies to 8-bit elements: one hex-escaped literal.
+    class ArrayInit : public Node
+    {
+    public:
+        __CGEN_NODE(ArrayInit)
+
+        enum Format
+        {
+            Braces,
+            String,
+        };
+
+        Primitive::Kind element = Primitive::u8;
+        const void *data = nullptr;
+        size_t count = 0;
+        Format format = Braces;
+
+        static size_t element_size(Primitive::Kind kind);
+
+        inline size_t size_bytes() const { return count * element_size(element); }
+
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    // C binding strength of an expression, tightest first.
+    enum class Precedence : uint8_t
+    {
+        Primary,
+        Postfix,
+        Prefix,
+        Multiplicative,
+        Additive,
+        Shift,
+        Relational,
+        Equality,
+        BitAnd,
+        BitXor,
+        BitOr,
+        LogicalAnd,
+        LogicalOr,
+        Assignment,
+    };
+
+    // Operator expressions. The emitter parenthesizes an operand only where
+    // C precedence and associativity need it.
+    class BinaryOp : public Node
+    {
+    public:
+        __CGEN_NODE(BinaryOp)
+
+        // Grouped by precedence, tightest first.
+        enum Op : uint8_t
+        {
+            Mul,
+            Div,
+            Mod,
+            Add,
+            Sub,
+            Shl,
+            Shr,
+            Lt,
+            Le,
+            Gt,
+            Ge,
+            Eq,
+            Ne,
+            BitAnd,
+            BitXor,
+            BitOr,
+            And,
+            Or,
+        };
+
+        Op op = Add;
+        std::unique_ptr<Node> lhs;
+        std::unique_ptr<Node> rhs;
+
+        static std::string_view spelling(Op op);
+        static Precedence precedence(Op op);
+
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    class UnaryOp : public Node
+    {
+    public:
+        __CGEN_NODE(UnaryOp)
+
+        enum Op : uint8_t
+        {
+            Neg,
+            Plus,
+            Not,
+            BitNot,
+            PreInc,
+            PreDec,
+            PostInc,
+            PostDec,
+        };
+
+        Op op = Neg;
+        std::unique_ptr<Node> node;
+
+        static std::string_view spelling(Op op);
+        static inline bool postfix(Op op) { return op == PostInc || op == PostDec; }
+
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    // node[index]
+    class Index : public Node
+    {
+    public:
+        __CGEN_NODE(Index)
+
+        std::unique_ptr<Node> node;
+        std::unique_ptr<Node> index;
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    // (type)node
+    class Cast : public Node
+    {
+    public:
+        __CGEN_NODE(Cast)
+
+        std::unique_ptr<Node> type;
+        std::unique_ptr<Node> node;
+        AcceptResult accept(Visitor *visitor) override;
+    };
+
+    template <typename... Fs>
+    struct overloaded : Fs...
+    {
+        using Fs::operator()...;
+    };
+
+    template <typename... Fs>
+    overloaded(Fs...) -> overloaded<Fs...>;
+
+    // Calls f with node downcast to its concrete class. Custom nodes are
+    // passed through as Node *.
+    template <typename F>
+    inline decltype(auto) dispatch(Node *node, F &&f)
+    {
+        switch (node->node_kind)
+        {
+        case NodeKind::Program:
+            return f(static_cast<Program *>(node));
+        case NodeKind::PointerOf:
+            return f(static_cast<PointerOf *>(node));
+        case NodeKind::ArrayOf:
+            return f(static_cast<ArrayOf *>(node));
+        case NodeKind::Primitive:
+            return f(static_cast<Primitive *>(node));
+        case NodeKind::Type:
+            return f(static_cast<Type *>(node));
+        case NodeKind::Static:
+            return f(static_cast<Static *>(node));
+        case NodeKind::Literal:
+            switch (static_cast<LiteralBase *>(node)->literal_kind)
+            {
+            case LiteralBase::Bool:
+                return f(static_cast<Literal<bool> *>(node));
+            case LiteralBase::Char:
+                return f(static_cast<Literal<char> *>(node));
+            case LiteralBase::SChar:
+                return f(static_cast<Literal<signed char> *>(node));
+            case LiteralBase::UChar:
+                return f(static_cast<Literal<unsigned char> *>(node));
+            case LiteralBase::Short:
+                return f(static_cast<Literal<short> *>(node));
+            case LiteralBase::UShort:
+                return f(static_cast<Literal<unsigned short> *>(node));
+            case LiteralBase::Int:
+                return f(static_cast<Literal<int> *>(node));
+            case LiteralBase::UInt:
+                return f(static_cast<Literal<unsigned int> *>(node));
+            case LiteralBase::Long:
+                return f(static_cast<Literal<long> *>(node));
+            case LiteralBase::ULong:
+                return f(static_cast<Literal<unsigned long> *>(node));
+            case LiteralBase::LongLong:
+                return f(static_cast<Literal<long long> *>(node));
+            case LiteralBase::ULongLong:
+                return f(static_cast<Literal<unsigned long long> *>(node));
+            case LiteralBase::Float:
+                return f(static_cast<Literal<float> *>(node));
+            case LiteralBase::Double:
+                return f(static_cast<Literal<double> *>(node));
+            case LiteralBase::LongDouble:
+                return f(static_cast<Literal<long double> *>(node));
+            case LiteralBase::String:
+                return f(static_cast<Literal<std::string> *>(node));
+            }
+            break;
+        case NodeKind::DeclLocal:
+            return f(static_cast<DeclLocal *>(node));
+        case NodeKind::Assign:
+            return f(static_cast<Assign *>(node));
+        case NodeKind::Block:
+            return f(static_cast<Block *>(node));
+        case NodeKind::Function:
+            return f(static_cast<Function *>(node));
+        case NodeKind::Return:
+            return f(static_cast<Return *>(node));
+        case NodeKind::Field:
+            return f(static_cast<Field *>(node));
+        case NodeKind::DeclType:
+            return f(static_cast<DeclType *>(node));
+        case NodeKind::Deref:
+            return f(static_cast<Deref *>(node));
+        case NodeKind::GetRef:
+            return f(static_cast<GetRef *>(node));
+        case NodeKind::Local:
+            return f(static_cast<Local *>(node));
+        case NodeKind::Call:
+            return f(static_cast<Call *>(node));
+        case NodeKind::ArrayInit:
+            return f(static_cast<ArrayInit *>(node));
+        case NodeKind::BinaryOp:
+            return f(static_cast<BinaryOp *>(node));
+        case NodeKind::UnaryOp:
+            return f(static_cast<UnaryOp *>(node));
+        case NodeKind::Index:
+            return f(static_cast<Index *>(node));
+        case NodeKind::Cast:
+            return f(static_cast<Cast *>(node));
+        case NodeKind::Custom:
+            break;
+        }
+
+        return f(node);
+    }
+
+    // CRTP visitor dispatched through dispatch(); Derived provides
+    // visit() overloads (a visit(Node *) fallback catches the rest).
+    template <typename Derived, typename R = void>
+    class StaticVisitor
+    {
+    public:
+        inline R dispatch(Node *node)
+        {
+            return cgen::dispatch(node, [this](auto *n) -> R
+                                  { return static_cast<Derived *>(this)->visit(n); });
+        }
+    };
+
+    // Calls f with every child slot of node (including empty ones), in
+    // emission order.
+    template <typename F>
+    inline void for_each_child(Node *node, F &&f)
+    {
+        dispatch(node, overloaded{
+                           [&](Program *n)
+                           { for (auto &c : n->nodes) f(c); },
+                           [&](PointerOf *n)
+                           { f(n->node); },
+                           [&](ArrayOf *n)
+                           { f(n->node); },
+                           [&](Static *n)
+                           { f(n->node); },
+                           [&](DeclLocal *n)
+                           { f(n->type); },
+                           [&](Assign *n)
+                           { f(n->lhs); f(n->rhs); },
+                           [&](Block *n)
+                           { for (auto &c : n->nodes) f(c); },
+                           [&](Function *n)
+                           { f(n->return_type); for (auto &c : n->parameters) f(c); f(n->body); },
+                           [&](Return *n)
+                           { f(n->node); },
+                           [&](Field *n)
+                           { f(n->type); },
+                           [&](DeclType *n)
+                           { for (auto &c : n->fields) f(c); },
+                           [&](Deref *n)
+                           { f(n->node); },
+                           [&](GetRef *n)
+                           { f(n->node); },
+                           [&](Call *n)
+                           { f(n->node); for (auto &c : n->nodes) f(c); },
+                           [&](BinaryOp *n)
+                           { f(n->lhs); f(n->rhs); },
+                           [&](UnaryOp *n)
+                           { f(n->node); },
+                           [&](Index *n)
+                           { f(n->node); f(n->index); },
+                           [&](Cast *n)
+                           { f(n->type); f(n->node); },
+                           [&](Node *) {},
+                       });
+    }
+
+    // Points every child of node back at it.
+    inline void adopt(Node *node)
+    {
+        for_each_child(node, [node](std::unique_ptr<Node> &child)
+                       {
+                           if (child && !(child->flags & (Node::Interned | Node::Shared)))
+                               child->parent = node; });
+    }
+
+    // Sets parent links throughout a hand-assembled subtree.
+    void link_parents(Node *root);
+
+    // Deep copy of a subtree, made from the current ArenaScope's arena if
+    // one is bound (with the space reserved up front) or else the heap.
+    // Interned nodes are shared rather than copied.
+    std::unique_ptr<Node> clone(const Node *node);
+
+    // Another owner for node, which is frozen along with its subtree: it
+    // and its descendants become Shared and must not be edited in place,
+    // and it is destroyed with its last owner. Variants built from shared
+    // handles have no per-variant cost for the parts they leave alone.
+    // Arena-owned nodes still live only as long as their arena.
+    std::unique_ptr<Node> share(Node *node);
+
+    // Copy-on-write: makes the node in slot safe to edit and returns it. A
+    // shared node with other owners is replaced by a copy whose children
+    // are shared handles to the originals; parent, if given, becomes the
+    // copy's parent and is marked dirty.
+    Node *mutate(std::unique_ptr<Node> &slot, Node *parent = nullptr);
+
+    // 128-bit content hash of a subtree. Names hash by text and values by
+    // bits, so digests are stable across runs; custom nodes hash by identity.
+    struct Digest
+    {
+        uint64_t low = 0;
+        uint64_t high = 0;
+
+        inline bool operator==(const Digest &other) const { return low == other.low && high == other.high; }
+    };
+
+    Digest structural_digest(const Node *node);
+    bool structurally_equal(const Node *a, const Node *b);
+
+    inline uint64_t structural_hash(const Node *node) { return structural_digest(node).low; }
+
+    class MappedFile;
+
+    // Opt-in memo of rendered text for selected node kinds (Call and DeclType
+    // by default). Identity mode keys on the node address and must be told
+    // about mutations through invalidate(), for the node and every cached
+    // ancestor. Structural mode keys on structural_digest(), so edits simply
+    // miss, at the cost of hashing each candidate subtree. Thread-safe.
+    class RenderCache
+    {
+    public:
+        enum Mode
+        {
+            Identity,
+            Structural,
+        };
+
+        explicit RenderCache(Mode mode = Identity);
+        ~RenderCache();
+
+        inline bool caches(NodeKind kind) const { return kinds & (1u << (unsigned)kind); }
+
+        inline void cache_kind(NodeKind kind, bool enabled = true)
+        {
+            kinds = enabled ? kinds | (1u << (unsigned)kind) : kinds & ~(1u << (unsigned)kind);
+        }
+
+        struct Key
+        {
+            const Node *node;
+            Digest digest;
+            // False when the subtree holds custom nodes, which hash by
+            // address and so mean nothing to another run.
+            bool portable = true;
+        };
+
+        Key key(const Node *node) const;
+
+        // Writes the cached text for key to out, counting a hit or a miss.
+        bool write(const Key &key, Sink &out);
+        void store(const Key &key, std::string text);
+
+        void invalidate(const Node *node);
+        void clear();
+
+        // On-disk store for Structural mode, so unchanged subtrees are not
+        // rendered again by the next run. load() maps a file written by
+        // save() and serves hits straight from the mapping. save() keeps
+        // the entries hit or stored since, and replaces the file in one
+        // rename. Both return false on I/O errors or a foreign file.
+        bool load(const char *path);
+        bool save(const char *path);
+
+        size_t size() const;
+        inline size_t hits() const { return hit_count; }
+        inline size_t misses() const { return miss_count; }
+
+        // Bump whenever emitted text changes, so stale stores are ignored.
+        static constexpr uint32_t file_version = 2;
+
+    private:
+        struct DigestHash
+        {
+            inline size_t operator()(const Digest &digest) const noexcept { return digest.low; }
+        };
+
+        struct Rendered
+        {
+            std::string text;
+            bool portable;
+        };
+
+        struct FileHeader
+        {
+            char magic[8];
+            uint32_t version;
+            uint32_t byte_order;
+            uint64_t count;
+            uint64_t bytes;
+        };
+
+        // Sorted by digest, followed by the text bytes they point into.
+        struct FileRecord
+        {
+            Digest digest;
+            uint64_t offset;
+            uint64_t size;
+        };
+
+        Mode mode;
+        uint32_t kinds = (1u << (unsigned)NodeKind::Call) | (1u << (unsigned)NodeKind::DeclType);
+        mutable std::shared_mutex mutex;
+        std::unordered_map<const Node *, std::string> by_node;
+        std::unordered_map<Digest, Rendered, DigestHash> by_digest;
+        std::atomic<size_t> hit_count{0};
+        std::atomic<size_t> miss_count{0};
+
+        std::unique_ptr<MappedFile> file;
+        std::span<const FileRecord> records;
+        std::string_view stored;
+        std::unique_ptr<std::atomic<bool>[]> used;
+
+        const FileRecord *find_stored(const Digest &digest) const;
+        bool map(const char *path);
+        void unload();
+    };
+
+    // Hash-conses type nodes (Primitive, Type, PointerOf, ArrayOf) so equal
+    // types share one immutable node that caches its rendered text. Interned
+    // nodes are owned by the table and must not be modified. Safe to share
+    // between threads.
+    class TypeTable
+    {
+    public:
+        TypeTable() = default;
+
+        TypeTable(const TypeTable &) = delete;
+        TypeTable &operator=(const TypeTable &) = delete;
+
+        Node *primitive(Primitive::Kind kind);
+        Node *named(Symbol name);
+        Node *pointer_of(Node *type);
+        Node *array_of(Node *type, size_t size = 0);
+
+        // Interned equivalent of an arbitrary type tree, or nullptr if node
+        // is not a type.
+        Node *intern(Node *node);
+
+        size_t size() const
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            return index.size();
+        }
+
+        static inline std::string_view text(const Node *node)
+        {
+            assert(node->flags & Node::Interned);
+
+            switch (node->node_kind)
+            {
+            case NodeKind::Primitive:
+                return static_cast<const Entry<Primitive> *>(node)->text;
+            case NodeKind::Type:
+                return static_cast<const Entry<Type> *>(node)->text;
+            case NodeKind::PointerOf:
+                return static_cast<const Entry<PointerOf> *>(node)->text;
+            case NodeKind::ArrayOf:
+                return static_cast<const Entry<ArrayOf> *>(node)->text;
+            default:
+                return {};
+            }
+        }
+
+    private:
+        template <typename T>
+        struct Entry : T
+        {
+            using T::T;
+            std::string_view text;
+        };
+
+        struct Key
+        {
+            NodeKind kind;
+            uint8_t primitive;
+            const Node *node;
+            size_t size;
+            Symbol name;
+
+            inline bool operator==(const Key &other) const
+            {
+                return kind == other.kind && primitive == other.primitive && node == other.node &&
+                       size == other.size && name == other.name;
+            }
+        };
+
+        struct KeyHash
+        {
+            inline size_t operator()(const Key &key) const noexcept
+            {
+                size_t h = std::hash<const void *>()(key.node);
+                h = h * 31 + (size_t)key.kind;
+                h = h * 31 + key.primitive;
+                h = h * 31 + key.size;
+                h = h * 31 + std::hash<Symbol>()(key.name);
+                return h;
+            }
+        };
+
+        // Lookups share the lock; only a miss takes it exclusively.
+        mutable std::shared_mutex mutex;
+        Arena storage;
+        std::unordered_map<Key, Node *, KeyHash> index;
+
+        template <typename T, typename F>
+        Node *find_or_create(const Key &key, F &&init);
+    };
+
+    using TypeScope = Scope<TypeTable>;
+
+    // Interned types from one table are equal exactly when they are the same
+    // node; anything else is compared structurally.
+    bool same_type(const Node *a, const Node *b);
+
+    class Visitor
+    {
+    public:
+        virtual AcceptResult visit(class Node *node) = 0;
+        virtual AcceptResult visit(class Program *node) = 0;
+        virtual AcceptResult visit(class Primitive *node) = 0;
+        virtual AcceptResult visit(class Type *node) = 0;
+        virtual AcceptResult visit(class PointerOf *node) = 0;
+        virtual AcceptResult visit(class ArrayOf *node) = 0;
+        virtual AcceptResult visit(class Static *node) = 0;
+        virtual AcceptResult visit(class DeclLocal *node) = 0;
+        virtual AcceptResult visit(class Block *node) = 0;
+        virtual AcceptResult visit(class Function *node) = 0;
+        virtual AcceptResult visit(class Return *node) = 0;
+        virtual AcceptResult visit(class Assign *node) = 0;
+        virtual AcceptResult visit(class Field *node) = 0;
+        virtual AcceptResult visit(class Deref *node) = 0;
+        virtual AcceptResult visit(class GetRef *node) = 0;
+        virtual AcceptResult visit(class DeclType *node) = 0;
+        virtual AcceptResult visit(class Local *node) = 0;
+        virtual AcceptResult visit(class Call *node) = 0;
+
+        // Node kinds added later default to the generic overload so existing
+        // visitors keep compiling.
+        virtual AcceptResult visit(class ArrayInit *node) { return visit(static_cast<Node *>(node)); }
+        virtual AcceptResult visit(class BinaryOp *node) { return visit(static_cast<Node *>(node)); }
+        virtual AcceptResult visit(class UnaryOp *node) { return visit(static_cast<Node *>(node)); }
+        virtual AcceptResult visit(class Index *node) { return visit(static_cast<Node *>(node)); }
+        virtual AcceptResult visit(class Cast *node) { return visit(static_cast<Node *>(node)); }
+    };
+
+    // Output of CodeGenVisitor::emit_sharded: a header shared by every unit
+    // and the units themselves, each starting with an include of it.
+    struct TranslationUnits
+    {
+        std::string header;
+        std::vector<std::string> units;
+    };
+
+    class EmitWorker;
+
+    class CodeGenVisitor : public Visitor
+    {
+    public:
+        CodeGenVisitor() = default;
+        explicit CodeGenVisitor(Sink &sink) : sink(&sink) {}
+
+        RenderCache *cache = nullptr;
+
+        // Subtrees nested deeper than this are emitted from an explicit
+        // stack instead of by recursion, so depth is bounded only by heap.
+        // On that path the cache and per-kind instrumentation see leaves only.
+        unsigned max_depth = 256;
+
+        void emit(Node *node, Sink &out);
+
+        // Renders the program on worker threads, each with its own copy of
+        // this visitor, and writes it to out in program order. Work is split
+        // inside nodes as well, at Block statements and Call arguments, so
+        // one large function is shared out like many small ones.
+        void emit_parallel(Program *program, Sink &out, unsigned threads = 0);
+
+        // Appends to out, which is grown once: workers first measure the
+        // top-level nodes, then write each in place at its offset. Only text
+        // split off inside a node goes through a segment, copied into the
+        // node's span afterwards. Output must be deterministic (custom nodes
+        // included) for the sizes to hold.
+        void emit_parallel(Program *program, std::string &out, unsigned threads = 0);
+
+        // What the last emit_parallel() did: ranges handed to another
+        // worker, tasks stolen, and bytes that reached out through a
+        // segment rather than being written in place.
+        struct ParallelStats
+        {
+            size_t splits = 0;
+            size_t steals = 0;
+            size_t copied = 0;
+        };
+        ParallelStats parallel_stats;
+
+        // Exact length of the text emit() would produce.
+        size_t measure(Node *node);
+
+        // Appends the text of node to out with a single allocation.
+        void emit_sized(Node *node, std::string &out);
+
+        // Writes functions to defs and every other top-level node to decls,
+        // so the two can be built as separate files (defs including decls).
+        void emit_sections(Program *program, Sink &decls, Sink &defs);
+
+        // Writes the declaration of a function without its body.
+        void emit_prototype(Function *node, Sink &out);
+
+        // Splits a program into a header and up to count units that compile
+        // independently. The header gets only types, prototypes and extern
+        // declarations; function bodies are balanced across units by
+        // rendered size. Globals, initialized or not, are defined in the
+        // first unit, and so is everything static, together with every
+        // function that names one, since other units cannot see it.
+        TranslationUnits emit_sharded(Program *program, size_t count, std::string_view header_name = "program.h");
+
+        AcceptResult visit(Node *node) override;
+        AcceptResult visit(Program *node) override;
+        AcceptResult visit(Primitive *node) override;
+        AcceptResult visit(Type *node) override;
+        AcceptResult visit(PointerOf *node) override;
+        AcceptResult visit(ArrayOf *node) override;
+        AcceptResult visit(Static *node) override;
+        AcceptResult visit(DeclLocal *node) override;
+        AcceptResult visit(Block *node) override;
+        AcceptResult visit(Function *node) override;
+        AcceptResult visit(Return *node) override;
+        AcceptResult visit(Assign *node) override;
+        AcceptResult visit(Field *node) override;
+        AcceptResult visit(Deref *node) override;
+        AcceptResult visit(GetRef *node) override;
+        AcceptResult visit(DeclType *node) override;
+        AcceptResult visit(Local *node) override;
+        AcceptResult visit(Call *node) override;
+        AcceptResult visit(ArrayInit *node) override;
+        AcceptResult visit(BinaryOp *node) override;
+        AcceptResult visit(UnaryOp *node) override;
+        AcceptResult visit(Index *node) override;
+        AcceptResult visit(Cast *node) override;
+
+    private:
+        friend class EmitWorker;
+
+        Sink *sink = nullptr;
+        unsigned depth = 0;
+        EmitWorker *worker = nullptr;
+
+        template <typename T>
+        inline AcceptResult render(T *node)
+        {
+            if (sink != nullptr)
+            {
+                emit(static_cast<Node *>(node));
+                return {};
+            }
+
+            AcceptResult result;
+            StringSink out(result);
+            sink = &out;
+            emit(static_cast<Node *>(node));
+            sink = nullptr;
+            return result;
+        }
+
+        template <typename T>
+        inline void emit(Literal<T> *node)
+        {
+            node->write(*sink);
+        }
+
+        void emit_custom(Node *node);
+        void emit_cached(Node *node);
+        void emit(Node *node);
+        void emit_node(Node *node);
+        void emit_iterative(Node *root);
+        void emit(Program *node);
+        void emit(Primitive *node);
+        void emit(Type *node);
+        void emit(PointerOf *node);
+        void emit(ArrayOf *node);
+        void emit(Static *node);
+        void emit(DeclLocal *node);
+        void emit(Block *node);
+        void emit(Function *node);
+        void emit_signature(Function *node);
+        void emit(Return *node);
+        void emit(Assign *node);
+        void emit(Field *node);
+        void emit(Deref *node);
+        void emit(GetRef *node);
+        void emit(DeclType *node);
+        void emit(Local *node);
+        void emit(Call *node);
+        void emit_list(Node *owner, size_t begin, size_t end);
+        void emit(ArrayInit *node);
+        void emit_operand(Node *node, bool parenthesized);
+        void emit_prefix(std::string_view op, Node *operand);
+        void emit(BinaryOp *node);
+        void emit(UnaryOp *node);
+        void emit(Index *node);
+        void emit(Cast *node);
+    };
+
+    // Keeps the rendered text of each top-level node of a Program and, on
+    // update(), re-renders only nodes that are new or marked dirty. Finding
+    // them is a pointer/flag scan over Program::nodes; rendering work is
+    // proportional to what changed.
+    class IncrementalEmitter
+    {
+    public:
+        explicit IncrementalEmitter(Program *program, CodeGenVisitor visitor = {})
+            : program(program), visitor(visitor) {}
+
+        // Returns the number of top-level nodes rendered.
+        size_t update();
+
+        void write(Sink &out) const;
+        std::string str() const;
+
+        inline size_t size() const { return bytes; }
+
+    private:
+        struct Segment
+        {
+            Node *node;
+            std::string text;
+        };
+
+        Program *program;
+        CodeGenVisitor visitor;
+        std::vector<Segment> segments;
+        size_t bytes = 0;
+
+        void render(Segment &segment);
+    };
+
+    // Emits top-level nodes on a background thread as they are produced,
+    // freeing each once written, so only queued nodes are alive at a time.
+    // push() blocks while capacity nodes are waiting. Nodes must not be
+    // touched after push(); arena-owned ones are freed by their arena.
+    class ProgramWriter
+    {
+    public:
+        explicit ProgramWriter(Sink &out, size_t capacity = 64, CodeGenVisitor visitor = {});
+        ~ProgramWriter() { close(); }
+
+        ProgramWriter(const ProgramWriter &) = delete;
+        ProgramWriter &operator=(const ProgramWriter &) = delete;
+
+        // Queues node for writing. Pushing after close() is a bug: it asserts,
+        // and otherwise drops node and returns false.
+        bool push(std::unique_ptr<Node> node);
+
+        // Waits for everything pushed to be written. Called by the destructor.
+        void close();
+
+        inline size_t written() const { return emitted.load(std::memory_order_acquire); }
+
+    private:
+        Sink &out;
+        size_t capacity;
+        CodeGenVisitor visitor;
+
+        std::mutex mutex;
+        std::condition_variable not_full;
+        std::condition_variable not_empty;
+        std::deque<std::unique_ptr<Node>> queue;
+        bool closing = false;
+        std::atomic<size_t> emitted{0};
+        std::thread worker;
+
+        void run();
+    };
+
+    // Read-only view of a flattened tree: one entry per node across parallel
+    // arrays, children as 32-bit indices into one shared list, and names and
+    // payloads as (offset << 32 | size) ranges into a byte pool. It holds no
+    // pointers, so it can sit directly on loaded or mapped memory.
+    struct FlatView
+    {
+        using Index = uint32_t;
+        static constexpr Index none = 0xFFFFFFFF;
+
+        // tags: Primitive::Kind, LiteralBase::Kind, ArrayInit element |
+        // format << 4, or the operator of BinaryOp and UnaryOp. values:
+        // ArrayOf size, literal bits, or a range.
+        std::span<const NodeKind> kinds;
+        std::span<const uint8_t> tags;
+        std::span<const uint32_t> first;
+        std::span<const uint32_t> counts;
+        std::span<const uint64_t> values;
+        std::span<const Index> children;
+        std::string_view bytes;
+        Index root = none;
+
+        inline size_t size() const { return kinds.size(); }
+
+        inline std::span<const Index> children_of(Index node) const
+        {
+            return children.subspan(first[node], counts[node]);
+        }
+
+        // Name, string literal or table data of node.
+        inline std::string_view text(Index node) const
+        {
+            return bytes.substr(values[node] >> 32, values[node] & 0xFFFFFFFF);
+        }
+
+        // Same output as CodeGenVisitor on the original tree.
+        void emit(Index node, Sink &out) const;
+        inline void emit(Sink &out) const { emit(root, out); }
+        std::string str() const;
+
+        // Rebuilds a pointer tree; ArrayInit data points into bytes.
+        std::unique_ptr<Node> to_tree(Index node) const;
+        inline std::unique_ptr<Node> to_tree() const { return to_tree(root); }
+
+        // Binary form: a header, then each array in turn (widest elements
+        // first, so none needs padding). Native byte order; load() refuses
+        // data written with the other one.
+        void write(Sink &out) const;
+
+        // Views serialized data in place; data must be 8-byte aligned and
+        // outlive the view. Checks the header only, see valid().
+        static std::optional<FlatView> load(const void *data, size_t size);
+
+        // Checks a view from untrusted data before emit() or to_tree(): that
+        // indices and ranges are in bounds, each kind has the children it
+        // needs, tags and payload sizes are known, and there is no cycle.
+        bool valid() const;
+    };
+
+    // Read-only memory map of a whole file.
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const char *path);
+        ~MappedFile();
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        inline bool ok() const { return mapping != nullptr || (opened && length == 0); }
+        inline const void *data() const { return mapping; }
+        inline size_t size() const { return length; }
+
+    private:
+        void *mapping = nullptr;
+        size_t length = 0;
+        bool opened = false;
+#ifdef _WIN32
+        void *file = nullptr;
+        void *section = nullptr;
+#endif
+    };
+
+    enum class WriteStatus
+    {
+        Unchanged,
+        Written,
+        Failed,
+    };
+
+    // Replaces path with text unless it already holds exactly that, so
+    // outputs that did not change (such as untouched shards) keep their
+    // modification time and make or ccache can skip them.
+    WriteStatus write_if_changed(const char *path, std::string_view text);
+
+    // Owning storage behind a FlatView. Interned types are stored once and
+    // shared by index, and names once per symbol.
+    class FlatTree
+    {
+    public:
+        using Index = FlatView::Index;
+
+        std::vector<NodeKind> kinds;
+        std::vector<uint8_t> tags;
+        std::vector<uint32_t> first;
+        std::vector<uint32_t> counts;
+        std::vector<uint64_t> values;
+        std::vector<Index> children;
+        std::string bytes;
+        Index root = FlatView::none;
+
+        FlatTree() = default;
+        explicit FlatTree(const Node *node);
+
+        // Appends a subtree and returns its index. Custom nodes have no flat
+        // form and come back as none.
+        Index add(const Node *node);
+
+        // Drops spare capacity and the dedup maps once building is done.
+        void shrink();
+
+        FlatView view() const;
+
+        inline size_t size() const { return kinds.size(); }
+        size_t memory_used() const;
+
+    private:
+        std::unordered_map<const Node *, Index> shared;
+        std::unordered_map<uint32_t, uint64_t> names;
+
+        uint64_t store(const void *data, size_t size);
+        uint64_t store(Symbol name);
+    };
+
+    // A transformation over a whole program; run() returns how many
+    // changes it made, so passes can be repeated until none do.
+    class Pass
+    {
+    public:
+        virtual ~Pass() = default;
+        virtual size_t run(Program *program) = 0;
+    };
+
+    // Bottom-up tree rewrite: rewrite() sees every child slot after that
+    // child's own subtree and may edit the node or replace it by assigning
+    // the slot. Interned and shared nodes are neither entered nor edited.
+    class RewritePass : public Pass
+    {
+    public:
+        size_t run(Program *program) override;
+
+    protected:
+        // Returns whether the slot or its node changed.
+        virtual bool rewrite(std::unique_ptr<Node> &slot) = 0;
+
+    private:
+        size_t walk(Node *node);
+    };
+
+    // Folds Deref(GetRef(x)) and GetRef(Deref(x)) to x, and operators whose
+    // operands are literals of the same type. Anything C leaves undefined or
+    // implementation-defined (overflow, division by zero, out of range
+    // shifts) is kept as written.
+    class FoldConstants : public RewritePass
+    {
+    protected:
+        bool rewrite(std::unique_ptr<Node> &slot) override;
+    };
+
+    // Drops the statements of a Block that follow a Return.
+    class RemoveUnreachable : public RewritePass
+    {
+    protected:
+        bool rewrite(std::unique_ptr<Node> &slot) override;
+    };
+
+    // Drops top-level static functions and struct declarations that nothing
+    // reachable from the rest of the program names, through a Local or a
+    // Type respectively.
+    class RemoveUnused : public Pass
+    {
+    public:
+        size_t run(Program *program) override;
+    };
+
+    // Runs the passes above until none changes anything; returns the total.
+    size_t optimize(Program *program);
+
+    inline std::unique_ptr<Node> primitive(Primitive::Kind kind)
+    {
+        if (TypeTable *types = TypeScope::current())
+        {
+            return std::unique_ptr<Node>(types->primitive(kind));
+        }
+
+        return make<Primitive>(kind);
+    }
+
+#define __CGEN_PRIMITIVE(name) \
+    inline std::unique_ptr<Node> name() { return primitive(Primitive::name); }
+
+    __CGEN_PRIMITIVE(i8)
+    __CGEN_PRIMITIVE(i16)
+    __CGEN_PRIMITIVE(i32)
+    __CGEN_PRIMITIVE(i64)
+    __CGEN_PRIMITIVE(u8)
+    __CGEN_PRIMITIVE(u16)
+    __CGEN_PRIMITIVE(u32)
+    __CGEN_PRIMITIVE(u64)
+    __CGEN_PRIMITIVE(f32)
+    __CGEN_PRIMITIVE(f64)
+
+    inline std::unique_ptr<Node> type(Symbol name)
+    {
+        if (TypeTable *types = TypeScope::current())
+        {
+            return std::unique_ptr<Node>(types->named(name));
+        }
+
+        auto t = make<Type>();
+        t->name = name;
+        return t;
+    }
+
+    inline std::unique_ptr<Node> pointer_of(std::unique_ptr<Node> node)
+    {
+        if (TypeTable *types = TypeScope::current())
+        {
+            if (Node *interned = types->intern(node.get()))
+            {
+                return std::unique_ptr<Node>(types->pointer_of(interned));
+            }
+        }
+
+        auto ptr = make<PointerOf>();
+        ptr->node = std::move(node);
+        adopt(ptr.get());
+        return ptr;
+    }
+
+    inline std::unique_ptr<Node> array_of(std::unique_ptr<Node> node, size_t size = 0)
+    {
+        if (TypeTable *types = TypeScope::current())
+        {
+            if (Node *interned = types->intern(node.get()))
+            {
+                return std::unique_ptr<Node>(types->array_of(interned, size));
+            }
+        }
+
+        auto arr = make<ArrayOf>();
+        arr->node = std::move(node);
+        arr->size = size;
+        adopt(arr.get());
+        return arr;
+    }
+
+    inline std::unique_ptr<Node> decl_local(Symbol name, std::unique_ptr<Node> type)
+    {
+        auto dl = make<DeclLocal>();
+        dl->name = name;
+        dl->type = std::move(type);
+        adopt(dl.get());
+        return dl;
+    }
+
+    template <typename T>
+    inline std::unique_ptr<Node> literal(T value)
+    {
+        auto lit = make<Literal<T>>();
+        lit->value = std::move(value);
+        return lit;
+    }
+
+    inline std::unique_ptr<Node> literal(std::string_view value)
+    {
+        return literal(std::string(value));
+    }
+
+    inline std::unique_ptr<Node> literal(const char *value)
+    {
+        return literal(std::string(value));
+    }
+
+    inline std::unique_ptr<Node> local(Symbol name)
+    {
+        auto l = make<Local>();
+        l->name = name;
+        return l;
+    }
+
+    inline std::unique_ptr<Node> field(std::unique_ptr<Node> type, Symbol name)
+    {
+        auto f = make<Field>();
+        f->type = std::move(type);
+        f->name = name;
+        adopt(f.get());
+        return f;
+    }
+
+    template <typename... Fields>
+    inline std::unique_ptr<Node> decl_type(Symbol name, Fields &&...fields_)
+    {
+        auto dt = make<DeclType>();
+        dt->name = name;
+        dt->fields.reserve(sizeof...(fields_));
+        (dt->fields.emplace_back(std::forward<Fields>(fields_)), ...);
+        adopt(dt.get());
+        return dt;
+    }
+
+    template <typename... Nodes>
+    inline std::unique_ptr<Node> call(std::unique_ptr<Node> node, Nodes &&...nodes_)
+    {
+        auto c = make<Call>();
+        c->node = std::move(node);
+        c->nodes.reserve(sizeof...(nodes_));
+        (c->nodes.emplace_back(std::forward<Nodes>(nodes_)), ...);
+        adopt(c.get());
+        return c;
+    }
+
+    template <typename T>
+    constexpr Primitive::Kind primitive_kind_of()
+    {
+        static_assert(std::is_arithmetic_v<T>, "array_init needs arithmetic elements");
+
+        if constexpr (std::is_floating_point_v<T>)
+            return sizeof(T) == 4 ? Primitive::f32 : Primitive::f64;
+        else if constexpr (std::is_signed_v<T>)
+            return sizeof(T) == 1 ? Primitive::i8 : sizeof(T) == 2 ? Primitive::i16
+                                                : sizeof(T) == 4   ? Primitive::i32
+                                                                   : Primitive::i64;
+        else
+            return sizeof(T) == 1 ? Primitive::u8 : sizeof(T) == 2 ? Primitive::u16
+                                                : sizeof(T) == 4   ? Primitive::u32
+                                                                   : Primitive::u64;
+    }
+
+    // values must outlive the node.
+    template <typename T>
+    inline std::unique_ptr<Node> array_init(std::span<const T> values, ArrayInit::Format format = ArrayInit::Braces)
+    {
+        static_assert(sizeof(T) <= 8 && (!std::is_floating_point_v<T> || sizeof(T) == 4 || sizeof(T) == 8));
+
+        auto a = make<ArrayInit>();
+        a->element = primitive_kind_of<T>();
+        a->data = values.data();
+        a->count = values.size();
+        a->format = format;
+        return a;
+    }
+
+    inline std::unique_ptr<Node> get_ref(std::unique_ptr<Node> node)
+    {
+        auto r = make<GetRef>();
+        r->node = std::move(node);
+        adopt(r.get());
+        return r;
+    }
+
+    inline std::unique_ptr<Node> binary(BinaryOp::Op op, std::unique_ptr<Node> lhs, std::unique_ptr<Node> rhs)
+    {
+        auto b = make<BinaryOp>();
+        b->op = op;
+        b->lhs = std::move(lhs);
+        b->rhs = std::move(rhs);
+        adopt(b.get());
+        return b;
+    }
+
+    inline std::unique_ptr<Node> unary(UnaryOp::Op op, std::unique_ptr<Node> node)
+    {
+        auto u = make<UnaryOp>();
+        u->op = op;
+        u->node = std::move(node);
+        adopt(u.get());
+        return u;
+    }
+
+    inline std::unique_ptr<Node> index(std::unique_ptr<Node> node, std::unique_ptr<Node> index)
+    {
+        auto i = make<Index>();
+        i->node = std::move(node);
+        i->index = std::move(index);
+        adopt(i.get());
+        return i;
+    }
+
+    inline std::unique_ptr<Node> cast(std::unique_ptr<Node> type, std::unique_ptr<Node> node)
+    {
+        auto c = make<Cast>();
+        c->type = std::move(type);
+        c->node = std::move(node);
+        adopt(c.get());
+        return c;
+    }
+
+    inline std::unique_ptr<Node> Type::pointer_of() const
+    {
+        return cgen::pointer_of(type(name));
+    }
+
+    inline std::unique_ptr<Node> Type::array_of(size_t size) const
+    {
+        return cgen::array_of(type(name), size);
+    }
+} // namespace cgen
+
+#ifdef CGEN_IMPLEMENTATION
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define __CGEN_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
+
+#include <cerrno>
+#include <fcntl.h>
+
+#ifdef CGEN_INSTRUMENTATION
+#include <chrono>
+#endif
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <io.h>
+#define __CGEN_WRITE(fd, data, size) _write(fd, data, (unsigned int)(size))
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#define __CGEN_WRITE(fd, data, size) ::write(fd, data, size)
+#endif
+
+namespace cgen
+{
+    AcceptResult Node::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult Program::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult Primitive::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult Type::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult Assign::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult Block::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult Function::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult Static::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult DeclLocal::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult PointerOf::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult ArrayOf::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult Return::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult Field::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult Deref::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult DeclType::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult Local::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult Call::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult GetRef::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    std::string_view kind_name(NodeKind kind)
+    {
+        switch (kind)
+        {
+        case NodeKind::Custom:
+            return "Custom";
+        case NodeKind::Program:
+            return "Program";
+        case NodeKind::PointerOf:
+            return "PointerOf";
+        case NodeKind::ArrayOf:
+            return "ArrayOf";
+        case NodeKind::Primitive:
+            return "Primitive";
+        case NodeKind::Type:
+            return "Type";
+        case NodeKind::Static:
+            return "Static";
+        case NodeKind::Literal:
+            return "Literal";
+        case NodeKind::DeclLocal:
+            return "DeclLocal";
+        case NodeKind::Assign:
+            return "Assign";
+        case NodeKind::Block:
+            return "Block";
+        case NodeKind::Function:
+            return "Function";
+        case NodeKind::Return:
+            return "Return";
+        case NodeKind::Field:
+            return "Field";
+        case NodeKind::DeclType:
+            return "DeclType";
+        case NodeKind::Deref:
+            return "Deref";
+        case NodeKind::GetRef:
+            return "GetRef";
+        case NodeKind::Local:
+            return "Local";
+        case NodeKind::Call:
+            return "Call";
+        case NodeKind::ArrayInit:
+            return "ArrayInit";
+        case NodeKind::BinaryOp:
+            return "BinaryOp";
+        case NodeKind::UnaryOp:
+            return "UnaryOp";
+        case NodeKind::Index:
+            return "Index";
+        case NodeKind::Cast:
+            return "Cast";
+        }
+        return {};
+    }
+
+    std::string_view Primitive::spelling(Kind kind)
+    {
+        switch (kind)
+        {
+        case i8:
+            return "char";
+        case i16:
+            return "short";
+        case i32:
+            return "int";
+        case i64:
+            return "long";
+        case u8:
+            return "unsigned char";
+        case u16:
+            return "unsigned short";
+        case u32:
+            return "unsigned int";
+        case u64:
+            return "unsigned long";
+        case f32:
+            return "float";
+        case f64:
+            return "double";
+        }
+        return {};
+    }
+
+    AcceptResult ArrayInit::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult BinaryOp::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult UnaryOp::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult Index::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    AcceptResult Cast::accept(Visitor *visitor)
+    {
+        return visitor->visit(this);
+    }
+
+    std::string_view BinaryOp::spelling(Op op)
+    {
+        switch (op)
+        {
+        case Mul:
+            return "*";
+        case Div:
+            return "/";
+        case Mod:
+            return "%";
+        case Add:
+            return "+";
+        case Sub:
+            return "-";
+        case Shl:
+            return "<<";
+        case Shr:
+            return ">>";
+        case Lt:
+            return "<";
+        case Le:
+            return "<=";
+        case Gt:
+            return ">";
+        case Ge:
+            return ">=";
+        case Eq:
+            return "==";
+        case Ne:
+            return "!=";
+        case BitAnd:
+            return "&";
+        case BitXor:
+            return "^";
+        case BitOr:
+            return "|";
+        case And:
+            return "&&";
+        case Or:
+            return "||";
+        }
+        return {};
+    }
+
+    Precedence BinaryOp::precedence(Op op)
+    {
+        switch (op)
+        {
+        case Mul:
+        case Div:
+        case Mod:
+            return Precedence::Multiplicative;
+        case Add:
+        case Sub:
+            return Precedence::Additive;
+        case Shl:
+        case Shr:
+            return Precedence::Shift;
+        case Lt:
+        case Le:
+        case Gt:
+        case Ge:
+            return Precedence::Relational;
+        case Eq:
+        case Ne:
+            return Precedence::Equality;
+        case BitAnd:
+            return Precedence::BitAnd;
+        case BitXor:
+            return Precedence::BitXor;
+        case BitOr:
+            return Precedence::BitOr;
+        case And:
+            return Precedence::LogicalAnd;
+        case Or:
+            return Precedence::LogicalOr;
+        }
+        return Precedence::Primary;
+    }
+
+    std::string_view UnaryOp::spelling(Op op)
+    {
+        switch (op)
+        {
+        case Neg:
+            return "-";
+        case Plus:
+            return "+";
+        case Not:
+            return "!";
+        case BitNot:
+            return "~";
+        case PreInc:
+        case PostInc:
+            return "++";
+        case PreDec:
+        case PostDec:
+            return "--";
+        }
+        return {};
+    }
+
+    size_t ArrayInit::element_size(Primitive::Kind kind)
+    {
+        switch (kind)
+        {
+        case Primitive::i8:
+        case Primitive::u8:
+            return 1;
+        case Primitive::i16:
+        case Primitive::u16:
+            return 2;
+        case Primitive::i32:
+        case Primitive::u32:
+        case Primitive::f32:
+            return 4;
+        case Primitive::i64:
+        case Primitive::u64:
+        case Primitive::f64:
+            return 8;
+        }
+        return 1;
+    }
+
+    void *Arena::allocate(size_t size, size_t alignment)
+    {
+        while (current < blocks.size())
+        {
+            Block &block = blocks[current];
+            uintptr_t base = reinterpret_cast<uintptr_t>(block.data.get());
+            size_t aligned = ((base + offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - base;
+
+            if (aligned + size <= block.size)
+            {
+                offset = aligned + size;
+                used += size;
+                return block.data.get() + aligned;
+            }
+
+            current++;
+            offset = 0;
+        }
+
+        size_t size_ = std::max(block_size, size + alignment);
+        blocks.push_back({std::unique_ptr<char[]>(new char[size_]), size_});
+        current = blocks.size() - 1;
+        offset = 0;
+
+        return allocate(size, alignment);
+    }
+
+    void Arena::reset()
+    {
+        for (auto it = nodes.rbegin(); it != nodes.rend(); ++it)
+        {
+            (*it)->~Node();
+        }
+
+        nodes.clear();
+        current = 0;
+        offset = 0;
+        used = 0;
+    }
+
+    void Arena::reserve(size_t size)
+    {
+        for (size_t i = current; i < blocks.size(); i++)
+        {
+            size_t available = blocks[i].size - (i == current ? offset : 0);
+            if (available >= size)
+            {
+                if (i != current)
+                {
+                    current = i;
+                    offset = 0;
+                }
+                return;
+            }
+        }
+
+        size_t size_ = std::max(block_size, size);
+        blocks.push_back({std::unique_ptr<char[]>(new char[size_]), size_});
+        current = blocks.size() - 1;
+        offset = 0;
+    }
+
+    SymbolTable::~SymbolTable()
+    {
+        for (auto &segment : segments)
+        {
+            delete[] segment.load(std::memory_order_relaxed);
+        }
+    }
+
+    SymbolTable::Slot *SymbolTable::slot(uint32_t id, bool create) const
+    {
+        size_t segment = std::bit_width(id) - 1;
+        Slot *slots = segments[segment].load(std::memory_order_acquire);
+
+        if (slots == nullptr && create)
+        {
+            Slot *fresh = new Slot[size_t(1) << segment]();
+            if (segments[segment].compare_exchange_strong(slots, fresh, std::memory_order_acq_rel))
+            {
+                slots = fresh;
+            }
+            else
+            {
+                delete[] fresh;
+            }
+        }
+
+        return slots ? slots + (id - (uint32_t(1) << segment)) : nullptr;
+    }
+
+    Symbol SymbolTable::intern(std::string_view name)
+    {
+        if (name.empty())
+        {
+            return Symbol();
+        }
+
+        Shard &shard = shards[std::hash<std::string_view>()(name) % shard_count];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        auto it = shard.index.find(name);
+        if (it != shard.index.end())
+        {
+            return Symbol(it->second);
+        }
+
+        char *data = static_cast<char *>(shard.storage.allocate(name.size() + 1, 1));
+        std::memcpy(data, name.data(), name.size());
+        data[name.size()] = '\0';
+
+        auto entry = shard.storage.create<Symbol::Entry>();
+        entry->id = next.fetch_add(1, std::memory_order_relaxed);
+        entry->size = (uint32_t)name.size();
+        entry->data = data;
+
+        slot(entry->id, true)->store(entry, std::memory_order_release);
+        shard.index.emplace(std::string_view(data, name.size()), entry);
+
+        return Symbol(entry);
+    }
+
+    Symbol SymbolTable::lookup(uint32_t id) const
+    {
+        if (id == 0 || id >= next.load(std::memory_order_acquire))
+        {
+            return Symbol();
+        }
+
+        // An id being interned concurrently may not be published yet.
+        Slot *entry = slot(id, false);
+        const Symbol::Entry *value = entry ? entry->load(std::memory_order_acquire) : nullptr;
+        return value ? Symbol(value) : Symbol();
+    }
+
+    size_t SymbolTable::size() const
+    {
+        return next.load(std::memory_order_acquire) - 1;
+    }
+
+    SymbolTable &SymbolTable::global()
+    {
+        // Never destroyed, so symbols stay valid during static destruction.
+        static SymbolTable *table = new SymbolTable();
+        return *table;
+    }
+
+    ProgramBuilder::Producer &ProgramBuilder::producer()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return producers.emplace_back();
+    }
+
+    std::unique_ptr<Program> ProgramBuilder::build()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        size_t count = 0;
+        for (auto &producer : producers)
+        {
+            count += producer.items.size();
+        }
+
+        std::vector<std::pair<uint64_t, std::unique_ptr<Node>>> items;
+        items.reserve(count);
+
+        auto program = make<Program>();
+        program->arenas.reserve(producers.size());
+
+        for (auto &producer : producers)
+        {
+            std::move(producer.items.begin(), producer.items.end(), std::back_inserter(items));
+            program->arenas.push_back(std::move(producer.arena));
+        }
+        producers.clear();
+
+        std::stable_sort(items.begin(), items.end(), [](const auto &a, const auto &b)
+                         { return a.first < b.first; });
+
+        program->nodes.reserve(count);
+        for (auto &item : items)
+        {
+            program->push(std::move(item.second));
+        }
+
+        return program;
+    }
+
+    // Two independent multiply-xorshift lanes; fast, deterministic, and not
+    // meant to be cryptographic.
+    class Hasher
+    {
+    public:
+        Digest digest;
+        bool portable = true;
+
+        inline void mix(uint64_t value)
+        {
+            digest.low = (digest.low ^ value) * 0x9E3779B97F4A7C15ull;
+            digest.low ^= digest.low >> 29;
+            digest.high = (digest.high ^ value) * 0xC2B2AE3D27D4EB4Full;
+            digest.high ^= digest.high >> 31;
+        }
+
+        inline void mix(std::string_view text)
+        {
+            mix(text.size());
+
+            size_t i = 0;
+            for (; i + 8 <= text.size(); i += 8)
+            {
+                uint64_t chunk;
+                std::memcpy(&chunk, text.data() + i, 8);
+                mix(chunk);
+            }
+
+            uint64_t tail = 0;
+            std::memcpy(&tail, text.data() + i, text.size() - i);
+            mix(tail);
+        }
+
+        template <typename T>
+        inline void mix_value(const T &value)
+        {
+            if constexpr (std::is_same_v<T, std::string>)
+            {
+                mix(std::string_view(value));
+            }
+            else if constexpr (std::is_same_v<T, long double>)
+            {
+                double head = (double)value;
+                double rest = (double)(value - (long double)head);
+                mix_value(head);
+                mix_value(rest);
+            }
+            else
+            {
+                uint64_t bits = 0;
+                std::memcpy(&bits, &value, sizeof(T));
+                mix(bits);
+            }
+        }
+
+        void node(const Node *node)
+        {
+            if (node == nullptr)
+            {
+                mix(0xFFull);
+                return;
+            }
+
+            Node *n = const_cast<Node *>(node);
+            mix((uint64_t)n->node_kind + 1);
+
+            dispatch(n, overloaded{
+                            [&](Primitive *p)
+                            { mix((uint64_t)p->kind); },
+                            [&](Type *t)
+                            { mix(t->name.view()); },
+                            [&](ArrayOf *a)
+                            { mix((uint64_t)a->size); },
+                            [&](DeclLocal *d)
+                            { mix(d->name.view()); },
+                            [&](Function *f)
+                            { mix(f->name.view()); mix((uint64_t)f->parameters.size()); },
+                            [&](Field *f)
+                            { mix(f->name.view()); },
+                            [&](DeclType *d)
+                            { mix(d->name.view()); },
+                            [&](Local *l)
+                            { mix(l->name.view()); },
+                            [&]<typename T>(Literal<T> *l)
+                            { mix((uint64_t)l->literal_kind); mix_value(l->value); },
+                            [&](ArrayInit *a)
+                            {
+                                mix((uint64_t)a->element);
+                                mix((uint64_t)a->format);
+                                mix(std::string_view(static_cast<const char *>(a->data), a->size_bytes()));
+                            },
+                            [&](BinaryOp *b)
+                            { mix((uint64_t)b->op); },
+                            [&](UnaryOp *u)
+                            { mix((uint64_t)u->op); },
+                            [&](Node *other)
+                            {
+                                if (other->node_kind == NodeKind::Custom)
+                                {
+                                    mix((uint64_t)(uintptr_t)other);
+                                    portable = false;
+                                }
+                            },
+                        });
+
+            uint64_t children = 0;
+            for_each_child(n, [&](std::unique_ptr<Node> &child)
+                           { this->node(child.get()); children++; });
+            mix(children);
+        }
+    };
+
+    void link_parents(Node *root)
+    {
+        std::vector<Node *> stack{root};
+
+        while (!stack.empty())
+        {
+            Node *node = stack.back();
+            stack.pop_back();
+
+            for_each_child(node, [&](std::unique_ptr<Node> &child)
+                           {
+                               if (child && !(child->flags & (Node::Interned | Node::Shared)))
+                               {
+                                   child->parent = node;
+                                   stack.push_back(child.get());
+                               } });
+        }
+    }
+
+    const SymbolIndex::Entry &SymbolIndex::lookup(Symbol name) const
+    {
+        static const Entry empty;
+        auto it = entries.find(name);
+        return it != entries.end() ? it->second : empty;
+    }
+
+    void SymbolIndex::add(Node *root)
+    {
+        std::vector<Node *> stack{root};
+
+        while (!stack.empty())
+        {
+            Node *node = stack.back();
+            stack.pop_back();
+
+            dispatch(node, overloaded{
+                               [&](Function *n)
+                               { entries[n->name].definitions.push_back(n); },
+                               [&](DeclType *n)
+                               { entries[n->name].definitions.push_back(n); },
+                               [&](DeclLocal *n)
+                               { entries[n->name].definitions.push_back(n); },
+                               [&](Local *n)
+                               { entries[n->name].locals.push_back(n); },
+                               [&](Call *n)
+                               {
+                                   if (auto callee = n->node ? n->node->as<Local>() : nullptr)
+                                       entries[callee->name].calls.push_back(n);
+                               },
+                               [&](Type *n)
+                               { entries[n->name].types.push_back(n); },
+                               [&](Field *n)
+                               { entries[n->name].fields.push_back(n); },
+                               [](Node *) {},
+                           });
+
+            // Reversed onto the stack, so sites are listed in source order.
+            size_t first = stack.size();
+            for_each_child(node, [&](std::unique_ptr<Node> &child)
+                           {
+                               if (child)
+                                   stack.push_back(child.get()); });
+            std::reverse(stack.begin() + first, stack.end());
+        }
+    }
+
+    void SymbolIndex::pushed(Node *owner, Node *node)
+    {
+        Node *root = owner;
+        while (root->parent != nullptr)
+        {
+            root = root->parent;
+        }
+
+        if (auto program = root->as<Program>(); program && program->symbols)
+        {
+            program->symbols->add(node);
+        }
+    }
+
+    SymbolIndex &Program::index_symbols()
+    {
+        if (!symbols)
+        {
+            symbols = std::make_unique<SymbolIndex>();
+        }
+
+        symbols->clear();
+        symbols->add(this);
+        return *symbols;
+    }
+
+    // A copy of node's own fields with every child slot present but empty,
+    // or nullptr for a custom node that does not implement copy().
+    static std::unique_ptr<Node> copy_fields(Node *node)
+    {
+        return dispatch(node, overloaded{
+                                  [](Program *n) -> std::unique_ptr<Node>
+                                  { auto c = make<Program>(); c->nodes.resize(n->nodes.size()); return c; },
+                                  [](ArrayOf *n) -> std::unique_ptr<Node>
+                                  { auto c = make<ArrayOf>(); c->size = n->size; return c; },
+                                  [](Primitive *n) -> std::unique_ptr<Node>
+                                  { return make<Primitive>(n->kind); },
+                                  [](Type *n) -> std::unique_ptr<Node>
+                                  { auto c = make<Type>(); c->name = n->name; return c; },
+                                  []<typename T>(Literal<T> *n) -> std::unique_ptr<Node>
+                                  { auto c = make<Literal<T>>(); c->value = n->value; return c; },
+                                  [](DeclLocal *n) -> std::unique_ptr<Node>
+                                  { auto c = make<DeclLocal>(); c->name = n->name; return c; },
+                                  [](Block *n) -> std::unique_ptr<Node>
+                                  { auto c = make<Block>(); c->nodes.resize(n->nodes.size()); return c; },
+                                  [](Function *n) -> std::unique_ptr<Node>
+                                  { auto c = make<Function>(); c->name = n->name; c->parameters.resize(n->parameters.size()); return c; },
+                                  [](Field *n) -> std::unique_ptr<Node>
+                                  { auto c = make<Field>(); c->name = n->name; return c; },
+                                  [](DeclType *n) -> std::unique_ptr<Node>
+                                  { auto c = make<DeclType>(); c->name = n->name; c->fields.resize(n->fields.size()); return c; },
+                                  [](Local *n) -> std::unique_ptr<Node>
+                                  { auto c = make<Local>(); c->name = n->name; return c; },
+                                  [](Call *n) -> std::unique_ptr<Node>
+                                  { auto c = make<Call>(); c->nodes.resize(n->nodes.size()); return c; },
+                                  [](ArrayInit *n) -> std::unique_ptr<Node>
+                                  {
+                                      auto c = make<ArrayInit>();
+                                      c->element = n->element;
+                                      c->data = n->data;
+                                      c->count = n->count;
+                                      c->format = n->format;
+                                      return c;
+                                  },
+                                  [](BinaryOp *n) -> std::unique_ptr<Node>
+                                  { auto c = make<BinaryOp>(); c->op = n->op; return c; },
+                                  [](UnaryOp *n) -> std::unique_ptr<Node>
+                                  { auto c = make<UnaryOp>(); c->op = n->op; return c; },
+                                  []<typename T>(T *) -> std::unique_ptr<Node>
+                                  { return make<T>(); },
+                                  [](Node *n) -> std::unique_ptr<Node>
+                                  { return n->copy(); },
+                              });
+    }
+
+    // The child slots of node, in for_each_child() order.
+    static void child_slots(Node *node, std::vector<std::unique_ptr<Node> *> &slots)
+    {
+        slots.clear();
+        for_each_child(node, [&](std::unique_ptr<Node> &child)
+                       { slots.push_back(&child); });
+    }
+
+    std::unique_ptr<Node> clone(const Node *node)
+    {
+        if (node == nullptr)
+        {
+            return nullptr;
+        }
+
+        std::vector<Node *> stack{const_cast<Node *>(node)};
+
+        // An upper bound on the copy, padding included.
+        if (Arena *arena = ArenaScope::current())
+        {
+            size_t size = 0;
+            while (!stack.empty())
+            {
+                Node *next = stack.back();
+                stack.pop_back();
+                if (next->flags & Node::Interned)
+                {
+                    continue;
+                }
+
+                size += dispatch(next, [](auto *n)
+                                 { return sizeof(*n); }) +
+                        2 * alignof(std::max_align_t);
+                for_each_child(next, [&](std::unique_ptr<Node> &child)
+                               {
+                                   size += sizeof(std::unique_ptr<Node>);
+                                   if (child)
+                                       stack.push_back(child.get()); });
+            }
+            arena->reserve(size);
+        }
+
+        struct Step
+        {
+            Node *source;
+            std::unique_ptr<Node> *slot;
+            Node *parent;
+        };
+
+        std::unique_ptr<Node> result;
+        std::vector<Step> steps{{const_cast<Node *>(node), &result, nullptr}};
+        std::vector<std::unique_ptr<Node> *> slots;
+
+        // Pre-order, so a copy is laid out like a freshly built tree.
+        while (!steps.empty())
+        {
+            Step step = steps.back();
+            steps.pop_back();
+
+            if (step.source->flags & Node::Interned)
+            {
+                step.slot->reset(step.source);
+                continue;
+            }
+
+            *step.slot = copy_fields(step.source);
+            Node *copy = step.slot->get();
+            if (copy == nullptr)
+            {
+                continue;
+            }
+            copy->parent = step.parent;
+
+            child_slots(copy, slots);
+            size_t i = 0;
+            size_t first = steps.size();
+            for_each_child(step.source, [&](std::unique_ptr<Node> &child)
+                           {
+                               if (child)
+                                   steps.push_back({child.get(), slots[i], copy});
+                               i++; });
+            std::reverse(steps.begin() + first, steps.end());
+        }
+
+        return result;
+    }
+
+    std::unique_ptr<Node> share(Node *node)
+    {
+        if (node == nullptr || (node->flags & Node::Interned))
+        {
+            return std::unique_ptr<Node>(node);
+        }
+
+        if (!(node->flags & Node::Shared))
+        {
+            std::vector<Node *> stack{node};
+            while (!stack.empty())
+            {
+                Node *next = stack.back();
+                stack.pop_back();
+                next->flags |= Node::Shared;
+
+                // Already shared subtrees are frozen through.
+                for_each_child(next, [&](std::unique_ptr<Node> &child)
+                               {
+                                   if (child && !(child->flags & (Node::Interned | Node::Shared)))
+                                       stack.push_back(child.get()); });
+            }
+        }
+
+        std::atomic_ref<uint32_t>(node->shares).fetch_add(1, std::memory_order_relaxed);
+        node->parent = nullptr;
+        return std::unique_ptr<Node>(node);
+    }
+
+    Node *mutate(std::unique_ptr<Node> &slot, Node *parent)
+    {
+        Node *node = slot.get();
+        if (node == nullptr || !(node->flags & (Node::Interned | Node::Shared)))
+        {
+            return node;
+        }
+
+        // The only owner left can thaw it in place; its children stay frozen.
+        if (!(node->flags & Node::Interned) && std::atomic_ref<uint32_t>(node->shares).load(std::memory_order_acquire) == 0)
+        {
+            node->flags &= ~Node::Shared;
+        }
+        else
+        {
+            auto copy = copy_fields(node);
+            if (copy == nullptr)
+            {
+                return nullptr;
+            }
+
+            std::vector<std::unique_ptr<Node> *> slots;
+            child_slots(copy.get(), slots);
+            size_t i = 0;
+            for_each_child(node, [&](std::unique_ptr<Node> &child)
+                           { *slots[i++] = share(child.get()); });
+
+            slot = std::move(copy);
+            node = slot.get();
+        }
+
+        node->parent = parent;
+        node->mark_dirty();
+        return node;
+    }
+
+    Digest structural_digest(const Node *node)
+    {
+        Hasher hasher;
+        hasher.node(node);
+        return hasher.digest;
+    }
+
+    bool structurally_equal(const Node *a, const Node *b)
+    {
+        if (a == b)
+        {
+            return true;
+        }
+
+        if (a == nullptr || b == nullptr || a->node_kind != b->node_kind || a->node_kind == NodeKind::Custom)
+        {
+            return false;
+        }
+
+        Node *x = const_cast<Node *>(a);
+        Node *y = const_cast<Node *>(b);
+
+        bool same = dispatch(x, overloaded{
+                                    [&](Primitive *p)
+                                    { return p->kind == y->cast<Primitive>()->kind; },
+                                    [&](Type *t)
+                                    { return t->name == y->cast<Type>()->name; },
+                                    [&](ArrayOf *arr)
+                                    { return arr->size == y->cast<ArrayOf>()->size; },
+                                    [&](DeclLocal *d)
+                                    { return d->name == y->cast<DeclLocal>()->name; },
+                                    [&](Function *f)
+                                    { return f->name == y->cast<Function>()->name &&
+                                             f->parameters.size() == y->cast<Function>()->parameters.size(); },
+                                    [&](Field *f)
+                                    { return f->name == y->cast<Field>()->name; },
+                                    [&](DeclType *d)
+                                    { return d->name == y->cast<DeclType>()->name; },
+                                    [&](Local *l)
+                                    { return l->name == y->cast<Local>()->name; },
+                                    [&]<typename T>(Literal<T> *l)
+                                    {
+                                        auto other = y->as<Literal<T>>();
+                                        if (other == nullptr)
+                                            return false;
+                                        if constexpr (std::is_floating_point_v<T>)
+                                            return std::memcmp(&l->value, &other->value, sizeof(T)) == 0 || l->value == other->value;
+                                        else
+                                            return l->value == other->value;
+                                    },
+                                    [&](ArrayInit *arr)
+                                    {
+                                        auto other = y->cast<ArrayInit>();
+                                        return arr->element == other->element && arr->format == other->format &&
+                                               arr->count == other->count &&
+                                               (arr->count == 0 || arr->data == other->data || std::memcmp(arr->data, other->data, arr->size_bytes()) == 0);
+                                    },
+                                    [&](BinaryOp *b)
+                                    { return b->op == y->cast<BinaryOp>()->op; },
+                                    [&](UnaryOp *u)
+                                    { return u->op == y->cast<UnaryOp>()->op; },
+                                    [&](Node *)
+                                    { return true; },
+                                });
+
+        if (!same)
+        {
+            return false;
+        }
+
+        std::vector<Node *> children;
+        for_each_child(y, [&](std::unique_ptr<Node> &child)
+                       { children.push_back(child.get()); });
+
+        size_t i = 0;
+        for_each_child(x, [&](std::unique_ptr<Node> &child)
+                       { same = same && i < children.size() && structurally_equal(child.get(), children[i]); i++; });
+
+        return same && i == children.size();
+    }
+
+    // Renames over an existing file; readers see the old or the new one.
+    static bool replace_file(const char *from, const char *to)
+    {
+#ifdef _WIN32
+        return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+        return ::rename(from, to) == 0;
+#endif
+    }
+
+    RenderCache::RenderCache(Mode mode) : mode(mode) {}
+
+    RenderCache::~RenderCache() = default;
+
+    RenderCache::Key RenderCache::key(const Node *node) const
+    {
+        if (mode == Identity)
+        {
+            return {node, Digest()};
+        }
+
+        Hasher hasher;
+        hasher.node(node);
+        return {node, hasher.digest, hasher.portable};
+    }
+
+    const RenderCache::FileRecord *RenderCache::find_stored(const Digest &digest) const
+    {
+        auto it = std::lower_bound(records.begin(), records.end(), digest, [](const FileRecord &record, const Digest &digest)
+                                   { return record.digest.low != digest.low ? record.digest.low < digest.low : record.digest.high < digest.high; });
+
+        if (it == records.end() || !(it->digest == digest))
+        {
+            return nullptr;
+        }
+
+        // Records are checked as they are used rather than all on load.
+        return it->offset <= stored.size() && it->size <= stored.size() - it->offset ? &*it : nullptr;
+    }
+
+    bool RenderCache::write(const Key &key, Sink &out)
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+
+        if (mode == Identity)
+        {
+            auto it = by_node.find(key.node);
+            if (it != by_node.end())
+            {
+                out << it->second;
+                hit_count++;
+                return true;
+            }
+        }
+        else
+        {
+            auto it = by_digest.find(key.digest);
+            if (it != by_digest.end())
+            {
+                out << it->second.text;
+                hit_count++;
+                return true;
+            }
+
+            if (const FileRecord *record = key.portable ? find_stored(key.digest) : nullptr)
+            {
+                out << stored.substr(record->offset, record->size);
+                used[record - records.data()].store(true, std::memory_order_relaxed);
+                hit_count++;
+                return true;
+            }
+        }
+
+        miss_count++;
+        return false;
+    }
+
+    void RenderCache::store(const Key &key, std::string text)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+
+        if (mode == Identity)
+        {
+            by_node[key.node] = std::move(text);
+        }
+        else
+        {
+            by_digest[key.digest] = {std::move(text), key.portable};
+        }
+    }
+
+    void RenderCache::invalidate(const Node *node)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+
+        for (; node != nullptr; node = node->parent)
+        {
+            by_node.erase(node);
+        }
+    }
+
+    void RenderCache::clear()
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        by_node.clear();
+        by_digest.clear();
+        unload();
+    }
+
+    void RenderCache::unload()
+    {
+        records = {};
+        stored = {};
+        used.reset();
+        file.reset();
+    }
+
+    bool RenderCache::load(const char *path)
+    {
+        if (mode != Structural)
+        {
+            return false;
+        }
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        return map(path);
+    }
+
+    bool RenderCache::map(const char *path)
+    {
+        unload();
+
+        auto mapped = std::make_unique<MappedFile>(path);
+        if (!mapped->ok() || mapped->size() < sizeof(FileHeader) ||
+            reinterpret_cast<uintptr_t>(mapped->data()) % alignof(FileRecord) != 0)
+        {
+            return false;
+        }
+
+        FileHeader header;
+        std::memcpy(&header, mapped->data(), sizeof(header));
+
+        size_t available = (mapped->size() - sizeof(FileHeader)) / sizeof(FileRecord);
+        if (std::memcmp(header.magic, "CGENEMIT", 8) != 0 || header.version != file_version ||
+            header.byte_order != 0x01020304 || header.count > available ||
+            header.bytes != mapped->size() - sizeof(FileHeader) - header.count * sizeof(FileRecord))
+        {
+            return false;
+        }
+
+        const char *base = static_cast<const char *>(mapped->data()) + sizeof(FileHeader);
+        records = {reinterpret_cast<const FileRecord *>(base), size_t(header.count)};
+        stored = {base + header.count * sizeof(FileRecord), size_t(header.bytes)};
+        used.reset(new std::atomic<bool>[records.size()]());
+        file = std::move(mapped);
+        return true;
+    }
+
+    bool RenderCache::save(const char *path)
+    {
+        if (mode != Structural)
+        {
+            return false;
+        }
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+
+        struct Entry
+        {
+            Digest digest;
+            std::string_view text;
+        };
+
+        std::vector<Entry> entries;
+        for (auto &[digest, rendered] : by_digest)
+        {
+            if (rendered.portable)
+            {
+                entries.push_back({digest, rendered.text});
+            }
+        }
+
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            const FileRecord &record = records[i];
+            if (used[i].load(std::memory_order_relaxed) && !by_digest.contains(record.digest) &&
+                find_stored(record.digest) == &record)
+            {
+                entries.push_back({record.digest, stored.substr(record.offset, record.size)});
+            }
+        }
+
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b)
+                  { return a.digest.low != b.digest.low ? a.digest.low < b.digest.low : a.digest.high < b.digest.high; });
+
+        FileHeader header{};
+        std::memcpy(header.magic, "CGENEMIT", 8);
+        header.version = file_version;
+        header.byte_order = 0x01020304;
+        header.count = entries.size();
+        for (auto &entry : entries)
+        {
+            header.bytes += entry.text.size();
+        }
+
+        std::string temporary = std::string(path) + ".tmp";
+        {
+            FileWriter out(temporary.c_str());
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+            uint64_t offset = 0;
+            for (auto &entry : entries)
+            {
+                FileRecord record{entry.digest, offset, entry.text.size()};
+                out.write(reinterpret_cast<const char *>(&record), sizeof(record));
+                offset += entry.text.size();
+            }
+
+            for (auto &entry : entries)
+            {
+                out << entry.text;
+            }
+
+            out.flush();
+            if (!out.ok())
+            {
+                out.close();
+                std::remove(temporary.c_str());
+                return false;
+            }
+        }
+
+        // Windows cannot replace a mapped file, so the old one is unmapped
+        // first and the new one mapped in its place, counted as in use.
+        entries.clear();
+        unload();
+
+        if (!replace_file(temporary.c_str(), path))
+        {
+            std::remove(temporary.c_str());
+            map(path);
+            return false;
+        }
+
+        if (!map(path))
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            used[i].store(true, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    size_t RenderCache::size() const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return by_node.size() + by_digest.size();
+    }
+
+    template <typename T, typename F>
+    Node *TypeTable::find_or_create(const Key &key, F &&init)
+    {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it != index.end())
+            {
+                return it->second;
+            }
+        }
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it != index.end())
+        {
+            return it->second;
+        }
+
+        auto *entry = [&]
+        {
+            if constexpr (std::is_same_v<T, Primitive>)
+                return storage.create<Entry<T>>((Primitive::Kind)key.primitive);
+            else
+                return storage.create<Entry<T>>();
+        }();
+        init(entry);
+
+        CodeGenVisitor visitor;
+        std::string text = entry->accept(&visitor);
+        entry->flags |= Node::Interned;
+        char *data = static_cast<char *>(storage.allocate(text.size(), 1));
+        std::memcpy(data, text.data(), text.size());
+        entry->text = std::string_view(data, text.size());
+
+        index.emplace(key, entry);
+        return entry;
+    }
+
+    Node *TypeTable::primitive(Primitive::Kind kind)
+    {
+        return find_or_create<Primitive>({NodeKind::Primitive, (uint8_t)kind, nullptr, 0, {}}, [](Primitive *) {});
+    }
+
+    Node *TypeTable::named(Symbol name)
+    {
+        return find_or_create<Type>({NodeKind::Type, 0, nullptr, 0, name}, [&](Type *t)
+                                    { t->name = name; });
+    }
+
+    Node *TypeTable::pointer_of(Node *type)
+    {
+        type = intern(type);
+        return find_or_create<PointerOf>({NodeKind::PointerOf, 0, type, 0, {}}, [&](PointerOf *p)
+                                         { p->node.reset(type); });
+    }
+
+    Node *TypeTable::array_of(Node *type, size_t size)
+    {
+        type = intern(type);
+        return find_or_create<ArrayOf>({NodeKind::ArrayOf, 0, type, size, {}}, [&](ArrayOf *a)
+                                       { a->node.reset(type); a->size = size; });
+    }
+
+    Node *TypeTable::intern(Node *node)
+    {
+        if (node == nullptr)
+        {
+            return nullptr;
+        }
+
+        if (node->flags & Node::Interned)
+        {
+            return node;
+        }
+
+        switch (node->node_kind)
+        {
+        case NodeKind::Primitive:
+            return primitive(node->cast<Primitive>()->kind);
+        case NodeKind::Type:
+            return named(node->cast<Type>()->name);
+        case NodeKind::PointerOf:
+        {
+            Node *child = intern(node->cast<PointerOf>()->node.get());
+            return child ? pointer_of(child) : nullptr;
+        }
+        case NodeKind::ArrayOf:
+        {
+            auto arr = node->cast<ArrayOf>();
+            Node *child = intern(arr->node.get());
+            return child ? array_of(child, arr->size) : nullptr;
+        }
+        default:
+            return nullptr;
+        }
+    }
+
+    bool same_type(const Node *a, const Node *b)
+    {
+        if (a == b)
+        {
+            return true;
+        }
+
+        if (a == nullptr || b == nullptr || a->node_kind != b->node_kind)
+        {
+            return false;
+        }
+
+        switch (a->node_kind)
+        {
+        case NodeKind::Primitive:
+            return a->cast<Primitive>()->kind == b->cast<Primitive>()->kind;
+        case NodeKind::Type:
+            return a->cast<Type>()->name == b->cast<Type>()->name;
+        case NodeKind::PointerOf:
+            return same_type(a->cast<PointerOf>()->node.get(), b->cast<PointerOf>()->node.get());
+        case NodeKind::ArrayOf:
+            return a->cast<ArrayOf>()->size == b->cast<ArrayOf>()->size &&
+                   same_type(a->cast<ArrayOf>()->node.get(), b->cast<ArrayOf>()->node.get());
+        default:
+            return false;
+        }
+    }
+
+    void FileSink::write(const char *data, size_t size)
+    {
+        while (size > 0 && !error)
+        {
+            size_t written = fwrite(data, 1, size, file);
+            data += written;
+            size -= written;
+
+            if (size > 0)
+            {
+                if (errno != EINTR)
+                {
+                    error = true;
+                }
+                clearerr(file);
+            }
+        }
+    }
+
+    // All of data to fd, retrying short and interrupted writes; false on
+    // any other error.
+    static bool write_fd(int fd, const char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            auto written = __CGEN_WRITE(fd, data, size);
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written <= 0)
+            {
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    void FdSink::write(const char *data, size_t size)
+    {
+        if (error)
+        {
+            return;
+        }
+
+        if (used + size > sizeof(buffer))
+        {
+            flush();
+        }
+
+        if (size >= sizeof(buffer))
+        {
+            error = error || !write_fd(fd, data, size);
+            return;
+        }
+
+        std::memcpy(buffer + used, data, size);
+        used += size;
+    }
+
+    void FdSink::flush()
+    {
+        if (!error && !write_fd(fd, buffer, used))
+        {
+            error = true;
+        }
+        used = 0;
+    }
+
+    FileWriter::FileWriter(const char *path, size_t buffer_size)
+        : buffer(new char[std::max<size_t>(buffer_size, 1)]), capacity(std::max<size_t>(buffer_size, 1))
+    {
+#ifdef _WIN32
+        fd = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#else
+        fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif
+    }
+
+    void FileWriter::write(const char *data, size_t size)
+    {
+        if (used + size <= capacity)
+        {
+            std::memcpy(buffer.get() + used, data, size);
+            used += size;
+            return;
+        }
+
+        write_all(buffer.get(), used, data, size);
+        used = 0;
+    }
+
+    void FileWriter::flush()
+    {
+        write_all(buffer.get(), used, nullptr, 0);
+        used = 0;
+    }
+
+    void FileWriter::close()
+    {
+        if (fd < 0)
+        {
+            return;
+        }
+
+        flush();
+#ifdef _WIN32
+        _close(fd);
+#else
+        ::close(fd);
+#endif
+        fd = -1;
+    }
+
+    void FileWriter::write_all(const char *head, size_t head_size, const char *tail, size_t tail_size)
+    {
+        if (fd < 0 || error)
+        {
+            error = true;
+            return;
+        }
+
+        written += head_size + tail_size;
+
+#ifdef _WIN32
+        if (!write_fd(fd, head, head_size) || !write_fd(fd, tail, tail_size))
+        {
+            error = true;
+        }
+#else
+        iovec parts[2] = {{const_cast<char *>(head), head_size}, {const_cast<char *>(tail), tail_size}};
+        iovec *part = parts;
+        int count = 2;
+
+        while (count > 0)
+        {
+            if (part->iov_len == 0)
+            {
+                part++;
+                count--;
+                continue;
+            }
+
+            auto n = ::writev(fd, part, count);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                error = true;
+                return;
+            }
+
+            for (size_t left = n; left > 0;)
+            {
+                size_t step = std::min(left, part->iov_len);
+                part->iov_base = static_cast<char *>(part->iov_base) + step;
+                part->iov_len -= step;
+                left -= step;
+                if (part->iov_len == 0)
+                {
+                    part++;
+                    count--;
+                }
+            }
+        }
+#endif
+    }
+
+    void CodeGenVisitor::emit(Node *node, Sink &out)
+    {
+        Sink *previous = sink;
+        sink = &out;
+        emit(node);
+        sink = previous;
+    }
+
+    // emit_parallel runs tasks from per-thread deques: the owner takes from
+    // the back, and idle workers steal from the front, where the larger
+    // ranges are. A task is a range of a Program's nodes, a Block's
+    // statements or a Call's arguments. A busy worker hands the second half
+    // of the range it is in to the scheduler when others are idle, so work
+    // is split inside nodes only when someone can take it.
+    //
+    // Text handed off that way goes to a chain of segments in program
+    // order. The split links the handed-off segment and a continuation
+    // after the current one, and only the thread writing a segment links
+    // after it. The chain is read once every task is done.
+    struct EmitSegment
+    {
+        std::string text;
+        StringSink string{text};
+        CountingSink counter;
+        Sink *out = &string;
+        EmitSegment *next = nullptr;
+    };
+
+    // out is null for a range of top-level nodes laid out by offset, as
+    // the string overload of emit_parallel does.
+    struct EmitTask
+    {
+        Node *owner;
+        size_t begin;
+        size_t end;
+        EmitSegment *out;
+    };
+
+    // A top-level node (string overload): bytes it wrote or counted
+    // directly, and the segments split off from it, if any.
+    struct EmitPiece
+    {
+        size_t node;
+        size_t bytes;
+        EmitSegment *chain;
+    };
+
+    class EmitScheduler;
+
+    class EmitWorker
+    {
+    public:
+        EmitScheduler &scheduler;
+        CodeGenVisitor visitor;
+        EmitSegment *current = nullptr;
+        std::vector<EmitPiece> pieces;
+        size_t splits = 0;
+        size_t steals = 0;
+
+        EmitWorker(EmitScheduler &scheduler, const CodeGenVisitor &base) : scheduler(scheduler), visitor(base)
+        {
+            visitor.worker = this;
+        }
+
+        // Only while output goes straight to the current segment: a render
+        // cache entry or an instrumentation frame being written must stay
+        // in one piece.
+        inline bool wants_split(const Sink *sink);
+
+        // Queues [task.begin, task.end) and returns the segment to resume
+        // in once the part kept is written, creating it if resume is null.
+        EmitSegment *spawn(EmitTask task, EmitSegment *resume);
+        void resume(EmitSegment *segment);
+        void push(const EmitTask &task);
+
+        void run(const EmitTask &task);
+        void run_nodes(size_t begin, size_t end);
+        bool take(EmitTask &task);
+        bool steal(EmitTask &task);
+        void work();
+        void reset();
+
+    private:
+        // Other workers being idle is checked every this many list items,
+        // not on each one.
+        static constexpr unsigned split_interval = 16;
+        unsigned countdown = 1;
+
+        EmitSegment head;
+        std::deque<EmitSegment> segments;
+        std::mutex mutex;
+        std::deque<EmitTask> tasks;
+
+        inline bool peers_hungry();
+    };
+
+    class EmitScheduler
+    {
+    public:
+        Program *program;
+        std::vector<std::unique_ptr<EmitWorker>> workers;
+        EmitSegment root;
+
+        // Top-level tasks either count, or write node i at data + offsets[i].
+        bool counting = false;
+        char *data = nullptr;
+        std::vector<size_t> offsets;
+
+        // Tasks queued or running, queued ones, and workers without a
+        // task. Idle workers sleep on wake until a task is queued or all
+        // are done.
+        std::atomic<size_t> pending{0};
+        std::atomic<size_t> queued{0};
+        std::atomic<size_t> hungry{0};
+        std::mutex mutex;
+        std::condition_variable wake;
+
+        EmitScheduler(const CodeGenVisitor &base, unsigned threads, Program *program) : program(program)
+        {
+            for (unsigned i = 0; i < threads; i++)
+            {
+                workers.push_back(std::make_unique<EmitWorker>(*this, base));
+            }
+        }
+
+        // Every worker starts hungry except the one that takes task.
+        void run(const EmitTask &task)
+        {
+            for (auto &w : workers)
+            {
+                w->reset();
+            }
+            hungry = workers.size();
+            workers[0]->push(task);
+
+            std::vector<std::thread> threads;
+            for (size_t i = 1; i < workers.size(); i++)
+            {
+                threads.emplace_back(&EmitWorker::work, workers[i].get());
+            }
+            workers[0]->work();
+
+            for (auto &t : threads)
+            {
+                t.join();
+            }
+        }
+
+        void signal(bool all)
+        {
+            {
+                std::lock_guard lock(mutex);
+            }
+            if (all)
+                wake.notify_all();
+            else
+                wake.notify_one();
+        }
+
+        void add_stats(CodeGenVisitor::ParallelStats &stats) const
+        {
+            for (auto &w : workers)
+            {
+                stats.splits += w->splits;
+                stats.steals += w->steals;
+            }
+        }
+    };
+
+    inline bool EmitWorker::peers_hungry()
+    {
+        if (--countdown != 0)
+        {
+            return false;
+        }
+        countdown = split_interval;
+        return scheduler.hungry.load(std::memory_order_relaxed) > scheduler.queued.load(std::memory_order_relaxed);
+    }
+
+    inline bool EmitWorker::wants_split(const Sink *sink)
+    {
+        return sink == current->out && peers_hungry();
+    }
+
+    EmitSegment *EmitWorker::spawn(EmitTask task, EmitSegment *resume)
+    {
+        auto segment = [&]
+        {
+            EmitSegment *s = &segments.emplace_back();
+            if (scheduler.counting)
+                s->out = &s->counter;
+            return s;
+        };
+
+        if (resume == nullptr)
+        {
+            resume = segment();
+            resume->next = current->next;
+            current->next = resume;
+        }
+
+        task.out = segment();
+        task.out->next = current->next;
+        current->next = task.out;
+
+        splits++;
+        push(task);
+        return resume;
+    }
+
+    void EmitWorker::push(const EmitTask &task)
+    {
+        scheduler.pending++;
+        {
+            std::lock_guard lock(mutex);
+            tasks.push_back(task);
+        }
+        scheduler.queued++;
+        if (scheduler.hungry > 0)
+        {
+            scheduler.signal(false);
+        }
+    }
+
+    void EmitWorker::resume(EmitSegment *segment)
+    {
+        current = segment;
+        visitor.sink = segment->out;
+    }
+
+    void EmitWorker::run(const EmitTask &task)
+    {
+        countdown = 1;
+        if (task.out == nullptr)
+        {
+            run_nodes(task.begin, task.end);
+            return;
+        }
+
+        resume(task.out);
+        visitor.emit_list(task.owner, task.begin, task.end);
+        visitor.sink = nullptr;
+    }
+
+    // Top-level nodes [begin, end) straight into their place in the output
+    // (or counted), splitting the range itself without segments.
+    void EmitWorker::run_nodes(size_t begin, size_t end)
+    {
+        auto &nodes = scheduler.program->nodes;
+
+        for (size_t i = begin; i < end; i++)
+        {
+            if (end - i > 1 && peers_hungry())
+            {
+                size_t middle = i + (end - i + 1) / 2;
+                splits++;
+                push({scheduler.program, middle, end, nullptr});
+                end = middle;
+            }
+
+            std::optional<SpanSink> span;
+            if (scheduler.counting)
+            {
+                head.counter.count = 0;
+                head.out = &head.counter;
+            }
+            else
+            {
+                span.emplace(scheduler.data + scheduler.offsets[i], scheduler.offsets[i + 1] - scheduler.offsets[i]);
+                head.out = &*span;
+            }
+            head.next = nullptr;
+
+            resume(&head);
+            visitor.emit(nodes[i].get());
+            *visitor.sink << ';';
+            pieces.push_back({i, span ? span->used : head.counter.count, head.next});
+        }
+
+        visitor.sink = nullptr;
+    }
+
+    bool EmitWorker::take(EmitTask &task)
+    {
+        std::lock_guard lock(mutex);
+        if (tasks.empty())
+        {
+            return false;
+        }
+        task = tasks.back();
+        tasks.pop_back();
+        scheduler.queued--;
+        return true;
+    }
+
+    bool EmitWorker::steal(EmitTask &task)
+    {
+        std::lock_guard lock(mutex);
+        if (tasks.empty())
+        {
+            return false;
+        }
+        task = tasks.front();
+        tasks.pop_front();
+        scheduler.queued--;
+        return true;
+    }
+
+    void EmitWorker::work()
+    {
+        auto &workers = scheduler.workers;
+        size_t self = 0;
+        while (workers[self].get() != this)
+        {
+            self++;
+        }
+
+        bool hungry = true;
+        for (;;)
+        {
+            EmitTask task;
+            bool found = take(task);
+            for (size_t i = 1; !found && i < workers.size(); i++)
+            {
+                found = workers[(self + i) % workers.size()]->steal(task);
+                steals += found;
+            }
+
+            if (found)
+            {
+                if (hungry)
+                {
+                    scheduler.hungry--;
+                    hungry = false;
+                }
+                run(task);
+                if (--scheduler.pending == 0)
+                {
+                    scheduler.signal(true);
+                }
+                continue;
+            }
+
+            if (!hungry)
+            {
+                scheduler.hungry++;
+                hungry = true;
+            }
+
+            std::unique_lock lock(scheduler.mutex);
+            scheduler.wake.wait(lock, [&]
+                                { return scheduler.queued > 0 || scheduler.pending == 0; });
+            if (scheduler.pending == 0)
+            {
+                break;
+            }
+        }
+
+        scheduler.hungry--;
+    }
+
+    void EmitWorker::reset()
+    {
+        segments.clear();
+        pieces.clear();
+        current = nullptr;
+    }
+
+    static NodeList &list_of(Node *owner)
+    {
+        if (auto block = owner->as<Block>())
+        {
+            return block->nodes;
+        }
+        if (auto call = owner->as<Call>())
+        {
+            return call->nodes;
+        }
+        return owner->cast<Program>()->nodes;
+    }
+
+    static unsigned thread_count(unsigned threads)
+    {
+        return threads == 0 ? std::max(1u, std::thread::hardware_concurrency()) : threads;
+    }
+
+    void CodeGenVisitor::emit_parallel(Program *program, Sink &out, unsigned threads)
+    {
+        parallel_stats = {};
+        threads = thread_count(threads);
+        if (threads == 1 || program->nodes.empty())
+        {
+            emit(program, out);
+            return;
+        }
+
+        EmitScheduler scheduler(*this, threads, program);
+        scheduler.run({program, 0, program->nodes.size(), &scheduler.root});
+        scheduler.add_stats(parallel_stats);
+
+        for (EmitSegment *segment = &scheduler.root; segment != nullptr; segment = segment->next)
+        {
+            out << segment->text;
+            parallel_stats.copied += segment->text.size();
+        }
+    }
+
+    void CodeGenVisitor::emit_parallel(Program *program, std::string &out, unsigned threads)
+    {
+        parallel_stats = {};
+        auto &nodes = program->nodes;
+        threads = thread_count(threads);
+        if (threads == 1 || nodes.empty())
+        {
+            emit_sized(program, out);
+            return;
+        }
+
+        EmitScheduler scheduler(*this, threads, program);
+        auto &offsets = scheduler.offsets;
+
+        // Measure: each top-level node's size is what it counted directly
+        // plus the counts of the segments split off from it.
+        offsets.assign(nodes.size() + 1, 0);
+        scheduler.counting = true;
+        scheduler.run({program, 0, nodes.size(), nullptr});
+        for (auto &w : scheduler.workers)
+        {
+            for (auto &piece : w->pieces)
+            {
+                size_t size = piece.bytes;
+                for (EmitSegment *s = piece.chain; s != nullptr; s = s->next)
+                {
+                    size += s->counter.count;
+                }
+                offsets[piece.node + 1] = size;
+            }
+        }
+
+        offsets[0] = out.size();
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            offsets[i + 1] += offsets[i];
+        }
+        out.resize(offsets.back());
+
+        // Write in place. Text split off inside a node follows the part
+        // its worker wrote directly, within the node's span.
+        scheduler.counting = false;
+        scheduler.data = out.data();
+        scheduler.run({program, 0, nodes.size(), nullptr});
+        for (auto &w : scheduler.workers)
+        {
+            for (auto &piece : w->pieces)
+            {
+                char *at = out.data() + offsets[piece.node] + piece.bytes;
+                for (EmitSegment *s = piece.chain; s != nullptr; s = s->next)
+                {
+                    assert(at + s->text.size() <= out.data() + offsets[piece.node + 1] && "output grew between measuring and writing");
+                    std::memcpy(at, s->text.data(), std::min<size_t>(s->text.size(), out.data() + offsets[piece.node + 1] - at));
+                    at += s->text.size();
+                    parallel_stats.copied += s->text.size();
+                }
+            }
+        }
+        scheduler.add_stats(parallel_stats);
+    }
+
+    size_t CodeGenVisitor::measure(Node *node)
+    {
+        CountingSink counter;
+        emit(node, counter);
+        return counter.count;
+    }
+
+    void CodeGenVisitor::emit_sized(Node *node, std::string &out)
+    {
+        size_t base = out.size();
+        size_t size = measure(node);
+        out.resize(base + size);
+
+        SpanSink sink(out.data() + base, size);
+        emit(node, sink);
+    }
+
+    void CodeGenVisitor::emit_sections(Program *program, Sink &decls, Sink &defs)
+    {
+        for (auto &n : program->nodes)
+        {
+            Node *node = n.get();
+            if (auto s = node->as<Static>())
+            {
+                node = s->node.get();
+            }
+
+            Sink &out = node != nullptr && node->is<Function>() ? defs : decls;
+            emit(n.get(), out);
+            out << ';';
+        }
+    }
+
+    void CodeGenVisitor::emit_prototype(Function *node, Sink &out)
+    {
+        Sink *previous = sink;
+        sink = &out;
+        emit_signature(node);
+        sink = previous;
+    }
+
+    // The variable a top-level DeclLocal or initialized Assign defines.
+    static DeclLocal *global_variable(Node *node)
+    {
+        if (auto assign = node->as<Assign>())
+        {
+            node = assign->lhs.get();
+        }
+        return node != nullptr ? node->as<DeclLocal>() : nullptr;
+    }
+
+    // Whether a Local anywhere under node has one of names.
+    static bool names_any(Node *node, const std::vector<Symbol> &names)
+    {
+        std::vector<Node *> work{node};
+        while (!work.empty())
+        {
+            Node *n = work.back();
+            work.pop_back();
+
+            if (auto l = n->as<Local>(); l && std::find(names.begin(), names.end(), l->name) != names.end())
+            {
+                return true;
+            }
+
+            for_each_child(n, [&](std::unique_ptr<Node> &child)
+                           {
+                               if (child)
+                                   work.push_back(child.get()); });
+        }
+        return false;
+    }
+
+    TranslationUnits CodeGenVisitor::emit_sharded(Program *program, size_t count, std::string_view header_name)
+    {
+        TranslationUnits result;
+        StringSink header(result.header);
+        header << "#pragma once\n";
+
+        std::vector<Function *> functions;
+        std::vector<std::string> bodies;
+        std::string globals;
+        StringSink globals_sink(globals);
+        // Names with internal linkage, all defined in unit 0.
+        std::vector<Symbol> statics;
+
+        for (auto &n : program->nodes)
+        {
+            if (auto fn = n->as<Function>())
+            {
+                emit_prototype(fn, header);
+                header << ";\n";
+
+                functions.push_back(fn);
+                bodies.emplace_back();
+                StringSink body(bodies.back());
+                emit(fn, body);
+                body << ";\n";
+            }
+            else if (auto local = n->as<Static>())
+            {
+                if (auto fn = local->node ? local->node->as<Function>() : nullptr)
+                {
+                    statics.push_back(fn->name);
+                }
+                else if (auto decl = local->node ? global_variable(local->node.get()) : nullptr)
+                {
+                    statics.push_back(decl->name);
+                }
+
+                emit(local, globals_sink);
+                globals_sink << ";\n";
+            }
+            else if (auto decl = global_variable(n.get()))
+            {
+                header << "extern ";
+                emit(decl, header);
+                header << ";\n";
+
+                emit(n.get(), globals_sink);
+                globals_sink << ";\n";
+            }
+            else
+            {
+                emit(n.get(), header);
+                header << ";\n";
+            }
+        }
+
+        count = std::max<size_t>(1, std::min(count, functions.size()));
+
+        // Functions that use a static go to unit 0 first; then the largest
+        // bodies, each into the currently smallest unit.
+        std::vector<bool> pinned(functions.size());
+        std::vector<size_t> order(functions.size());
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            order[i] = i;
+            pinned[i] = !statics.empty() && names_any(functions[i], statics);
+        }
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                         { return pinned[a] != pinned[b] ? bool(pinned[a]) : bodies[a].size() > bodies[b].size(); });
+
+        std::vector<size_t> load(count, 0);
+        std::vector<size_t> unit_of(functions.size());
+        for (size_t i : order)
+        {
+            size_t unit = pinned[i] ? 0 : std::min_element(load.begin(), load.end()) - load.begin();
+            unit_of[i] = unit;
+            load[unit] += bodies[i].size();
+        }
+
+        result.units.resize(count);
+        for (size_t unit = 0; unit < count; unit++)
+        {
+            auto &text = result.units[unit];
+            text.reserve(load[unit] + header_name.size() + 12 + (unit == 0 ? globals.size() : 0));
+            text += "#include \"";
+            text += header_name;
+            text += "\"\n";
+
+            if (unit == 0)
+            {
+                text += globals;
+            }
+        }
+
+        // Program order within each unit keeps output deterministic.
+        for (size_t i = 0; i < functions.size(); i++)
+        {
+            result.units[unit_of[i]] += bodies[i];
+        }
+
+        return result;
+    }
+
+    ProgramWriter::ProgramWriter(Sink &out, size_t capacity, CodeGenVisitor visitor)
+        : out(out), capacity(std::max<size_t>(1, capacity)), visitor(visitor)
+    {
+        worker = std::thread(&ProgramWriter::run, this);
+    }
+
+    bool ProgramWriter::push(std::unique_ptr<Node> node)
+    {
+        std::unique_lock lock(mutex);
+        not_full.wait(lock, [&]
+                      { return closing || queue.size() < capacity; });
+        // The worker may have exited, so the node would never be written.
+        assert(!closing && "push() after close()");
+        if (closing)
+        {
+            return false;
+        }
+        queue.push_back(std::move(node));
+        lock.unlock();
+        not_empty.notify_one();
+        return true;
+    }
+
+    void ProgramWriter::close()
+    {
+        {
+            std::lock_guard lock(mutex);
+            if (closing)
+            {
+                return;
+            }
+            closing = true;
+        }
+        not_empty.notify_one();
+        not_full.notify_all();
+        worker.join();
+    }
+
+    void ProgramWriter::run()
+    {
+        for (;;)
+        {
+            std::unique_ptr<Node> node;
+            {
+                std::unique_lock lock(mutex);
+                not_empty.wait(lock, [&]
+                               { return !queue.empty() || closing; });
+                if (queue.empty())
+                {
+                    return;
+                }
+                node = std::move(queue.front());
+                queue.pop_front();
+            }
+            not_full.notify_one();
+
+            visitor.emit(node.get(), out);
+            out << ';';
+            node.reset();
+            emitted.fetch_add(1, std::memory_order_release);
+        }
+    }
+
+    void IncrementalEmitter::render(Segment &segment)
+    {
+        bytes -= segment.text.size();
+        segment.text.clear();
+
+        StringSink sink(segment.text);
+        visitor.emit(segment.node, sink);
+        sink << ';';
+        bytes += segment.text.size();
+
+        // Edits may have attached nodes by plain assignment; relink them and
+        // clear the dirty marks in one walk.
+        std::vector<Node *> stack{segment.node};
+        segment.node->parent = program;
+
+        while (!stack.empty())
+        {
+            Node *node = stack.back();
+            stack.pop_back();
+            node->flags &= ~Node::Dirty;
+
+            for_each_child(node, [&](std::unique_ptr<Node> &child)
+                           {
+                               if (child && !(child->flags & (Node::Interned | Node::Shared)))
+                               {
+                                   child->parent = node;
+                                   stack.push_back(child.get());
+                               } });
+        }
+    }
+
+    size_t IncrementalEmitter::update()
+    {
+        auto &nodes = program->nodes;
+        size_t rendered = 0;
+        size_t i = 0;
+
+        for (; i < nodes.size() && i < segments.size() && nodes[i].get() == segments[i].node; i++)
+        {
+            if (segments[i].node->flags & Node::Dirty)
+            {
+                render(segments[i]);
+                rendered++;
+            }
+        }
+
+        if (i < nodes.size() || i < segments.size())
+        {
+            // Nodes were inserted, removed or replaced: keep text for every
+            // clean node that is still present and render the rest.
+            std::unordered_map<const Node *, std::string> previous;
+            for (size_t j = i; j < segments.size(); j++)
+            {
+                previous.emplace(segments[j].node, std::move(segments[j].text));
+                bytes -= previous[segments[j].node].size();
+            }
+            segments.resize(i);
+
+            for (; i < nodes.size(); i++)
+            {
+                segments.push_back({nodes[i].get(), {}});
+                Segment &segment = segments.back();
+                auto it = previous.find(segment.node);
+
+                if (it != previous.end() && !(segment.node->flags & Node::Dirty))
+                {
+                    segment.text = std::move(it->second);
+                    bytes += segment.text.size();
+                }
+                else
+                {
+                    render(segment);
+                    rendered++;
+                }
+            }
+        }
+
+        program->flags &= ~Node::Dirty;
+        return rendered;
+    }
+
+    void IncrementalEmitter::write(Sink &out) const
+    {
+        for (auto &segment : segments)
+        {
+            out << segment.text;
+        }
+    }
+
+    std::string IncrementalEmitter::str() const
+    {
+        std::string out;
+        out.reserve(bytes);
+        StringSink sink(out);
+        write(sink);
+        return out;
+    }
+
+    AcceptResult CodeGenVisitor::visit(Node *node)
+    {
+        return node->accept(this);
+    }
+
+    // Finite negative literals are written with a leading '-', so they bind
+    // like a prefix operator; infinities, NaN and the minimum of a signed
+    // type come parenthesized.
+    template <typename T>
+    static inline bool negative_literal(const T &value)
+    {
+        if constexpr (std::is_floating_point_v<T>)
+            return std::signbit(value) && std::isfinite(value);
+        else if constexpr (std::is_integral_v<T> && std::is_signed_v<T> && !std::is_same_v<T, char>)
+            return value < 0 && (sizeof(T) < sizeof(int) || value != std::numeric_limits<T>::min());
+        else
+            return false;
+    }
+
+    static Precedence expression_precedence(Node *node)
+    {
+        if (node == nullptr)
+        {
+            return Precedence::Primary;
+        }
+
+        return dispatch(node, overloaded{
+                                  [](BinaryOp *n)
+                                  { return BinaryOp::precedence(n->op); },
+                                  [](UnaryOp *n)
+                                  { return UnaryOp::postfix(n->op) ? Precedence::Postfix : Precedence::Prefix; },
+                                  [](Deref *)
+                                  { return Precedence::Prefix; },
+                                  [](GetRef *)
+                                  { return Precedence::Prefix; },
+                                  [](Cast *)
+                                  { return Precedence::Prefix; },
+                                  [](Index *)
+                                  { return Precedence::Postfix; },
+                                  [](Call *)
+                                  { return Precedence::Postfix; },
+                                  [](Field *)
+                                  { return Precedence::Postfix; },
+                                  [](Assign *)
+                                  { return Precedence::Assignment; },
+                                  []<typename T>(Literal<T> *n)
+                                  { return negative_literal(n->value) ? Precedence::Prefix : Precedence::Primary; },
+                                  [](auto *)
+                                  { return Precedence::Primary; },
+                              });
+    }
+
+    // right marks the right operand of a (left-associative) binary operator.
+    static inline bool parenthesize(Precedence operand, Precedence context, bool right = false)
+    {
+        return operand > context || (right && operand == context);
+    }
+
+    // Whether an operand starting with next, written straight after an
+    // operator ending in last, would lex as another token: "a- -b",
+    // "a& &b", "a/ *p".
+    static inline bool pastes(char last, char next)
+    {
+        return (last == next && (last == '-' || last == '+' || last == '&' || last == '|')) || (last == '/' && next == '*');
+    }
+
+    // First character node is written with, as far as pastes() cares.
+    static char leading_char(Node *node)
+    {
+        while (node != nullptr)
+        {
+            Node *next = nullptr;
+            Precedence context = Precedence::Postfix;
+
+            switch (node->node_kind)
+            {
+            case NodeKind::UnaryOp:
+            {
+                auto u = node->cast<UnaryOp>();
+                if (!UnaryOp::postfix(u->op))
+                    return UnaryOp::spelling(u->op)[0];
+                next = u->node.get();
+                break;
+            }
+            case NodeKind::Deref:
+                return '*';
+            case NodeKind::GetRef:
+                return '&';
+            case NodeKind::Cast:
+                return '(';
+            case NodeKind::Literal:
+                return expression_precedence(node) == Precedence::Prefix ? '-' : 0;
+            case NodeKind::BinaryOp:
+            {
+                auto b = node->cast<BinaryOp>();
+                next = b->lhs.get();
+                context = BinaryOp::precedence(b->op);
+                break;
+            }
+            case NodeKind::Index:
+                next = node->cast<Index>()->node.get();
+                break;
+            case NodeKind::Call:
+                next = node->cast<Call>()->node.get();
+                break;
+            case NodeKind::Field:
+                next = node->cast<Field>()->type.get();
+                break;
+            case NodeKind::Assign:
+                next = node->cast<Assign>()->lhs.get();
+                context = Precedence::Assignment;
+                break;
+            default:
+                return 0;
+            }
+
+            if (parenthesize(expression_precedence(next), context))
+            {
+                return '(';
+            }
+            node = next;
+        }
+        return 0;
+    }
+
+#define __CGEN_RENDER(type)                             \
+    AcceptResult CodeGenVisitor::visit(type *node)      \
+    {                                                   \
+        return render(node);                            \
+    }
+
+    __CGEN_RENDER(Program)
+    __CGEN_RENDER(Primitive)
+    __CGEN_RENDER(Type)
+    __CGEN_RENDER(PointerOf)
+    __CGEN_RENDER(ArrayOf)
+    __CGEN_RENDER(Static)
+    __CGEN_RENDER(DeclLocal)
+    __CGEN_RENDER(Block)
+    __CGEN_RENDER(Function)
+    __CGEN_RENDER(Return)
+    __CGEN_RENDER(Assign)
+    __CGEN_RENDER(Field)
+    __CGEN_RENDER(Deref)
+    __CGEN_RENDER(GetRef)
+    __CGEN_RENDER(DeclType)
+    __CGEN_RENDER(Local)
+    __CGEN_RENDER(Call)
+    __CGEN_RENDER(ArrayInit)
+    __CGEN_RENDER(BinaryOp)
+    __CGEN_RENDER(UnaryOp)
+    __CGEN_RENDER(Index)
+    __CGEN_RENDER(Cast)
+
+#undef __CGEN_RENDER
+
+    void CodeGenVisitor::emit_custom(Node *node)
+    {
+        // User nodes either render themselves and return text, or call back
+        // into a visit overload that writes into the sink and returns nothing.
+        AcceptResult text = node->accept(this);
+        if (!text.empty())
+        {
+            *sink << text;
+        }
+    }
+
+    void CodeGenVisitor::emit_cached(Node *node)
+    {
+        auto key = cache->key(node);
+        if (cache->write(key, *sink))
+        {
+            return;
+        }
+
+        std::string text;
+        Sink *previous = sink;
+        StringSink out(text);
+        sink = &out;
+        dispatch(node, [this](auto *n)
+                 { emit(n); });
+        sink = previous;
+
+        *sink << text;
+        cache->store(key, std::move(text));
+    }
+
+#ifdef CGEN_INSTRUMENTATION
+    // Counts what passes through and forwards it.
+    class CountingForwardSink final : public Sink
+    {
+    public:
+        Sink &out;
+        uint64_t count = 0;
+
+        explicit CountingForwardSink(Sink &out) : out(out) {}
+
+        void write(const char *data, size_t size) override
+        {
+            count += size;
+            out.write(data, size);
+        }
+    };
+
+    // One per emit(Node *) on the stack. The outermost frame of a thread
+    // interposes a counting sink; nested frames charge their totals to
+    // the parent so it can report self figures.
+    class InstrumentationFrame
+    {
+    public:
+        InstrumentationFrame(NodeKind kind, Sink *&sink) : kind(kind), sink(sink), parent(current)
+        {
+            if (parent == nullptr || parent->sink != sink)
+            {
+                previous = sink;
+                counter.emplace(*sink);
+                sink = &*counter;
+                root_counter = &*counter;
+            }
+            else
+            {
+                root_counter = parent->root_counter;
+            }
+
+            current = this;
+            start_bytes = root_counter->count;
+            start = std::chrono::steady_clock::now();
+        }
+
+        ~InstrumentationFrame()
+        {
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            uint64_t bytes = root_counter->count - start_bytes;
+
+            auto &counters = Instrumentation::global().kinds[size_t(kind)];
+            counters.visits.fetch_add(1, std::memory_order_relaxed);
+            counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+            counters.self_bytes.fetch_add(bytes - child_bytes, std::memory_order_relaxed);
+            counters.nanoseconds.fetch_add(ns, std::memory_order_relaxed);
+            counters.self_nanoseconds.fetch_add(ns > child_ns ? ns - child_ns : 0, std::memory_order_relaxed);
+
+            current = parent;
+            if (parent != nullptr && parent->root_counter == root_counter)
+            {
+                parent->child_bytes += bytes;
+                parent->child_ns += ns;
+            }
+
+            if (counter)
+            {
+                sink = previous;
+            }
+        }
+
+    private:
+        NodeKind kind;
+        Sink *&sink;
+        InstrumentationFrame *parent;
+        Sink *previous = nullptr;
+        std::optional<CountingForwardSink> counter;
+        CountingForwardSink *root_counter;
+        uint64_t start_bytes = 0;
+        uint64_t child_bytes = 0;
+        uint64_t child_ns = 0;
+        std::chrono::steady_clock::time_point start;
+
+        static thread_local InstrumentationFrame *current;
+    };
+
+    thread_local InstrumentationFrame *InstrumentationFrame::current = nullptr;
+
+    Instrumentation &Instrumentation::global()
+    {
+        static Instrumentation instance;
+        return instance;
+    }
+
+    void Instrumentation::reset()
+    {
+        for (auto &c : kinds)
+        {
+            for (auto *counter : {&c.visits, &c.bytes, &c.self_bytes, &c.nanoseconds, &c.self_nanoseconds, &c.allocations, &c.allocated_bytes})
+            {
+                counter->store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void Instrumentation::write_json(Sink &out) const
+    {
+        out << "{\"kinds\":{";
+
+        bool first = true;
+        for (size_t i = 0; i < node_kind_count; i++)
+        {
+            auto &c = kinds[i];
+            if (c.visits == 0 && c.allocations == 0)
+            {
+                continue;
+            }
+
+            out << (first ? "" : ",") << '"' << kind_name(NodeKind(i)) << "\":{"
+                << "\"visits\":" << size_t(c.visits) << ",\"bytes\":" << size_t(c.bytes)
+                << ",\"self_bytes\":" << size_t(c.self_bytes) << ",\"ns\":" << size_t(c.nanoseconds)
+                << ",\"self_ns\":" << size_t(c.self_nanoseconds) << ",\"allocations\":" << size_t(c.allocations)
+                << ",\"allocated_bytes\":" << size_t(c.allocated_bytes) << '}';
+            first = false;
+        }
+
+        out << "}}";
+    }
+#endif
+
+    void CodeGenVisitor::emit(Node *node)
+    {
+        if (depth >= max_depth)
+        {
+            emit_iterative(node);
+            return;
+        }
+
+        depth++;
+        emit_node(node);
+        depth--;
+    }
+
+    void CodeGenVisitor::emit_node(Node *node)
+    {
+#ifdef CGEN_INSTRUMENTATION
+        InstrumentationFrame frame(node->node_kind, sink);
+#endif
+
+        if (cache != nullptr && cache->caches(node->node_kind))
+        {
+            emit_cached(node);
+            return;
+        }
+
+        dispatch(node, overloaded{
+                           [this](Node *n)
+                           { emit_custom(n); },
+                           [this](auto *n)
+                           { emit(n); },
+                       });
+    }
+
+    void CodeGenVisitor::emit(Program *node)
+    {
+        emit_list(node, 0, node->nodes.size());
+    }
+
+    void CodeGenVisitor::emit(Primitive *node)
+    {
+        if (node->flags & Node::Interned)
+        {
+            *sink << TypeTable::text(node);
+            return;
+        }
+
+        *sink << Primitive::spelling(node->kind);
+    }
+
+    void CodeGenVisitor::emit(Type *node)
+    {
+        if (node->flags & Node::Interned)
+        {
+            *sink << TypeTable::text(node);
+            return;
+        }
+
+        *sink << "struct " << node->name;
+    }
+
+    void CodeGenVisitor::emit(PointerOf *node)
+    {
+        if (node->flags & Node::Interned)
+        {
+            *sink << TypeTable::text(node);
+            return;
+        }
+
+        emit(node->node.get());
+        *sink << '*';
+    }
+
+    void CodeGenVisitor::emit(ArrayOf *node)
+    {
+        if (node->flags & Node::Interned)
+        {
+            *sink << TypeTable::text(node);
+            return;
+        }
+
+        emit(node->node.get());
+        *sink << '[';
+        if (node->size > 0)
+        {
+            *sink << node->size;
+        }
+        *sink << ']';
+    }
+
+    void CodeGenVisitor::emit(Static *node)
+    {
+        *sink << "static ";
+        emit(node->node.get());
+    }
+
+    void CodeGenVisitor::emit(DeclLocal *node)
+    {
+        emit(node->type.get());
+        *sink << ' ' << node->name;
+    }
+
+    void CodeGenVisitor::emit(Block *node)
+    {
+        *sink << '{';
+        emit_list(node, 0, node->nodes.size());
+        *sink << '}';
+    }
+
+    void CodeGenVisitor::emit(Function *node)
+    {
+        emit_signature(node);
+        emit(node->body.get());
+    }
+
+    void CodeGenVisitor::emit_signature(Function *node)
+    {
+        emit(node->return_type.get());
+        *sink << ' ' << node->name << '(';
+
+        for (size_t i = 0; i < node->parameters.size(); i++)
+        {
+            emit(node->parameters[i].get());
+
+            if (i < node->parameters.size() - 1)
+            {
+                *sink << ", ";
+            }
+        }
+
+        *sink << ')';
+    }
+
+    void CodeGenVisitor::emit(Return *node)
+    {
+        *sink << "return ";
+        emit(node->node.get());
+    }
+
+    void CodeGenVisitor::emit(Assign *node)
+    {
+        emit(node->lhs.get());
+        *sink << " = ";
+        emit(node->rhs.get());
+    }
+
+    void CodeGenVisitor::emit(Field *node)
+    {
+        emit_operand(node->type.get(), parenthesize(expression_precedence(node->type.get()), Precedence::Postfix));
+        *sink << '.' << node->name;
+    }
+
+    void CodeGenVisitor::emit(Deref *node)
+    {
+        emit_prefix("*", node->node.get());
+    }
+
+    void CodeGenVisitor::emit(DeclType *node)
+    {
+        *sink << "struct " << node->name << '{';
+
+        for (size_t i = 0; i < node->fields.size(); i++)
+        {
+            emit(node->fields[i].get());
+            *sink << ';';
+        }
+
+        *sink << "};";
+    }
+
+    void CodeGenVisitor::emit(Local *node)
+    {
+        *sink << node->name;
+    }
+
+    void CodeGenVisitor::emit(Call *node)
+    {
+        emit_operand(node->node.get(), parenthesize(expression_precedence(node->node.get()), Precedence::Postfix));
+        *sink << '(';
+        emit_list(node, 0, node->nodes.size());
+        *sink << ')';
+    }
+
+    // Items [begin, end) of a Program or Block, each followed by ';', or of
+    // a Call's arguments, separated by ','. Under emit_parallel the second
+    // half of what is left goes to an idle worker.
+    void CodeGenVisitor::emit_list(Node *owner, size_t begin, size_t end)
+    {
+        auto &nodes = list_of(owner);
+        bool arguments = owner->is<Call>();
+        EmitSegment *resume = nullptr;
+
+        for (size_t i = begin; i < end; i++)
+        {
+            if (worker != nullptr && end - i > 1 && worker->wants_split(sink))
+            {
+                size_t middle = i + (end - i + 1) / 2;
+                resume = worker->spawn({owner, middle, end, nullptr}, resume);
+                end = middle;
+            }
+
+            if (arguments && i > 0)
+            {
+                *sink << ',';
+            }
+            emit(nodes[i].get());
+            if (!arguments)
+            {
+                *sink << ';';
+            }
+        }
+
+        if (resume != nullptr)
+        {
+            worker->resume(resume);
+        }
+    }
+
+    void CodeGenVisitor::emit(GetRef *node)
+    {
+        emit_prefix("&", node->node.get());
+    }
+
+    void CodeGenVisitor::emit_operand(Node *node, bool parenthesized)
+    {
+        if (parenthesized)
+        {
+            *sink << '(';
+            emit(node);
+            *sink << ')';
+            return;
+        }
+
+        emit(node);
+    }
+
+    void CodeGenVisitor::emit_prefix(std::string_view op, Node *operand)
+    {
+        bool parenthesized = parenthesize(expression_precedence(operand), Precedence::Prefix);
+        *sink << op;
+        if (!parenthesized && pastes(op.back(), leading_char(operand)))
+        {
+            *sink << ' ';
+        }
+        emit_operand(operand, parenthesized);
+    }
+
+    void CodeGenVisitor::emit(BinaryOp *node)
+    {
+        Precedence level = BinaryOp::precedence(node->op);
+        std::string_view op = BinaryOp::spelling(node->op);
+        bool parenthesized = parenthesize(expression_precedence(node->rhs.get()), level, true);
+
+        emit_operand(node->lhs.get(), parenthesize(expression_precedence(node->lhs.get()), level));
+        *sink << op;
+        if (!parenthesized && pastes(op.back(), leading_char(node->rhs.get())))
+        {
+            *sink << ' ';
+        }
+        emit_operand(node->rhs.get(), parenthesized);
+    }
+
+    void CodeGenVisitor::emit(UnaryOp *node)
+    {
+        if (UnaryOp::postfix(node->op))
+        {
+            emit_operand(node->node.get(), parenthesize(expression_precedence(node->node.get()), Precedence::Postfix));
+            *sink << UnaryOp::spelling(node->op);
+            return;
+        }
+
+        emit_prefix(UnaryOp::spelling(node->op), node->node.get());
+    }
+
+    void CodeGenVisitor::emit(Index *node)
+    {
+        emit_operand(node->node.get(), parenthesize(expression_precedence(node->node.get()), Precedence::Postfix));
+        *sink << '[';
+        emit(node->index.get());
+        *sink << ']';
+    }
+
+    void CodeGenVisitor::emit(Cast *node)
+    {
+        *sink << '(';
+        emit(node->type.get());
+        *sink << ')';
+        emit_operand(node->node.get(), parenthesize(expression_precedence(node->node.get()), Precedence::Prefix));
+    }
+
+    // "\xHH" for every byte of data, 16 bytes per step with SSE2.
+    static void write_hex_escaped(BufferedSink &out, const uint8_t *data, size_t size)
+    {
+        static const char digits[] = "0123456789abcdef";
+        size_t i = 0;
+
+#ifdef __CGEN_SSE2
+        const __m128i mask = _mm_set1_epi8(0x0F);
+        const __m128i nine = _mm_set1_epi8(9);
+        const __m128i zero = _mm_set1_epi8('0');
+        const __m128i gap = _mm_set1_epi8('a' - '0' - 10);
+        const __m128i prefix = _mm_set1_epi16(('x' << 8) | '\\');
+
+        for (; i + 16 <= size; i += 16)
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            __m128i hi = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+            __m128i lo = _mm_and_si128(bytes, mask);
+
+            hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), gap));
+            lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), gap));
+
+            __m128i pairs0 = _mm_unpacklo_epi8(hi, lo);
+            __m128i pairs1 = _mm_unpackhi_epi8(hi, lo);
+
+            char *dst = out.reserve(64);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm_unpacklo_epi16(prefix, pairs0));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 16), _mm_unpackhi_epi16(prefix, pairs0));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 32), _mm_unpacklo_epi16(prefix, pairs1));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 48), _mm_unpackhi_epi16(prefix, pairs1));
+            out.commit(64);
+        }
+#endif
+
+        for (; i < size; i++)
+        {
+            char *dst = out.reserve(4);
+            dst[0] = '\\';
+            dst[1] = 'x';
+            dst[2] = digits[data[i] >> 4];
+            dst[3] = digits[data[i] & 0x0F];
+            out.commit(4);
+        }
+    }
+
+    template <typename T>
+    static void write_elements(BufferedSink &out, const void *data, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            T value;
+            std::memcpy(&value, static_cast<const char *>(data) + i * sizeof(T), sizeof(T));
+
+            if (i > 0)
+            {
+                out << ',';
+            }
+
+            if constexpr (std::is_floating_point_v<T>)
+            {
+                write_float(out, value);
+            }
+            else if constexpr (sizeof(T) == 1 && std::is_unsigned_v<T>)
+            {
+                // Bytes dominate data tables; skip to_chars for them.
+                char *dst = out.reserve(3);
+                size_t n = value >= 100 ? 3 : value >= 10 ? 2
+                                                          : 1;
+                for (size_t d = n; d-- > 0; value /= 10)
+                {
+                    dst[d] = char('0' + value % 10);
+                }
+                out.commit(n);
+            }
+            else
+            {
+                write_integer<std::conditional_t<(sizeof(T) < sizeof(int)), int, T>>(out, value);
+            }
+        }
+    }
+
+    void CodeGenVisitor::emit(ArrayInit *node)
+    {
+        BufferedSink out(*sink);
+
+        if (node->format == ArrayInit::String && ArrayInit::element_size(node->element) == 1)
+        {
+            // Split into adjacent literals to keep lines and pieces short.
+            constexpr size_t piece = 1024;
+            auto bytes = static_cast<const uint8_t *>(node->data);
+
+            out << '"';
+            for (size_t i = 0; i < node->count; i += piece)
+            {
+                if (i > 0)
+                {
+                    out << "\"\n\"";
+                }
+                write_hex_escaped(out, bytes + i, std::min(piece, node->count - i));
+            }
+            out << '"';
+            return;
+        }
+
+        // An empty initializer list is only valid from C23 on.
+        if (node->count == 0)
+        {
+            out << "{0}";
+            return;
+        }
+
+        out << '{';
+
+        switch (node->element)
+        {
+        case Primitive::i8:
+            write_elements<int8_t>(out, node->data, node->count);
+            break;
+        case Primitive::u8:
+            write_elements<uint8_t>(out, node->data, node->count);
+            break;
+        case Primitive::i16:
+            write_elements<int16_t>(out, node->data, node->count);
+            break;
+        case Primitive::u16:
+            write_elements<uint16_t>(out, node->data, node->count);
+            break;
+        case Primitive::i32:
+            write_elements<int32_t>(out, node->data, node->count);
+            break;
+        case Primitive::u32:
+            write_elements<uint32_t>(out, node->data, node->count);
+            break;
+        case Primitive::i64:
+            write_elements<int64_t>(out, node->data, node->count);
+            break;
+        case Primitive::u64:
+            write_elements<uint64_t>(out, node->data, node->count);
+            break;
+        case Primitive::f32:
+            write_elements<float>(out, node->data, node->count);
+            break;
+        case Primitive::f64:
+            write_elements<double>(out, node->data, node->count);
+            break;
+        }
+
+        out << '}';
+    }
+
+    template <typename F>
+    static void with_literal_type(LiteralBase::Kind kind, F &&f)
+    {
+        switch (kind)
+        {
+        case LiteralBase::Bool:
+            return f(std::type_identity<bool>{});
+        case LiteralBase::Char:
+            return f(std::type_identity<char>{});
+        case LiteralBase::SChar:
+            return f(std::type_identity<signed char>{});
+        case LiteralBase::UChar:
+            return f(std::type_identity<unsigned char>{});
+        case LiteralBase::Short:
+            return f(std::type_identity<short>{});
+        case LiteralBase::UShort:
+            return f(std::type_identity<unsigned short>{});
+        case LiteralBase::Int:
+            return f(std::type_identity<int>{});
+        case LiteralBase::UInt:
+            return f(std::type_identity<unsigned int>{});
+        case LiteralBase::Long:
+            return f(std::type_identity<long>{});
+        case LiteralBase::ULong:
+            return f(std::type_identity<unsigned long>{});
+        case LiteralBase::LongLong:
+            return f(std::type_identity<long long>{});
+        case LiteralBase::ULongLong:
+            return f(std::type_identity<unsigned long long>{});
+        case LiteralBase::Float:
+            return f(std::type_identity<float>{});
+        case LiteralBase::Double:
+            return f(std::type_identity<double>{});
+        case LiteralBase::LongDouble:
+            return f(std::type_identity<long double>{});
+        case LiteralBase::String:
+            return f(std::type_identity<std::string>{});
+        }
+    }
+
+    // Literals that fit are stored by value; the rest go to the byte pool.
+    template <typename T>
+    constexpr bool flat_inline_literal = sizeof(T) <= sizeof(uint64_t) && std::is_trivially_copyable_v<T>;
+
+    uint64_t FlatTree::store(const void *data, size_t size)
+    {
+        uint64_t offset = bytes.size();
+        if (size > 0)
+        {
+            bytes.append(static_cast<const char *>(data), size);
+        }
+        return offset << 32 | size;
+    }
+
+    uint64_t FlatTree::store(Symbol name)
+    {
+        auto [it, inserted] = names.try_emplace(name.id(), 0);
+        if (inserted)
+        {
+            it->second = store(name.data(), name.size());
+        }
+        return it->second;
+    }
+
+    FlatTree::Index FlatTree::add(const Node *node)
+    {
+        if (node == nullptr || node->node_kind == NodeKind::Custom)
+        {
+            return FlatView::none;
+        }
+
+        if (node->flags & (Node::Interned | Node::Shared))
+        {
+            if (auto it = shared.find(node); it != shared.end())
+            {
+                return it->second;
+            }
+        }
+
+        Index index = (Index)kinds.size();
+        uint8_t tag = 0;
+        uint64_t value = 0;
+
+        dispatch(const_cast<Node *>(node), overloaded{
+                                               [&](Primitive *n)
+                                               { tag = n->kind; },
+                                               [&](Type *n)
+                                               { value = store(n->name); },
+                                               [&](ArrayOf *n)
+                                               { value = n->size; },
+                                               [&](DeclLocal *n)
+                                               { value = store(n->name); },
+                                               [&](Function *n)
+                                               { value = store(n->name); },
+                                               [&](Field *n)
+                                               { value = store(n->name); },
+                                               [&](DeclType *n)
+                                               { value = store(n->name); },
+                                               [&](Local *n)
+                                               { value = store(n->name); },
+                                               [&]<typename T>(Literal<T> *n)
+                                               {
+                                                   tag = n->literal_kind;
+                                                   if constexpr (std::is_same_v<T, std::string>)
+                                                       value = store(n->value.data(), n->value.size());
+                                                   else if constexpr (flat_inline_literal<T>)
+                                                       std::memcpy(&value, &n->value, sizeof(T));
+                                                   else
+                                                       value = store(&n->value, sizeof(T));
+                                               },
+                                               [&](ArrayInit *n)
+                                               {
+                                                   tag = uint8_t(n->element | n->format << 4);
+                                                   value = store(n->data, n->size_bytes());
+                                               },
+                                               [&](BinaryOp *n)
+                                               { tag = n->op; },
+                                               [&](UnaryOp *n)
+                                               { tag = n->op; },
+                                               [&](Node *) {},
+                                           });
+
+        kinds.push_back(node->node_kind);
+        tags.push_back(tag);
+        values.push_back(value);
+
+        if (node->flags & (Node::Interned | Node::Shared))
+        {
+            shared.emplace(node, index);
+        }
+
+        // Reserve the child block first so it stays contiguous while the
+        // children append blocks of their own behind it.
+        uint32_t count = 0;
+        for_each_child(const_cast<Node *>(node), [&](std::unique_ptr<Node> &)
+                       { count++; });
+
+        uint32_t block = (uint32_t)children.size();
+        first.push_back(block);
+        counts.push_back(count);
+        children.resize(children.size() + count);
+
+        uint32_t i = 0;
+        for_each_child(const_cast<Node *>(node), [&](std::unique_ptr<Node> &child)
+                       {
+                           Index c = add(child.get());
+                           children[block + i++] = c; });
+
+        return index;
+    }
+
+    FlatTree::FlatTree(const Node *node)
+    {
+        root = add(node);
+        shrink();
+    }
+
+    void FlatTree::shrink()
+    {
+        kinds.shrink_to_fit();
+        tags.shrink_to_fit();
+        first.shrink_to_fit();
+        counts.shrink_to_fit();
+        values.shrink_to_fit();
+        children.shrink_to_fit();
+        bytes.shrink_to_fit();
+        shared = {};
+        names = {};
+    }
+
+    FlatView FlatTree::view() const
+    {
+        return FlatView{kinds, tags, first, counts, values, children, bytes, root};
+    }
+
+    size_t FlatTree::memory_used() const
+    {
+        return kinds.capacity() * sizeof(NodeKind) + tags.capacity() + first.capacity() * sizeof(uint32_t) +
+               counts.capacity() * sizeof(uint32_t) + values.capacity() * sizeof(uint64_t) +
+               children.capacity() * sizeof(Index) + bytes.capacity();
+    }
+
+    std::string FlatView::str() const
+    {
+        std::string result;
+        StringSink out(result);
+        emit(out);
+        return result;
+    }
+
+    static bool flat_negative_literal(const FlatView &view, FlatView::Index node)
+    {
+        bool negative = false;
+        with_literal_type(LiteralBase::Kind(view.tags[node]), [&]<typename T>(std::type_identity<T>)
+                          {
+                              if constexpr (!std::is_same_v<T, std::string>)
+                              {
+                                  T value;
+                                  std::memcpy(&value, flat_inline_literal<T> ? (const void *)&view.values[node] : view.text(node).data(), sizeof(T));
+                                  negative = negative_literal(value);
+                              } });
+        return negative;
+    }
+
+    // expression_precedence() and leading_char() over a flat tree.
+    static Precedence flat_precedence(const FlatView &view, FlatView::Index node)
+    {
+        if (node == FlatView::none)
+        {
+            return Precedence::Primary;
+        }
+
+        switch (view.kinds[node])
+        {
+        case NodeKind::BinaryOp:
+            return BinaryOp::precedence(BinaryOp::Op(view.tags[node]));
+        case NodeKind::UnaryOp:
+            return UnaryOp::postfix(UnaryOp::Op(view.tags[node])) ? Precedence::Postfix : Precedence::Prefix;
+        case NodeKind::Deref:
+        case NodeKind::GetRef:
+        case NodeKind::Cast:
+            return Precedence::Prefix;
+        case NodeKind::Index:
+        case NodeKind::Call:
+        case NodeKind::Field:
+            return Precedence::Postfix;
+        case NodeKind::Assign:
+            return Precedence::Assignment;
+        case NodeKind::Literal:
+            return flat_negative_literal(view, node) ? Precedence::Prefix : Precedence::Primary;
+        default:
+            return Precedence::Primary;
+        }
+    }
+
+    static char flat_leading_char(const FlatView &view, FlatView::Index node)
+    {
+        while (node != FlatView::none)
+        {
+            Precedence context = Precedence::Postfix;
+
+            switch (view.kinds[node])
+            {
+            case NodeKind::UnaryOp:
+            {
+                auto op = UnaryOp::Op(view.tags[node]);
+                if (!UnaryOp::postfix(op))
+                    return UnaryOp::spelling(op)[0];
+                break;
+            }
+            case NodeKind::Deref:
+                return '*';
+            case NodeKind::GetRef:
+                return '&';
+            case NodeKind::Cast:
+                return '(';
+            case NodeKind::Literal:
+                return flat_negative_literal(view, node) ? '-' : 0;
+            case NodeKind::BinaryOp:
+                context = BinaryOp::precedence(BinaryOp::Op(view.tags[node]));
+                break;
+            case NodeKind::Index:
+            case NodeKind::Call:
+            case NodeKind::Field:
+                break;
+            case NodeKind::Assign:
+                context = Precedence::Assignment;
+                break;
+            default:
+                return 0;
+            }
+
+            FlatView::Index next = view.children_of(node)[0];
+            if (parenthesize(flat_precedence(view, next), context))
+            {
+                return '(';
+            }
+            node = next;
+        }
+        return 0;
+    }
+
+    void FlatView::emit(Index node, Sink &out) const
+    {
+        if (node == none)
+        {
+            return;
+        }
+
+        auto list = children_of(node);
+        auto operand = [&](Index child, bool parenthesized)
+        {
+            if (parenthesized)
+                out << '(';
+            emit(child, out);
+            if (parenthesized)
+                out << ')';
+        };
+        auto prefix = [&](std::string_view op, Index child)
+        {
+            bool parenthesized = parenthesize(flat_precedence(*this, child), Precedence::Prefix);
+            out << op;
+            if (!parenthesized && pastes(op.back(), flat_leading_char(*this, child)))
+                out << ' ';
+            operand(child, parenthesized);
+        };
+
+        switch (kinds[node])
+        {
+        case NodeKind::Program:
+            for (Index c : list)
+            {
+                emit(c, out);
+                out << ';';
+            }
+            break;
+        case NodeKind::PointerOf:
+            emit(list[0], out);
+            out << '*';
+            break;
+        case NodeKind::ArrayOf:
+            emit(list[0], out);
+            out << '[';
+            if (values[node] > 0)
+            {
+                out << size_t(values[node]);
+            }
+            out << ']';
+            break;
+        case NodeKind::Primitive:
+            out << Primitive::spelling(Primitive::Kind(tags[node]));
+            break;
+        case NodeKind::Type:
+            out << "struct " << text(node);
+            break;
+        case NodeKind::Static:
+            out << "static ";
+            emit(list[0], out);
+            break;
+        case NodeKind::Literal:
+            with_literal_type(LiteralBase::Kind(tags[node]), [&]<typename T>(std::type_identity<T>)
+                              {
+                                  if constexpr (std::is_same_v<T, std::string>)
+                                  {
+                                      write_quoted(out, text(node));
+                                  }
+                                  else
+                                  {
+                                      T value;
+                                      std::memcpy(&value, flat_inline_literal<T> ? (const void *)&values[node] : text(node).data(), sizeof(T));
+                                      Literal<T>::write(out, value);
+                                  } });
+            break;
+        case NodeKind::DeclLocal:
+            emit(list[0], out);
+            out << ' ' << text(node);
+            break;
+        case NodeKind::Assign:
+            emit(list[0], out);
+            out << " = ";
+            emit(list[1], out);
+            break;
+        case NodeKind::Block:
+            out << '{';
+            for (Index c : list)
+            {
+                emit(c, out);
+                out << ';';
+            }
+            out << '}';
+            break;
+        case NodeKind::Function:
+            emit(list[0], out);
+            out << ' ' << text(node) << '(';
+            for (size_t i = 1; i + 1 < list.size(); i++)
+            {
+                emit(list[i], out);
+                if (i + 2 < list.size())
+                {
+                    out << ", ";
+                }
+            }
+            out << ')';
+            emit(list.back(), out);
+            break;
+        case NodeKind::Return:
+            out << "return ";
+            emit(list[0], out);
+            break;
+        case NodeKind::Field:
+            operand(list[0], parenthesize(flat_precedence(*this, list[0]), Precedence::Postfix));
+            out << '.' << text(node);
+            break;
+        case NodeKind::DeclType:
+            out << "struct " << text(node) << '{';
+            for (Index c : list)
+            {
+                emit(c, out);
+                out << ';';
+            }
+            out << "};";
+            break;
+        case NodeKind::Deref:
+            prefix("*", list[0]);
+            break;
+        case NodeKind::GetRef:
+            prefix("&", list[0]);
+            break;
+        case NodeKind::Local:
+            out << text(node);
+            break;
+        case NodeKind::Call:
+            operand(list[0], parenthesize(flat_precedence(*this, list[0]), Precedence::Postfix));
+            out << '(';
+            for (size_t i = 1; i < list.size(); i++)
+            {
+                emit(list[i], out);
+                if (i + 1 < list.size())
+                {
+                    out << ',';
+                }
+            }
+            out << ')';
+            break;
+        case NodeKind::ArrayInit:
+        {
+            // Reuse the node emitter on a stack node viewing the pool.
+            ArrayInit table;
+            table.element = Primitive::Kind(tags[node] & 0x0F);
+            table.format = ArrayInit::Format(tags[node] >> 4);
+            table.data = text(node).data();
+            table.count = text(node).size() / ArrayInit::element_size(table.element);
+            CodeGenVisitor().emit(&table, out);
+            break;
+        }
+        case NodeKind::BinaryOp:
+        {
+            auto op = BinaryOp::Op(tags[node]);
+            Precedence level = BinaryOp::precedence(op);
+            std::string_view spelling = BinaryOp::spelling(op);
+            bool parenthesized = parenthesize(flat_precedence(*this, list[1]), level, true);
+
+            operand(list[0], parenthesize(flat_precedence(*this, list[0]), level));
+            out << spelling;
+            if (!parenthesized && pastes(spelling.back(), flat_leading_char(*this, list[1])))
+            {
+                out << ' ';
+            }
+            operand(list[1], parenthesized);
+            break;
+        }
+        case NodeKind::UnaryOp:
+        {
+            auto op = UnaryOp::Op(tags[node]);
+            if (UnaryOp::postfix(op))
+            {
+                operand(list[0], parenthesize(flat_precedence(*this, list[0]), Precedence::Postfix));
+                out << UnaryOp::spelling(op);
+            }
+            else
+            {
+                prefix(UnaryOp::spelling(op), list[0]);
+            }
+            break;
+        }
+        case NodeKind::Index:
+            operand(list[0], parenthesize(flat_precedence(*this, list[0]), Precedence::Postfix));
+            out << '[';
+            emit(list[1], out);
+            out << ']';
+            break;
+        case NodeKind::Cast:
+            out << '(';
+            emit(list[0], out);
+            out << ')';
+            operand(list[1], parenthesize(flat_precedence(*this, list[1]), Precedence::Prefix));
+            break;
+        case NodeKind::Custom:
+            break;
+        }
+    }
+
+    std::unique_ptr<Node> FlatView::to_tree(Index node) const
+    {
+        if (node == none)
+        {
+            return nullptr;
+        }
+
+        auto list = children_of(node);
+        std::unique_ptr<Node> result;
+
+        switch (kinds[node])
+        {
+        case NodeKind::Program:
+        {
+            auto n = make<Program>();
+            n->nodes.resize(list.size());
+            result = std::move(n);
+            break;
+        }
+        case NodeKind::PointerOf:
+            result = make<PointerOf>();
+            break;
+        case NodeKind::ArrayOf:
+        {
+            auto n = make<ArrayOf>();
+            n->size = size_t(values[node]);
+            result = std::move(n);
+            break;
+        }
+        case NodeKind::Primitive:
+            result = make<Primitive>(Primitive::Kind(tags[node]));
+            break;
+        case NodeKind::Type:
+        {
+            auto n = make<Type>();
+            n->name = text(node);
+            result = std::move(n);
+            break;
+        }
+        case NodeKind::Static:
+            result = make<Static>();
+            break;
+        case NodeKind::Literal:
+            with_literal_type(LiteralBase::Kind(tags[node]), [&]<typename T>(std::type_identity<T>)
+                              {
+                                  auto n = make<Literal<T>>();
+                                  if constexpr (std::is_same_v<T, std::string>)
+                                      n->value = text(node);
+                                  else
+                                      std::memcpy(&n->value, flat_inline_literal<T> ? (const void *)&values[node] : text(node).data(), sizeof(T));
+                                  result = std::move(n); });
+            break;
+        case NodeKind::DeclLocal:
+        {
+            auto n = make<DeclLocal>();
+            n->name = text(node);
+            result = std::move(n);
+            break;
+        }
+        case NodeKind::Assign:
+            result = make<Assign>();
+            break;
+        case NodeKind::Block:
+        {
+            auto n = make<Block>();
+            n->nodes.resize(list.size());
+            result = std::move(n);
+            break;
+        }
+        case NodeKind::Function:
+        {
+            auto n = make<Function>();
+            n->name = text(node);
+            n->parameters.resize(list.size() - 2);
+            result = std::move(n);
+            break;
+        }
+        case NodeKind::Return:
+            result = make<Return>();
+            break;
+        case NodeKind::Field:
+        {
+            auto n = make<Field>();
+            n->name = text(node);
+            result = std::move(n);
+            break;
+        }
+        case NodeKind::DeclType:
+        {
+            auto n = make<DeclType>();
+            n->name = text(node);
+            n->fields.resize(list.size());
+            result = std::move(n);
+            break;
+        }
+        case NodeKind::Deref:
+            result = make<Deref>();
+            break;
+        case NodeKind::GetRef:
+            result = make<GetRef>();
+            break;
+        case NodeKind::Local:
+        {
+            auto n = make<Local>();
+            n->name = text(node);
+            result = std::move(n);
+            break;
+        }
+        case NodeKind::Call:
+        {
+            auto n = make<Call>();
+            n->nodes.resize(list.size() - 1);
+            result = std::move(n);
+            break;
+        }
+        case NodeKind::ArrayInit:
+        {
+            auto n = make<ArrayInit>();
+            n->element = Primitive::Kind(tags[node] & 0x0F);
+            n->format = ArrayInit::Format(tags[node] >> 4);
+            n->data = text(node).data();
+            n->count = text(node).size() / ArrayInit::element_size(n->element);
+            result = std::move(n);
+            break;
+        }
+        case NodeKind::BinaryOp:
+        {
+            auto n = make<BinaryOp>();
+            n->op = BinaryOp::Op(tags[node]);
+            result = std::move(n);
+            break;
+        }
+        case NodeKind::UnaryOp:
+        {
+            auto n = make<UnaryOp>();
+            n->op = UnaryOp::Op(tags[node]);
+            result = std::move(n);
+            break;
+        }
+        case NodeKind::Index:
+            result = make<cgen::Index>();
+            break;
+        case NodeKind::Cast:
+            result = make<Cast>();
+            break;
+        case NodeKind::Custom:
+            return nullptr;
+        }
+
+        size_t i = 0;
+        for_each_child(result.get(), [&](std::unique_ptr<Node> &child)
+                       { child = to_tree(list[i++]); });
+        adopt(result.get());
+
+        return result;
+    }
+
+    struct FlatHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t root;
+        uint32_t reserved;
+        uint64_t nodes;
+        uint64_t children;
+        uint64_t bytes;
+    };
+
+    static constexpr char flat_magic[8] = {'C', 'G', 'E', 'N', 'F', 'L', 'A', 'T'};
+    // Bump whenever NodeKind, the tag encodings or the layout change.
+    static constexpr uint32_t flat_version = 2;
+    static constexpr uint32_t flat_byte_order = 0x01020304;
+
+    void FlatView::write(Sink &out) const
+    {
+        FlatHeader header{};
+        std::memcpy(header.magic, flat_magic, sizeof(flat_magic));
+        header.version = flat_version;
+        header.byte_order = flat_byte_order;
+        header.root = root;
+        header.nodes = size();
+        header.children = children.size();
+        header.bytes = bytes.size();
+
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(values.data()), values.size_bytes());
+        out.write(reinterpret_cast<const char *>(first.data()), first.size_bytes());
+        out.write(reinterpret_cast<const char *>(counts.data()), counts.size_bytes());
+        out.write(reinterpret_cast<const char *>(children.data()), children.size_bytes());
+        out.write(reinterpret_cast<const char *>(kinds.data()), kinds.size_bytes());
+        out.write(reinterpret_cast<const char *>(tags.data()), tags.size_bytes());
+        out.write(bytes.data(), bytes.size());
+    }
+
+    std::optional<FlatView> FlatView::load(const void *data, size_t size)
+    {
+        FlatHeader header;
+        if (size < sizeof(header) || reinterpret_cast<uintptr_t>(data) % alignof(uint64_t) != 0)
+        {
+            return std::nullopt;
+        }
+
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, flat_magic, sizeof(flat_magic)) != 0 || header.version != flat_version ||
+            header.byte_order != flat_byte_order)
+        {
+            return std::nullopt;
+        }
+
+        // Compare in units that cannot overflow before the multiplication.
+        size_t rest = size - sizeof(header);
+        if (header.nodes > rest / (sizeof(uint64_t) + 2 * sizeof(uint32_t) + 2) ||
+            header.children > rest / sizeof(Index) ||
+            header.nodes * (sizeof(uint64_t) + 2 * sizeof(uint32_t) + 2) + header.children * sizeof(Index) + header.bytes != rest)
+        {
+            return std::nullopt;
+        }
+
+        size_t nodes = header.nodes;
+        auto at = static_cast<const char *>(data) + sizeof(header);
+        FlatView view;
+
+        view.values = {reinterpret_cast<const uint64_t *>(at), nodes};
+        at += nodes * sizeof(uint64_t);
+        view.first = {reinterpret_cast<const uint32_t *>(at), nodes};
+        at += nodes * sizeof(uint32_t);
+        view.counts = {reinterpret_cast<const uint32_t *>(at), nodes};
+        at += nodes * sizeof(uint32_t);
+        view.children = {reinterpret_cast<const Index *>(at), size_t(header.children)};
+        at += header.children * sizeof(Index);
+        view.kinds = {reinterpret_cast<const NodeKind *>(at), nodes};
+        at += nodes;
+        view.tags = {reinterpret_cast<const uint8_t *>(at), nodes};
+        at += nodes;
+        view.bytes = {at, size_t(header.bytes)};
+        view.root = header.root;
+
+        return view;
+    }
+
+    bool FlatView::valid() const
+    {
+        if (root != none && root >= size())
+        {
+            return false;
+        }
+
+        for (Index child : children)
+        {
+            if (child != none && child >= size())
+            {
+                return false;
+            }
+        }
+
+        for (Index i = 0; i < size(); i++)
+        {
+            if (kinds[i] > NodeKind::Cast || uint64_t(first[i]) + counts[i] > children.size())
+            {
+                return false;
+            }
+
+            // Slots that emit() and to_tree() index directly, at the front
+            // and back; between them lists, which may hold none where a
+            // custom node was dropped.
+            uint32_t leading = 0;
+            uint32_t trailing = 0;
+            bool list = false;
+
+            switch (kinds[i])
+            {
+            case NodeKind::Program:
+            case NodeKind::Block:
+            case NodeKind::DeclType:
+                list = true;
+                break;
+            case NodeKind::Function:
+                leading = trailing = 1;
+                list = true;
+                break;
+            case NodeKind::Call:
+                leading = 1;
+                list = true;
+                break;
+            case NodeKind::PointerOf:
+            case NodeKind::ArrayOf:
+            case NodeKind::Static:
+            case NodeKind::DeclLocal:
+            case NodeKind::Return:
+            case NodeKind::Field:
+            case NodeKind::Deref:
+            case NodeKind::GetRef:
+            case NodeKind::UnaryOp:
+                leading = 1;
+                break;
+            case NodeKind::Assign:
+            case NodeKind::BinaryOp:
+            case NodeKind::Index:
+            case NodeKind::Cast:
+                leading = 2;
+                break;
+            default:
+                break;
+            }
+
+            auto slots = children_of(i);
+            if (list ? slots.size() < leading + trailing : slots.size() != leading)
+            {
+                return false;
+            }
+            for (uint32_t s = 0; s < leading; s++)
+            {
+                if (slots[s] == none)
+                    return false;
+            }
+            for (uint32_t s = 0; s < trailing; s++)
+            {
+                if (slots[slots.size() - 1 - s] == none)
+                    return false;
+            }
+
+            // Tags must name a known kind or operator, and ranges must fit
+            // the pool and hold whole values.
+            uint64_t length = values[i] & 0xFFFFFFFF;
+            bool range = false;
+            bool sized = true;
+
+            switch (kinds[i])
+            {
+            case NodeKind::Primitive:
+                sized = tags[i] <= Primitive::f64;
+                break;
+            case NodeKind::BinaryOp:
+                sized = tags[i] <= BinaryOp::Or;
+                break;
+            case NodeKind::UnaryOp:
+                sized = tags[i] <= UnaryOp::PostDec;
+                break;
+            case NodeKind::Type:
+            case NodeKind::DeclLocal:
+            case NodeKind::Function:
+            case NodeKind::Field:
+            case NodeKind::DeclType:
+            case NodeKind::Local:
+                range = true;
+                break;
+            case NodeKind::ArrayInit:
+                range = true;
+                sized = (tags[i] & 0x0F) <= Primitive::f64 && tags[i] >> 4 <= ArrayInit::String &&
+                        length % ArrayInit::element_size(Primitive::Kind(tags[i] & 0x0F)) == 0;
+                break;
+            case NodeKind::Literal:
+                sized = tags[i] <= LiteralBase::String;
+                with_literal_type(LiteralBase::Kind(tags[i]), [&]<typename T>(std::type_identity<T>)
+                                  {
+                                      if constexpr (std::is_same_v<T, std::string>)
+                                      {
+                                          range = true;
+                                      }
+                                      else if constexpr (!flat_inline_literal<T>)
+                                      {
+                                          range = true;
+                                          sized = length == sizeof(T);
+                                      } });
+                break;
+            default:
+                break;
+            }
+
+            if (!sized || (range && (values[i] >> 32) + length > bytes.size()))
+            {
+                return false;
+            }
+        }
+
+        // Shared subtrees make this a DAG, so a child may come before its
+        // parent; look for a path back to a node still being walked.
+        std::vector<uint8_t> state(size()); // 0 unseen, 1 open, 2 done
+        std::vector<std::pair<Index, uint32_t>> stack;
+
+        for (Index start = 0; start < size(); start++)
+        {
+            if (state[start] != 0)
+            {
+                continue;
+            }
+
+            state[start] = 1;
+            stack.push_back({start, 0});
+
+            while (!stack.empty())
+            {
+                auto &[node, next] = stack.back();
+                if (next == counts[node])
+                {
+                    state[node] = 2;
+                    stack.pop_back();
+                    continue;
+                }
+
+                Index child = children[first[node] + next++];
+                if (child == none || state[child] == 2)
+                {
+                    continue;
+                }
+                if (state[child] == 1)
+                {
+                    return false;
+                }
 
-    AcceptResult Primitive::accept(Visitor *visitor)
-    {
-        return visitor->visit(this);
-    }
+                state[child] = 1;
+                stack.push_back({child, 0});
+            }
+        }
 
-    AcceptResult Type::accept(Visitor *visitor)
-    {
-        return visitor->visit(this);
+        return true;
     }
 
-    AcceptResult Assign::accept(Visitor *visitor)
+    MappedFile::MappedFile(const char *path)
     {
-        return visitor->visit(this);
-    }
+#ifdef _WIN32
+        HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (handle == INVALID_HANDLE_VALUE)
+        {
+            return;
+        }
+        file = handle;
+        opened = true;
 
-    AcceptResult Block::accept(Visitor *visitor)
-    {
-        return visitor->visit(this);
-    }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0)
+        {
+            return;
+        }
+        length = size_t(size.QuadPart);
 
-    AcceptResult Function::accept(Visitor *visitor)
-    {
-        return visitor->visit(this);
-    }
+        section = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (section != nullptr)
+        {
+            mapping = MapViewOfFile(section, FILE_MAP_READ, 0, 0, 0);
+        }
+#else
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return;
+        }
+        opened = true;
 
-    AcceptResult Static::accept(Visitor *visitor)
-    {
-        return visitor->visit(this);
-    }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            length = size_t(info.st_size);
+            void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            mapping = p == MAP_FAILED ? nullptr : p;
+        }
 
-    AcceptResult DeclLocal::accept(Visitor *visitor)
-    {
-        return visitor->visit(this);
+        // The mapping stays valid after the descriptor is closed.
+        ::close(fd);
+#endif
     }
 
-    AcceptResult PointerOf::accept(Visitor *visitor)
+    MappedFile::~MappedFile()
     {
-        return visitor->visit(this);
+#ifdef _WIN32
+        if (mapping != nullptr)
+        {
+            UnmapViewOfFile(mapping);
+        }
+        if (section != nullptr)
+        {
+            CloseHandle(section);
+        }
+        if (file != nullptr)
+        {
+            CloseHandle(file);
+        }
+#else
+        if (mapping != nullptr)
+        {
+            munmap(mapping, length);
+        }
+#endif
     }
 
-    AcceptResult ArrayOf::accept(Visitor *visitor)
+    WriteStatus write_if_changed(const char *path, std::string_view text)
     {
-        return visitor->visit(this);
-    }
+        {
+            MappedFile existing(path);
+            if (existing.ok() && existing.size() == text.size() &&
+                (text.empty() || std::memcmp(existing.data(), text.data(), text.size()) == 0))
+            {
+                return WriteStatus::Unchanged;
+            }
+        }
 
-    AcceptResult Return::accept(Visitor *visitor)
-    {
-        return visitor->visit(this);
-    }
+        // Written aside and renamed, so a failed write leaves the old file.
+        std::string temporary = std::string(path) + ".tmp";
+        {
+            FileWriter out(temporary.c_str());
+            out << text;
+            out.flush();
+            if (!out.ok())
+            {
+                out.close();
+                std::remove(temporary.c_str());
+                return WriteStatus::Failed;
+            }
+        }
 
-    AcceptResult Field::accept(Visitor *visitor)
-    {
-        return visitor->visit(this);
+        if (!replace_file(temporary.c_str(), path))
+        {
+            std::remove(temporary.c_str());
+            return WriteStatus::Failed;
+        }
+        return WriteStatus::Written;
     }
 
-    AcceptResult Deref::accept(Visitor *visitor)
+    size_t RewritePass::run(Program *program)
     {
-        return visitor->visit(this);
+        size_t changes = walk(program);
+        if (changes > 0 && program->symbols)
+        {
+            program->index_symbols();
+        }
+        return changes;
     }
 
-    AcceptResult DeclType::accept(Visitor *visitor)
+    size_t RewritePass::walk(Node *node)
     {
-        return visitor->visit(this);
-    }
+        size_t changes = 0;
 
-    AcceptResult Local::accept(Visitor *visitor)
-    {
-        return visitor->visit(this);
-    }
+        for_each_child(node, [&](std::unique_ptr<Node> &child)
+                       {
+                           if (!child || (child->flags & (Node::Interned | Node::Shared)))
+                               return;
 
-    AcceptResult Call::accept(Visitor *visitor)
-    {
-        return visitor->visit(this);
-    }
+                           changes += walk(child.get());
+                           if (rewrite(child))
+                           {
+                               changes++;
+                               if (child && !(child->flags & (Node::Interned | Node::Shared)))
+                                   child->parent = node;
+                               node->mark_dirty();
+                           } });
 
-    AcceptResult GetRef::accept(Visitor *visitor)
-    {
-        return visitor->visit(this);
+        return changes;
     }
 
-    AcceptResult CodeGenVisitor::visit(Node *node)
-    {
-        return node->accept(this);
-    }
+    // Literal types an operator does not promote; the rest are not folded.
+    template <typename T>
+    constexpr bool foldable_literal = std::is_floating_point_v<T> ||
+                                      (std::is_integral_v<T> && !std::is_same_v<T, bool> && sizeof(T) >= sizeof(int));
 
-    AcceptResult CodeGenVisitor::visit(Program *node)
+    template <typename T>
+    static std::optional<T> fold_arithmetic(BinaryOp::Op op, T a, T b)
     {
-        std::stringstream ss;
+        using limits = std::numeric_limits<T>;
+        constexpr bool is_signed = std::is_signed_v<T> && std::is_integral_v<T>;
+
+        switch (op)
+        {
+        case BinaryOp::Add:
+            if constexpr (is_signed)
+                if ((b > 0 && a > limits::max() - b) || (b < 0 && a < limits::min() - b))
+                    return std::nullopt;
+            return T(a + b);
+        case BinaryOp::Sub:
+            if constexpr (is_signed)
+                if ((b < 0 && a > limits::max() + b) || (b > 0 && a < limits::min() + b))
+                    return std::nullopt;
+            return T(a - b);
+        case BinaryOp::Mul:
+            if constexpr (is_signed)
+                if (a > 0 ? (b > 0 ? a > limits::max() / b : b < limits::min() / a)
+                          : (b > 0 ? a < limits::min() / b : a != 0 && b < limits::max() / a))
+                    return std::nullopt;
+            return T(a * b);
+        case BinaryOp::Div:
+        case BinaryOp::Mod:
+            if (b == 0)
+                return std::nullopt;
+            if constexpr (is_signed)
+                if (a == limits::min() && b == -1)
+                    return std::nullopt;
+            if constexpr (std::is_floating_point_v<T>)
+                return op == BinaryOp::Div ? std::optional<T>(a / b) : std::nullopt;
+            else
+                return T(op == BinaryOp::Div ? a / b : a % b);
+        default:
+            break;
+        }
 
-        for (auto &n : node->nodes)
+        if constexpr (std::is_integral_v<T>)
         {
-            ss << n->accept(this) << ";";
+            switch (op)
+            {
+            case BinaryOp::Shl:
+            case BinaryOp::Shr:
+                if constexpr (is_signed)
+                    if (a < 0 || b < 0)
+                        return std::nullopt;
+                if (uint64_t(b) >= uint64_t(limits::digits + is_signed))
+                    return std::nullopt;
+                if (op == BinaryOp::Shr)
+                    return T(a >> b);
+                if constexpr (is_signed)
+                    if (a > (limits::max() >> b))
+                        return std::nullopt;
+                return T(a << b);
+            case BinaryOp::BitAnd:
+                return T(a & b);
+            case BinaryOp::BitXor:
+                return T(a ^ b);
+            case BinaryOp::BitOr:
+                return T(a | b);
+            default:
+                break;
+            }
         }
 
-        return ss.str();
+        return std::nullopt;
     }
 
-    AcceptResult CodeGenVisitor::visit(Primitive *node)
+    static std::unique_ptr<Node> fold(BinaryOp *node)
     {
-        std::stringstream ss;
-
-        switch (node->kind)
+        auto lhs = node->lhs ? node->lhs->as<LiteralBase>() : nullptr;
+        auto rhs = node->rhs ? node->rhs->as<LiteralBase>() : nullptr;
+        if (lhs == nullptr || rhs == nullptr || lhs->literal_kind != rhs->literal_kind)
         {
-        case Primitive::i8:
-            ss << "char";
-            break;
-        case Primitive::i16:
-            ss << "short";
-            break;
-        case Primitive::i32:
-            ss << "int";
-            break;
-        case Primitive::i64:
-            ss << "long";
-            break;
-        case Primitive::u8:
-            ss << "unsigned char";
-            break;
-        case Primitive::u16:
-            ss << "unsigned short";
-            break;
-        case Primitive::u32:
-            ss << "unsigned int";
-            break;
-        case Primitive::u64:
-            ss << "unsigned long";
-            break;
-        case Primitive::f32:
-            ss << "float";
-            break;
-        case Primitive::f64:
-            ss << "double";
-            break;
+            return nullptr;
         }
 
-        return ss.str();
-    }
+        std::unique_ptr<Node> result;
+        with_literal_type(lhs->literal_kind, [&]<typename T>(std::type_identity<T>)
+                          {
+                              if constexpr (foldable_literal<T>)
+                              {
+                                  T a = static_cast<Literal<T> *>(lhs)->value;
+                                  T b = static_cast<Literal<T> *>(rhs)->value;
 
-    AcceptResult CodeGenVisitor::visit(Type *node)
-    {
-        return "struct " + node->name;
+                                  // Comparisons and logical operators yield int.
+                                  switch (node->op)
+                                  {
+                                  case BinaryOp::Lt: result = literal(int(a < b)); return;
+                                  case BinaryOp::Le: result = literal(int(a <= b)); return;
+                                  case BinaryOp::Gt: result = literal(int(a > b)); return;
+                                  case BinaryOp::Ge: result = literal(int(a >= b)); return;
+                                  case BinaryOp::Eq: result = literal(int(a == b)); return;
+                                  case BinaryOp::Ne: result = literal(int(a != b)); return;
+                                  case BinaryOp::And: result = literal(int(a != 0 && b != 0)); return;
+                                  case BinaryOp::Or: result = literal(int(a != 0 || b != 0)); return;
+                                  default: break;
+                                  }
+
+                                  if (auto value = fold_arithmetic(node->op, a, b))
+                                      result = literal(*value);
+                              } });
+        return result;
     }
 
-    AcceptResult CodeGenVisitor::visit(PointerOf *node)
+    static std::unique_ptr<Node> fold(UnaryOp *node)
     {
-        return node->node->accept(this) + "*";
+        auto operand = node->node ? node->node->as<LiteralBase>() : nullptr;
+        if (operand == nullptr)
+        {
+            return nullptr;
+        }
+
+        std::unique_ptr<Node> result;
+        with_literal_type(operand->literal_kind, [&]<typename T>(std::type_identity<T>)
+                          {
+                              if constexpr (foldable_literal<T>)
+                              {
+                                  T a = static_cast<Literal<T> *>(operand)->value;
+
+                                  switch (node->op)
+                                  {
+                                  case UnaryOp::Neg:
+                                      if constexpr (std::is_integral_v<T> && std::is_signed_v<T>)
+                                          if (a == std::numeric_limits<T>::min())
+                                              return;
+                                      result = literal(T(-a));
+                                      return;
+                                  case UnaryOp::Plus:
+                                      result = literal(a);
+                                      return;
+                                  case UnaryOp::Not:
+                                      result = literal(int(a == 0));
+                                      return;
+                                  case UnaryOp::BitNot:
+                                      if constexpr (std::is_integral_v<T>)
+                                          result = literal(T(~a));
+                                      return;
+                                  default:
+                                      return;
+                                  }
+                              } });
+        return result;
     }
 
-    AcceptResult CodeGenVisitor::visit(ArrayOf *node)
+    bool FoldConstants::rewrite(std::unique_ptr<Node> &slot)
     {
-        std::stringstream ss;
+        std::unique_ptr<Node> folded;
+        if (auto b = slot->as<BinaryOp>())
+        {
+            folded = fold(b);
+        }
+        else if (auto u = slot->as<UnaryOp>())
+        {
+            folded = fold(u);
+        }
 
-        ss << node->node->accept(this) << "[";
-        if (node->size > 0)
+        if (folded)
         {
-            ss << node->size;
+            slot = std::move(folded);
+            return true;
         }
-        ss << "]";
 
-        return ss.str();
-    }
+        std::unique_ptr<Node> *inner = nullptr;
 
-    AcceptResult CodeGenVisitor::visit(Static *node)
-    {
-        return "static " + node->node->accept(this);
+        if (auto deref = slot->as<Deref>(); deref && deref->node && deref->node->is<GetRef>())
+        {
+            inner = &deref->node->cast<GetRef>()->node;
+        }
+        else if (auto ref = slot->as<GetRef>(); ref && ref->node && ref->node->is<Deref>())
+        {
+            inner = &ref->node->cast<Deref>()->node;
+        }
+
+        if (inner == nullptr)
+        {
+            return false;
+        }
+
+        // Move x out before its wrappers are destroyed by the assignment.
+        auto x = std::move(*inner);
+        slot = std::move(x);
+        return true;
     }
 
-    AcceptResult CodeGenVisitor::visit(DeclLocal *node)
+    bool RemoveUnreachable::rewrite(std::unique_ptr<Node> &slot)
     {
-        return node->type->accept(this) + " " + node->name;
+        auto block = slot->as<Block>();
+        if (block == nullptr)
+        {
+            return false;
+        }
+
+        auto &nodes = block->nodes;
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            if (nodes[i] && nodes[i]->is<Return>() && i + 1 < nodes.size())
+            {
+                nodes.erase(nodes.begin() + i + 1, nodes.end());
+                return true;
+            }
+        }
+
+        return false;
     }
 
-    AcceptResult CodeGenVisitor::visit(Block *node)
+    size_t RemoveUnused::run(Program *program)
     {
-        std::stringstream ss;
+        auto &nodes = program->nodes;
 
-        ss << "{";
+        // Candidates by the name other nodes would use to refer to them.
+        std::unordered_multimap<Symbol, size_t> candidates;
+        std::vector<bool> live(nodes.size(), true);
 
-        for (auto &n : node->nodes)
+        for (size_t i = 0; i < nodes.size(); i++)
         {
-            ss << n->accept(this) << ";";
+            Node *n = nodes[i].get();
+            if (auto s = n ? n->as<Static>() : nullptr; s && s->node && s->node->is<Function>())
+            {
+                candidates.emplace(s->node->cast<Function>()->name, i);
+                live[i] = false;
+            }
+            else if (auto d = n ? n->as<DeclType>() : nullptr)
+            {
+                candidates.emplace(d->name, i);
+                live[i] = false;
+            }
         }
 
-        ss << "}";
-
-        return ss.str();
-    }
+        if (candidates.empty())
+        {
+            return 0;
+        }
 
-    AcceptResult CodeGenVisitor::visit(Function *node)
-    {
-        std::stringstream ss;
+        // Flood from everything that is live regardless of references.
+        std::vector<Node *> work;
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            if (live[i] && nodes[i])
+            {
+                work.push_back(nodes[i].get());
+            }
+        }
 
-        ss << node->return_type->accept(this) << " " << node->name << "(";
+        auto reference = [&](Symbol name)
+        {
+            auto [begin, end] = candidates.equal_range(name);
+            for (auto it = begin; it != end; ++it)
+            {
+                if (!live[it->second])
+                {
+                    live[it->second] = true;
+                    work.push_back(nodes[it->second].get());
+                }
+            }
+        };
 
-        for (size_t i = 0; i < node->parameters.size(); i++)
+        while (!work.empty())
         {
-            ss << node->parameters[i]->accept(this);
+            Node *n = work.back();
+            work.pop_back();
 
-            if (i < node->parameters.size() - 1)
+            if (auto l = n->as<Local>())
+            {
+                reference(l->name);
+            }
+            else if (auto t = n->as<Type>())
             {
-                ss << ", ";
+                reference(t->name);
             }
+
+            for_each_child(n, [&](std::unique_ptr<Node> &child)
+                           {
+                               if (child)
+                                   work.push_back(child.get()); });
         }
 
-        ss << ")";
-        ss << node->body->accept(this);
+        size_t removed = 0;
+        size_t kept = 0;
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            if (live[i])
+            {
+                nodes[kept++] = std::move(nodes[i]);
+            }
+            else
+            {
+                removed++;
+            }
+        }
+        nodes.resize(kept);
 
-        return ss.str();
+        if (removed > 0)
+        {
+            program->mark_dirty();
+            if (program->symbols)
+            {
+                program->index_symbols();
+            }
+        }
+        return removed;
     }
 
-    AcceptResult CodeGenVisitor::visit(Return *node)
+    size_t optimize(Program *program)
     {
-        return "return " + node->node->accept(this);
+        FoldConstants fold;
+        RemoveUnreachable unreachable;
+        RemoveUnused unused;
+
+        size_t total = 0;
+        for (size_t changes = 1; changes > 0; total += changes)
+        {
+            changes = fold.run(program) + unreachable.run(program) + unused.run(program);
+        }
+        return total;
     }
 
-    AcceptResult CodeGenVisitor::visit(Assign *node)
+    // Same output as the recursive emitters: each inner node is expanded
+    // into its text pieces and child slots, pushed in reverse; leaves are
+    // emitted directly.
+    void CodeGenVisitor::emit_iterative(Node *root)
     {
-        return node->lhs->accept(this) + " = " + node->rhs->accept(this);
+        struct Step
+        {
+            Node *node;
+            std::string_view text;
+            size_t number;
+            bool is_number;
+        };
+
+        std::vector<Step> stack;
+        auto push_node = [&](Node *node)
+        {
+            if (node != nullptr)
+                stack.push_back({node, {}, 0, false});
+        };
+        auto push_text = [&](std::string_view text)
+        { stack.push_back({nullptr, text, 0, false}); };
+        auto push_number = [&](size_t number)
+        { stack.push_back({nullptr, {}, number, true}); };
+        auto push_operand = [&](Node *node, bool parenthesized)
+        {
+            if (parenthesized)
+                push_text(")");
+            push_node(node);
+            if (parenthesized)
+                push_text("(");
+        };
+        auto push_prefix = [&](std::string_view op, Node *operand)
+        {
+            bool parenthesized = parenthesize(expression_precedence(operand), Precedence::Prefix);
+            push_operand(operand, parenthesized);
+            if (!parenthesized && pastes(op.back(), leading_char(operand)))
+                push_text(" ");
+            push_text(op);
+        };
+        auto postfix_operand = [](Node *node)
+        { return parenthesize(expression_precedence(node), Precedence::Postfix); };
+
+        push_node(root);
+
+        while (!stack.empty())
+        {
+            Step step = stack.back();
+            stack.pop_back();
+
+            if (step.node == nullptr)
+            {
+                if (step.is_number)
+                    *sink << step.number;
+                else
+                    *sink << step.text;
+                continue;
+            }
+
+            Node *node = step.node;
+            bool interned = node->flags & Node::Interned;
+
+            switch (node->node_kind)
+            {
+            case NodeKind::Program:
+            {
+                auto &nodes = node->cast<Program>()->nodes;
+                for (size_t i = nodes.size(); i-- > 0;)
+                {
+                    push_text(";");
+                    push_node(nodes[i].get());
+                }
+                continue;
+            }
+            case NodeKind::PointerOf:
+                if (interned)
+                    break;
+                push_text("*");
+                push_node(node->cast<PointerOf>()->node.get());
+                continue;
+            case NodeKind::ArrayOf:
+            {
+                if (interned)
+                    break;
+                auto arr = node->cast<ArrayOf>();
+                push_text("]");
+                if (arr->size > 0)
+                    push_number(arr->size);
+                push_text("[");
+                push_node(arr->node.get());
+                continue;
+            }
+            case NodeKind::Static:
+                push_node(node->cast<Static>()->node.get());
+                push_text("static ");
+                continue;
+            case NodeKind::DeclLocal:
+            {
+                auto decl = node->cast<DeclLocal>();
+                push_text(decl->name.view());
+                push_text(" ");
+                push_node(decl->type.get());
+                continue;
+            }
+            case NodeKind::Assign:
+            {
+                auto assign = node->cast<Assign>();
+                push_node(assign->rhs.get());
+                push_text(" = ");
+                push_node(assign->lhs.get());
+                continue;
+            }
+            case NodeKind::Block:
+            {
+                auto &nodes = node->cast<Block>()->nodes;
+                push_text("}");
+                for (size_t i = nodes.size(); i-- > 0;)
+                {
+                    push_text(";");
+                    push_node(nodes[i].get());
+                }
+                push_text("{");
+                continue;
+            }
+            case NodeKind::Function:
+            {
+                auto fn = node->cast<Function>();
+                push_node(fn->body.get());
+                push_text(")");
+                for (size_t i = fn->parameters.size(); i-- > 0;)
+                {
+                    push_node(fn->parameters[i].get());
+                    if (i > 0)
+                        push_text(", ");
+                }
+                push_text("(");
+                push_text(fn->name.view());
+                push_text(" ");
+                push_node(fn->return_type.get());
+                continue;
+            }
+            case NodeKind::Return:
+                push_node(node->cast<Return>()->node.get());
+                push_text("return ");
+                continue;
+            case NodeKind::Field:
+            {
+                auto f = node->cast<Field>();
+                push_text(f->name.view());
+                push_text(".");
+                push_operand(f->type.get(), postfix_operand(f->type.get()));
+                continue;
+            }
+            case NodeKind::DeclType:
+            {
+                auto d = node->cast<DeclType>();
+                push_text("};");
+                for (size_t i = d->fields.size(); i-- > 0;)
+                {
+                    push_text(";");
+                    push_node(d->fields[i].get());
+                }
+                push_text("{");
+                push_text(d->name.view());
+                push_text("struct ");
+                continue;
+            }
+            case NodeKind::Deref:
+                push_prefix("*", node->cast<Deref>()->node.get());
+                continue;
+            case NodeKind::GetRef:
+                push_prefix("&", node->cast<GetRef>()->node.get());
+                continue;
+            case NodeKind::Call:
+            {
+                auto c = node->cast<Call>();
+                push_text(")");
+                for (size_t i = c->nodes.size(); i-- > 0;)
+                {
+                    push_node(c->nodes[i].get());
+                    if (i > 0)
+                        push_text(",");
+                }
+                push_text("(");
+                push_operand(c->node.get(), postfix_operand(c->node.get()));
+                continue;
+            }
+            case NodeKind::BinaryOp:
+            {
+                auto b = node->cast<BinaryOp>();
+                Precedence level = BinaryOp::precedence(b->op);
+                std::string_view op = BinaryOp::spelling(b->op);
+                bool parenthesized = parenthesize(expression_precedence(b->rhs.get()), level, true);
+
+                push_operand(b->rhs.get(), parenthesized);
+                if (!parenthesized && pastes(op.back(), leading_char(b->rhs.get())))
+                    push_text(" ");
+                push_text(op);
+                push_operand(b->lhs.get(), parenthesize(expression_precedence(b->lhs.get()), level));
+                continue;
+            }
+            case NodeKind::UnaryOp:
+            {
+                auto u = node->cast<UnaryOp>();
+                if (UnaryOp::postfix(u->op))
+                {
+                    push_text(UnaryOp::spelling(u->op));
+                    push_operand(u->node.get(), postfix_operand(u->node.get()));
+                }
+                else
+                {
+                    push_prefix(UnaryOp::spelling(u->op), u->node.get());
+                }
+                continue;
+            }
+            case NodeKind::Index:
+            {
+                auto i = node->cast<Index>();
+                push_text("]");
+                push_node(i->index.get());
+                push_text("[");
+                push_operand(i->node.get(), postfix_operand(i->node.get()));
+                continue;
+            }
+            case NodeKind::Cast:
+            {
+                auto c = node->cast<Cast>();
+                push_operand(c->node.get(), parenthesize(expression_precedence(c->node.get()), Precedence::Prefix));
+                push_text(")");
+                push_node(c->type.get());
+                push_text("(");
+                continue;
+            }
+            default:
+                break;
+            }
+
+            emit_node(node);
+        }
     }
 
-    AcceptResult CodeGenVisitor::visit(Field *node)
+    static inline unsigned count_trailing_zeros(uint32_t bits)
     {
-        return node->type->accept(this) + "." + node->name;
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, bits);
+        return index;
+#else
+        return __builtin_ctz(bits);
+#endif
     }
 
-    AcceptResult CodeGenVisitor::visit(Deref *node)
+    // Bytes that write_quoted cannot copy as they are.
+    static inline bool needs_escape(unsigned char c)
     {
-        return "(*" + node->node->accept(this) + ")";
+        return c < 0x20 || c >= 0x7F || c == '"' || c == '\'' || c == '\\' || c == '?';
     }
 
-    AcceptResult CodeGenVisitor::visit(DeclType *node)
+    // Offset of the first byte in [data, data + size) that needs_escape(),
+    // or size. Scans a vector width at a time where the target has one.
+    static size_t find_escape(const unsigned char *data, size_t size)
     {
-        std::stringstream ss;
+        size_t i = 0;
 
-        ss << "struct " << node->name << "{";
+#if defined(__AVX2__)
+        {
+            const __m256i space = _mm256_set1_epi8(0x20 - 1);
+            const __m256i del = _mm256_set1_epi8(0x7F);
+            const __m256i dquote = _mm256_set1_epi8('"');
+            const __m256i squote = _mm256_set1_epi8('\'');
+            const __m256i slash = _mm256_set1_epi8('\\');
+            const __m256i question = _mm256_set1_epi8('?');
 
-        for (size_t i = 0; i < node->fields.size(); i++)
+            for (; i + 32 <= size; i += 32)
+            {
+                __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+                // Signed compare: bytes >= 0x80 are negative and count as low.
+                __m256i hit = _mm256_or_si256(_mm256_cmpgt_epi8(space, v), _mm256_cmpeq_epi8(v, del));
+                hit = _mm256_or_si256(hit, _mm256_or_si256(_mm256_cmpeq_epi8(v, dquote), _mm256_cmpeq_epi8(v, squote)));
+                hit = _mm256_or_si256(hit, _mm256_or_si256(_mm256_cmpeq_epi8(v, slash), _mm256_cmpeq_epi8(v, question)));
+
+                if (uint32_t bits = (uint32_t)_mm256_movemask_epi8(hit))
+                {
+                    return i + count_trailing_zeros(bits);
+                }
+            }
+        }
+#endif
+
+#ifdef __CGEN_SSE2
+        const __m128i space = _mm_set1_epi8(0x20 - 1);
+        const __m128i del = _mm_set1_epi8(0x7F);
+        const __m128i dquote = _mm_set1_epi8('"');
+        const __m128i squote = _mm_set1_epi8('\'');
+        const __m128i slash = _mm_set1_epi8('\\');
+        const __m128i question = _mm_set1_epi8('?');
+
+        for (; i + 16 <= size; i += 16)
         {
-            ss << node->fields[i]->accept(this);
-            ss << ";";
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            __m128i hit = _mm_or_si128(_mm_cmpgt_epi8(space, v), _mm_cmpeq_epi8(v, del));
+            hit = _mm_or_si128(hit, _mm_or_si128(_mm_cmpeq_epi8(v, dquote), _mm_cmpeq_epi8(v, squote)));
+            hit = _mm_or_si128(hit, _mm_or_si128(_mm_cmpeq_epi8(v, slash), _mm_cmpeq_epi8(v, question)));
+
+            if (uint32_t bits = (uint32_t)_mm_movemask_epi8(hit))
+            {
+                return i + count_trailing_zeros(bits);
+            }
         }
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+        for (; i + 16 <= size; i += 16)
+        {
+            uint8x16_t v = vld1q_u8(data + i);
+            uint8x16_t hit = vorrq_u8(vcltq_u8(v, vdupq_n_u8(0x20)), vcgeq_u8(v, vdupq_n_u8(0x7F)));
+            hit = vorrq_u8(hit, vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')), vceqq_u8(v, vdupq_n_u8('\''))));
+            hit = vorrq_u8(hit, vorrq_u8(vceqq_u8(v, vdupq_n_u8('\\')), vceqq_u8(v, vdupq_n_u8('?'))));
 
-        ss << "};";
+            // Narrow to 4 bits per byte to get a scalar mask.
+            uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+            if (bits != 0)
+            {
+                return i + __builtin_ctzll(bits) / 4;
+            }
+        }
+#endif
 
-        return ss.str();
+        for (; i < size; i++)
+        {
+            if (needs_escape(data[i]))
+            {
+                return i;
+            }
+        }
+        return size;
     }
 
-    AcceptResult CodeGenVisitor::visit(Local *node)
+    void write_quoted(Sink &sink, std::string_view text, char quote)
     {
-        return node->name;
-    }
+        // Output characters per piece; C requires 4095, MSVC allows ~16K.
+        constexpr size_t piece = 4000;
 
-    AcceptResult CodeGenVisitor::visit(Call *node)
-    {
-        std::stringstream ss;
+        BufferedSink out(sink);
+        auto data = reinterpret_cast<const unsigned char *>(text.data());
+        size_t size = text.size();
+        size_t column = 0;
 
-        ss << node->node->accept(this) << "(";
+        out << quote;
 
-        for (size_t i = 0; i < node->nodes.size(); i++)
+        for (size_t i = 0; i < size;)
         {
-            ss << node->nodes[i]->accept(this);
+            if (quote == '"' && column >= piece)
+            {
+                out << "\"\n\"";
+                column = 0;
+            }
 
-            if (i < node->nodes.size() - 1)
+            size_t budget = quote == '"' ? piece - column : size - i;
+            size_t run = find_escape(data + i, std::min(size - i, budget));
+            if (run > 0)
             {
-                ss << ",";
+                out.write(text.data() + i, run);
+                i += run;
+                column += run;
+                continue;
             }
-        }
 
-        ss << ")";
+            unsigned char c = data[i++];
+            char *dst = out.reserve(4);
+            size_t n = 2;
+            dst[0] = '\\';
 
-        return ss.str();
-    }
+            switch (c)
+            {
+            case '\n':
+                dst[1] = 'n';
+                break;
+            case '\t':
+                dst[1] = 't';
+                break;
+            case '\r':
+                dst[1] = 'r';
+                break;
+            case '"':
+            case '\'':
+            case '\\':
+                dst[1] = char(c);
+                break;
+            case '?':
+                // Only the second '?' of a pair can start a trigraph.
+                if (i < 2 || data[i - 2] != '?')
+                {
+                    dst[0] = '?';
+                    n = 1;
+                    break;
+                }
+                dst[1] = '?';
+                break;
+            default:
+                dst[1] = char('0' + (c >> 6));
+                dst[2] = char('0' + ((c >> 3) & 7));
+                dst[3] = char('0' + (c & 7));
+                n = 4;
+                break;
+            }
 
-    AcceptResult CodeGenVisitor::visit(GetRef *node)
-    {
-        return "(&" + node->node->accept(this) + ")";
+            out.commit(n);
+            column += n;
+        }
+
+        out << quote;
     }
 
 } // namespace1
@@ -0,0 +1,3 @@
+// The test suite again with CGEN_INSTRUMENTATION defined (see plus.toml),
+// so the instrumentation hooks and test_instrumentation are built and run.
+#include "../../src/test.cpp"
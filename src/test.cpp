@@ -1,5 +1,7 @@
 #include <iostream>
 #include <cassert>
+#include <filesystem>
+#include <thread>
 
 #define CGEN_IMPLEMENTATION
 #include "cgen.hpp"
@@ -132,6 +134,1676 @@ void test_pointer_work()
     assert(type->accept(&visitor) == "int*");
 }
 
+void test_sink()
+{
+    cgen::Program program;
+
+    auto fn = std::make_unique<cgen::Function>();
+    fn->name = "add";
+    fn->return_type = cgen::i32();
+    fn->parameters.push_back(cgen::decl_local("a", cgen::i32()));
+    fn->parameters.push_back(cgen::decl_local("b", cgen::array_of(cgen::u8(), 4)));
+
+    auto body = std::make_unique<cgen::Block>();
+    auto ret = std::make_unique<cgen::Return>();
+    ret->node = cgen::call(cgen::local("foo"), cgen::literal(1), cgen::local("a"));
+    body->push(std::move(ret));
+    fn->body = std::move(body);
+
+    program.push(std::move(fn));
+
+    const std::string expected = "int add(int a, unsigned char[4] b){return foo(1,a);};";
+
+    cgen::CodeGenVisitor visitor;
+    assert(program.accept(&visitor) == expected);
+
+    std::string buffer = "// generated\n";
+    cgen::StringSink string_sink(buffer);
+    visitor.emit(&program, string_sink);
+    assert(buffer == "// generated\n" + expected);
+
+    std::ostringstream stream;
+    cgen::StreamSink stream_sink(stream);
+    visitor.emit(&program, stream_sink);
+    assert(stream.str() == expected);
+
+    FILE *file = tmpfile();
+    {
+        cgen::FileSink file_sink(file);
+        visitor.emit(&program, file_sink);
+    }
+    std::string contents(expected.size(), '\0');
+    rewind(file);
+    assert(fread(contents.data(), 1, contents.size(), file) == expected.size());
+    assert(contents == expected);
+    fclose(file);
+
+    file = tmpfile();
+    {
+        cgen::FdSink fd_sink(fileno(file));
+        visitor.emit(&program, fd_sink);
+    }
+    contents.assign(expected.size(), '\0');
+    rewind(file);
+    assert(fread(contents.data(), 1, contents.size(), file) == expected.size());
+    assert(contents == expected);
+    fclose(file);
+
+    // Errors stick instead of passing silently (ENOSPC from /dev/full).
+    if (std::filesystem::exists("/dev/full"))
+    {
+        const std::string big(1 << 20, 'x');
+
+        FILE *full = fopen("/dev/full", "w");
+        cgen::FileSink full_sink(full);
+        assert(!full_sink.failed());
+        full_sink << std::string_view(big);
+        assert(full_sink.failed());
+        fclose(full);
+
+        full = fopen("/dev/full", "w");
+        {
+            cgen::FdSink fd_sink(fileno(full));
+            fd_sink << "small";
+            assert(!fd_sink.failed());
+            fd_sink.flush();
+            assert(fd_sink.failed());
+            fd_sink << std::string_view(big);
+            assert(fd_sink.failed());
+        }
+        fclose(full);
+
+        cgen::FileWriter writer("/dev/full", 16);
+        writer << std::string_view(big);
+        assert(writer.failed() && !writer.ok());
+    }
+
+    assert(program.accept(&visitor) == expected);
+}
+
+void test_arena()
+{
+    cgen::Arena arena(256);
+    cgen::CodeGenVisitor visitor;
+    size_t steady = 0;
+
+    for (int cycle = 0; cycle < 3; cycle++)
+    {
+        cgen::ArenaScope scope(arena);
+        size_t used = arena.bytes_used();
+        assert(used == 0);
+
+        auto type = cgen::decl_type(
+            "Point",
+            cgen::decl_local("p0", cgen::pointer_of(cgen::i32())),
+            cgen::decl_local("p1", cgen::array_of(cgen::i8(), 3)));
+        assert(type->flags & cgen::Node::ArenaOwned);
+
+        auto block = cgen::make<cgen::Block>();
+        block->push(std::make_unique<cgen::Return>());
+        block->nodes[0]->as<cgen::Return>()->node = cgen::call(cgen::local("f"), cgen::literal(7));
+        assert(!(block->nodes[0]->flags & cgen::Node::ArenaOwned));
+
+        assert(type->accept(&visitor) == "struct Point{int* p0;char[3] p1;};");
+        assert(block->accept(&visitor) == "{return f(7);}");
+        assert(arena.bytes_used() > used);
+        assert(type->as<cgen::DeclType>()->fields.get_allocator().resource() == &arena);
+        assert(block->nodes.get_allocator().resource() == &arena);
+
+        // Child lists are recycled with the nodes, so every cycle uses the same space
+        if (cycle == 0)
+            steady = arena.bytes_used();
+        assert(arena.bytes_used() == steady);
+
+        type.reset();
+        block.reset();
+        arena.reset();
+    }
+
+    auto heap = cgen::i32();
+    assert(!(heap->flags & cgen::Node::ArenaOwned));
+    assert(cgen::make<cgen::Block>()->nodes.get_allocator().resource() == std::pmr::new_delete_resource());
+}
+
+void test_node_kind()
+{
+    auto call = cgen::call(cgen::local("foo"), cgen::literal(1), cgen::literal(2.5), cgen::literal('c'));
+    assert(call->node_kind == cgen::NodeKind::Call);
+    assert(call->is<cgen::Call>());
+    assert(!call->is<cgen::Local>());
+    assert(call->as<cgen::Local>() == nullptr);
+
+    auto c = call->cast<cgen::Call>();
+    assert(c->node->as<cgen::Local>()->name == "foo");
+    assert(c->nodes[0]->is<cgen::LiteralBase>());
+    assert(c->nodes[0]->is<cgen::Literal<int>>());
+    assert(!c->nodes[0]->is<cgen::Literal<double>>());
+    assert(c->nodes[1]->as<cgen::Literal<double>>()->value == 2.5);
+    assert(c->nodes[2]->as<cgen::Literal<char>>()->value == 'c');
+    assert(c->nodes[2]->is<cgen::Node>());
+
+    assert(cgen::i32()->as<cgen::Primitive>()->kind == cgen::Primitive::i32);
+
+    cgen::Node custom;
+    assert(custom.node_kind == cgen::NodeKind::Custom);
+    assert(custom.as<cgen::Program>() == nullptr);
+}
+
+struct LeafCounter : cgen::StaticVisitor<LeafCounter, int>
+{
+    int visit(cgen::Call *node)
+    {
+        int count = dispatch(node->node.get());
+        for (auto &n : node->nodes)
+        {
+            count += dispatch(n.get());
+        }
+        return count;
+    }
+
+    int visit(cgen::Local *) { return 1; }
+
+    template <typename T>
+    int visit(cgen::Literal<T> *) { return 10; }
+
+    int visit(cgen::Node *) { return 100; }
+};
+
+void test_static_visitor()
+{
+    auto call = cgen::call(cgen::local("foo"), cgen::literal(1), cgen::literal(2.0f), cgen::i32());
+
+    LeafCounter counter;
+    assert(counter.dispatch(call.get()) == 1 + 10 + 10 + 100);
+
+    auto name = cgen::dispatch(call->as<cgen::Call>()->node.get(), cgen::overloaded{
+                                                                       [](cgen::Local *node)
+                                                                       { return node->name.str(); },
+                                                                       [](cgen::Node *)
+                                                                       { return std::string(); },
+                                                                   });
+    assert(name == "foo");
+}
+
+void test_parallel_emit()
+{
+    cgen::Program program;
+
+    for (int i = 0; i < 500; i++)
+    {
+        if (i % 3 == 0)
+        {
+            program.push(cgen::decl_type("T" + std::to_string(i), cgen::decl_local("x", cgen::i32())));
+            continue;
+        }
+
+        auto fn = std::make_unique<cgen::Function>();
+        fn->name = "f" + std::to_string(i);
+        fn->return_type = cgen::i32();
+        fn->body = std::make_unique<cgen::Block>();
+        fn->body->as<cgen::Block>()->push(cgen::call(cgen::local("g"), cgen::literal(i)));
+        program.push(std::move(fn));
+    }
+
+    cgen::CodeGenVisitor visitor;
+    std::string serial = program.accept(&visitor);
+
+    for (unsigned threads : {1u, 2u, 4u, 7u, 0u})
+    {
+        std::string parallel;
+        cgen::StringSink sink(parallel);
+        visitor.emit_parallel(&program, sink, threads);
+        assert(parallel == serial);
+    }
+
+    // One function holding nearly everything: split inside its body, the
+    // nested blocks and the wide calls, the text must come out the same.
+    cgen::Program unbalanced;
+    unbalanced.push(cgen::decl_type("T", cgen::decl_local("x", cgen::i32())));
+    auto big = std::make_unique<cgen::Function>();
+    big->name = "big";
+    big->return_type = cgen::i32();
+    auto body = std::make_unique<cgen::Block>();
+    for (int i = 0; i < 3000; i++)
+    {
+        if (i % 500 == 0)
+        {
+            auto call = cgen::call(cgen::local("h"));
+            for (int j = 0; j < 400; j++)
+            {
+                call->cast<cgen::Call>()->nodes.push_back(cgen::literal(j));
+            }
+            body->push(std::move(call));
+        }
+        else if (i % 100 == 0)
+        {
+            auto inner = std::make_unique<cgen::Block>();
+            for (int j = 0; j < 200; j++)
+            {
+                inner->push(cgen::call(cgen::local("g"), cgen::literal(j)));
+            }
+            body->push(std::move(inner));
+        }
+        else
+        {
+            body->push(cgen::call(cgen::local("g"), cgen::literal(i)));
+        }
+    }
+    big->body = std::move(body);
+    unbalanced.push(std::move(big));
+    unbalanced.push(cgen::decl_local("tail", cgen::i32()));
+
+    serial = unbalanced.accept(&visitor);
+
+    // Alone, the big function is split from the first statement on: every
+    // worker but the first starts out idle. Instrumentation frames keep
+    // each node whole, so nothing splits in that build.
+#ifdef CGEN_INSTRUMENTATION
+    const bool splits = false;
+#else
+    const bool splits = true;
+#endif
+    cgen::Program alone;
+    alone.push(cgen::clone(unbalanced.nodes[1].get()));
+    const std::string alone_serial = alone.accept(&visitor);
+    for (unsigned threads : {2u, 8u})
+    {
+        std::string parallel;
+        cgen::StringSink sink(parallel);
+        visitor.emit_parallel(&alone, sink, threads);
+        assert(parallel == alone_serial);
+        assert(!splits || visitor.parallel_stats.splits > 0);
+
+        std::string in_place;
+        visitor.emit_parallel(&alone, in_place, threads);
+        assert(in_place == alone_serial);
+        assert(!splits || (visitor.parallel_stats.splits > 0 && visitor.parallel_stats.copied > 0));
+        assert(visitor.parallel_stats.copied < alone_serial.size());
+    }
+
+    cgen::RenderCache cache;
+    cgen::CodeGenVisitor cached;
+    cached.cache = &cache;
+    for (unsigned threads : {2u, 3u, 8u})
+    {
+        std::string parallel;
+        cgen::StringSink sink(parallel);
+        visitor.emit_parallel(&unbalanced, sink, threads);
+        assert(parallel == serial);
+
+        std::string in_place = "// head\n";
+        visitor.emit_parallel(&unbalanced, in_place, threads);
+        assert(in_place == "// head\n" + serial);
+
+        std::string through_cache;
+        cgen::StringSink cache_sink(through_cache);
+        cached.emit_parallel(&unbalanced, cache_sink, threads);
+        assert(through_cache == serial);
+    }
+}
+
+void test_symbol()
+{
+    cgen::Symbol a = "counter";
+    cgen::Symbol b = std::string("counter");
+    cgen::Symbol c = "other";
+
+    static_assert(sizeof(cgen::Symbol) == sizeof(void *));
+    assert(a == b);
+    assert(a.id() == b.id());
+    assert(!(a == c));
+    assert(a == "counter");
+    assert(a.view() == "counter");
+    assert(cgen::Symbol().empty());
+    assert(cgen::Symbol("") == cgen::Symbol());
+    assert(cgen::SymbolTable::global().lookup(a.id()) == a);
+
+    auto local = cgen::local("counter");
+    auto decl = cgen::decl_local("counter", cgen::i32());
+    assert(local->as<cgen::Local>()->name == decl->as<cgen::DeclLocal>()->name);
+    assert(local->as<cgen::Local>()->name.data() == a.data());
+
+    cgen::SymbolTable table;
+    {
+        cgen::SymbolScope scope(table);
+        cgen::Symbol scoped = "counter";
+        assert(scoped == "counter");
+        assert(scoped.id() == 1);
+        assert(table.size() == 1);
+    }
+    assert(cgen::Symbol("counter") == a);
+}
+
+void test_type_table()
+{
+    cgen::TypeTable types;
+    cgen::CodeGenVisitor visitor;
+
+    {
+        cgen::TypeScope scope(types);
+
+        auto a = cgen::pointer_of(cgen::u8());
+        auto b = cgen::pointer_of(cgen::u8());
+        auto c = cgen::array_of(cgen::pointer_of(cgen::type("Point")), 4);
+        auto d = cgen::array_of(cgen::pointer_of(cgen::type("Point")), 4);
+
+        assert(a.get() == b.get());
+        assert(c.get() == d.get());
+        assert(a->flags & cgen::Node::Interned);
+        assert(cgen::i32().get() == cgen::i32().get());
+        assert(cgen::i32().get() != cgen::u32().get());
+        assert(cgen::TypeTable::text(c.get()) == "struct Point*[4]");
+        assert(c->accept(&visitor) == "struct Point*[4]");
+
+        auto decl = cgen::decl_local("x", cgen::pointer_of(cgen::u8()));
+        assert(decl->as<cgen::DeclLocal>()->type.get() == a.get());
+        assert(decl->accept(&visitor) == "unsigned char* x");
+
+        auto param = cgen::array_of(cgen::decl_local("argv", cgen::pointer_of(cgen::i8())));
+        assert(!(param->flags & cgen::Node::Interned));
+        assert(param->accept(&visitor) == "char* argv[]");
+    }
+
+    size_t count = types.size();
+    auto heap = cgen::pointer_of(cgen::u8());
+    assert(!(heap->flags & cgen::Node::Interned));
+    assert(types.intern(heap.get()) == types.pointer_of(types.primitive(cgen::Primitive::u8)));
+    assert(types.size() == count);
+
+    assert(cgen::same_type(heap.get(), types.intern(heap.get())));
+    assert(!cgen::same_type(heap.get(), cgen::pointer_of(cgen::i8()).get()));
+}
+
+void test_structural_hash()
+{
+    auto a = cgen::call(cgen::local("f"), cgen::literal(1), cgen::literal(2.5), cgen::get_ref(cgen::local("x")));
+    auto b = cgen::call(cgen::local("f"), cgen::literal(1), cgen::literal(2.5), cgen::get_ref(cgen::local("x")));
+    auto c = cgen::call(cgen::local("f"), cgen::literal(1), cgen::literal(2.5f), cgen::get_ref(cgen::local("x")));
+    auto d = cgen::call(cgen::local("f"), cgen::literal(1), cgen::literal(2.5));
+
+    assert(cgen::structural_digest(a.get()) == cgen::structural_digest(b.get()));
+    assert(cgen::structurally_equal(a.get(), b.get()));
+    assert(!(cgen::structural_digest(a.get()) == cgen::structural_digest(c.get())));
+    assert(!cgen::structurally_equal(a.get(), c.get()));
+    assert(!cgen::structurally_equal(a.get(), d.get()));
+    assert(cgen::structural_hash(cgen::i32().get()) != cgen::structural_hash(cgen::u32().get()));
+}
+
+void test_render_cache()
+{
+    cgen::Block block;
+    for (int i = 0; i < 4; i++)
+    {
+        block.push(cgen::call(cgen::local("puts"), cgen::literal(std::string("hi"))));
+    }
+    block.push(cgen::decl_type("P", cgen::decl_local("x", cgen::i32())));
+
+    cgen::CodeGenVisitor plain;
+    std::string expected = block.accept(&plain);
+
+    cgen::RenderCache identity;
+    cgen::CodeGenVisitor visitor;
+    visitor.cache = &identity;
+
+    assert(block.accept(&visitor) == expected);
+    assert(identity.hits() == 0 && identity.misses() == 5);
+    assert(block.accept(&visitor) == expected);
+    assert(identity.hits() == 5);
+
+    auto first = block.nodes[0]->as<cgen::Call>();
+    first->node->as<cgen::Local>()->name = "printf";
+    identity.invalidate(first);
+    assert(block.accept(&visitor) == "{printf(\"hi\");" + expected.substr(std::string("{puts(\"hi\");").size()));
+    assert(identity.hits() == 9 && identity.misses() == 6);
+
+    cgen::RenderCache structural(cgen::RenderCache::Structural);
+    visitor.cache = &structural;
+    block.nodes[0]->as<cgen::Call>()->node->as<cgen::Local>()->name = "puts";
+
+    assert(block.accept(&visitor) == expected);
+    assert(structural.misses() == 2 && structural.hits() == 3);
+    assert(structural.size() == 2);
+
+    structural.cache_kind(cgen::NodeKind::Block);
+    assert(block.accept(&visitor) == expected);
+    assert(block.accept(&visitor) == expected);
+    assert(structural.misses() == 3 && structural.hits() == 9);
+
+    std::string parallel;
+    cgen::Program program;
+    program.push(cgen::call(cgen::local("puts"), cgen::literal(std::string("hi"))));
+    cgen::StringSink sink(parallel);
+    visitor.emit_parallel(&program, sink, 2);
+    assert(parallel == "puts(\"hi\");");
+}
+
+std::unique_ptr<cgen::Node> make_function(const std::string &name, int value)
+{
+    auto fn = std::make_unique<cgen::Function>();
+    fn->name = name;
+    fn->return_type = cgen::i32();
+
+    auto body = std::make_unique<cgen::Block>();
+    auto ret = std::make_unique<cgen::Return>();
+    ret->node = cgen::call(cgen::local("g"), cgen::literal(value));
+    body->push(std::move(ret));
+    fn->body = std::move(body);
+
+    return fn;
+}
+
+void test_incremental_emit()
+{
+    cgen::Program program;
+    for (int i = 0; i < 10; i++)
+    {
+        program.push(make_function("f" + std::to_string(i), i));
+    }
+
+    cgen::CodeGenVisitor visitor;
+    cgen::IncrementalEmitter emitter(&program);
+
+    assert(emitter.update() == 10);
+    assert(emitter.str() == program.accept(&visitor));
+    assert(emitter.update() == 0);
+
+    auto call = program.nodes[3]->as<cgen::Function>()->body->as<cgen::Block>()->nodes[0]->as<cgen::Return>()->node->as<cgen::Call>();
+    call->nodes[0]->as<cgen::Literal<int>>()->value = 42;
+    call->nodes[0]->mark_dirty();
+    assert(program.nodes[3]->flags & cgen::Node::Dirty);
+    assert(!(program.nodes[4]->flags & cgen::Node::Dirty));
+
+    assert(emitter.update() == 1);
+    assert(emitter.str() == program.accept(&visitor));
+    assert(emitter.str().find("g(42)") != std::string::npos);
+
+    program.push(make_function("added", 1));
+    assert(emitter.update() == 1);
+    assert(emitter.str() == program.accept(&visitor));
+
+    program.nodes.erase(program.nodes.begin() + 1);
+    assert(emitter.update() == 0);
+    assert(emitter.str() == program.accept(&visitor));
+
+    program.nodes[0] = make_function("replaced", 0);
+    assert(emitter.update() == 1);
+    assert(emitter.str() == program.accept(&visitor));
+    assert(emitter.size() == emitter.str().size());
+
+    auto fn = program.nodes[5]->as<cgen::Function>();
+    fn->body = std::make_unique<cgen::Block>();
+    fn->mark_dirty();
+    assert(emitter.update() == 1);
+    assert(emitter.str() == program.accept(&visitor));
+
+    fn->body->as<cgen::Block>()->push(cgen::local("x"));
+    assert(emitter.update() == 1);
+    assert(emitter.str() == program.accept(&visitor));
+}
+
+void test_literal()
+{
+    cgen::CodeGenVisitor visitor;
+
+    assert(cgen::literal(42)->accept(&visitor) == "42");
+    assert(cgen::literal(-7)->accept(&visitor) == "-7");
+    assert(cgen::literal(42u)->accept(&visitor) == "42u");
+    assert(cgen::literal(42l)->accept(&visitor) == "42L");
+    assert(cgen::literal(42ul)->accept(&visitor) == "42UL");
+    assert(cgen::literal(42ll)->accept(&visitor) == "42LL");
+    assert(cgen::literal(42ull)->accept(&visitor) == "42ULL");
+    assert(cgen::literal((unsigned char)200)->accept(&visitor) == "200");
+    assert(cgen::literal((short)-3)->accept(&visitor) == "-3");
+    assert(cgen::literal(true)->accept(&visitor) == "1");
+    assert(cgen::literal(std::numeric_limits<int>::min())->accept(&visitor) == "(-2147483647-1)");
+    assert(cgen::literal(std::numeric_limits<long long>::min())->accept(&visitor) == "(-9223372036854775807LL-1)");
+
+    assert(cgen::literal(0.1)->accept(&visitor) == "0.1");
+    assert(cgen::literal(0.1f)->accept(&visitor) == "0.1f");
+    assert(cgen::literal(1.0)->accept(&visitor) == "1.0");
+    assert(cgen::literal(-2.0f)->accept(&visitor) == "-2.0f");
+    assert(cgen::literal(1e300)->accept(&visitor) == "1e+300");
+    assert(cgen::literal(0.1L)->accept(&visitor) == "0.1L");
+    assert(cgen::literal(std::numeric_limits<double>::infinity())->accept(&visitor) == "(1.0/0.0)");
+    assert(cgen::literal(-std::numeric_limits<float>::infinity())->accept(&visitor) == "(-1.0f/0.0f)");
+    assert(cgen::literal(std::nan(""))->accept(&visitor) == "(0.0/0.0)");
+
+    double value = 0.30000000000000004;
+    std::string text = cgen::literal(value)->accept(&visitor);
+    assert(std::stod(text) == value);
+
+    auto call = cgen::call(cgen::local("f"), cgen::literal(1.5f), cgen::literal(3u));
+    assert(call->accept(&visitor) == "f(1.5f,3u)");
+}
+
+void test_array_init()
+{
+    cgen::CodeGenVisitor visitor;
+
+    const uint8_t bytes[] = {0, 9, 10, 99, 100, 255};
+    auto table = cgen::array_init(std::span<const uint8_t>(bytes));
+    assert(table->accept(&visitor) == "{0,9,10,99,100,255}");
+
+    const int32_t ints[] = {-1, 2, std::numeric_limits<int32_t>::min()};
+    assert(cgen::array_init(std::span<const int32_t>(ints))->accept(&visitor) == "{-1,2,(-2147483647-1)}");
+
+    const float floats[] = {0.5f, 1.0f};
+    assert(cgen::array_init(std::span<const float>(floats))->accept(&visitor) == "{0.5f,1.0f}");
+
+    const uint16_t none[1] = {};
+    auto empty = cgen::array_init(std::span<const uint16_t>(none, 0));
+    assert(empty->accept(&visitor) == "{0}");
+    cgen::FlatTree flat(empty.get());
+    assert(flat.view().str() == "{0}");
+    assert(cgen::array_init(std::span<const uint8_t>(bytes, 0), cgen::ArrayInit::String)->accept(&visitor) == "\"\"");
+
+    std::vector<uint8_t> blob(2100);
+    for (size_t i = 0; i < blob.size(); i++)
+    {
+        blob[i] = (uint8_t)(i * 7);
+    }
+
+    std::string expected = "\"";
+    for (size_t i = 0; i < blob.size(); i++)
+    {
+        if (i > 0 && i % 1024 == 0)
+        {
+            expected += "\"\n\"";
+        }
+        char hex[5];
+        std::snprintf(hex, sizeof(hex), "\\x%02x", blob[i]);
+        expected += hex;
+    }
+    expected += "\"";
+
+    auto string = cgen::array_init(std::span<const uint8_t>(blob), cgen::ArrayInit::String);
+    assert(string->accept(&visitor) == expected);
+
+    std::string streamed;
+    cgen::StringSink sink(streamed);
+    visitor.emit(string.get(), sink);
+    assert(streamed == expected);
+
+    std::vector<uint8_t> copy = blob;
+    auto other = cgen::array_init(std::span<const uint8_t>(copy), cgen::ArrayInit::String);
+    assert(cgen::structurally_equal(string.get(), other.get()));
+    assert(cgen::structural_digest(string.get()) == cgen::structural_digest(other.get()));
+
+    copy[2000] ^= 1;
+    assert(!cgen::structurally_equal(string.get(), other.get()));
+}
+
+std::string read_file(const std::string &path)
+{
+    std::string contents;
+    FILE *file = fopen(path.c_str(), "rb");
+    char chunk[4096];
+    for (size_t n; (n = fread(chunk, 1, sizeof(chunk), file)) > 0;)
+    {
+        contents.append(chunk, n);
+    }
+    fclose(file);
+    return contents;
+}
+
+void test_file_writer()
+{
+    cgen::Program program;
+    program.push(cgen::decl_type("point", cgen::decl_local("x", cgen::i32())));
+    program.push(make_function("f", 1));
+    program.push(cgen::decl_local("g", cgen::u8()));
+
+    auto fn = make_function("h", 2);
+    auto wrapped = std::make_unique<cgen::Static>();
+    wrapped->node = std::move(fn);
+    program.push(std::move(wrapped));
+
+    cgen::CodeGenVisitor visitor;
+    const std::string expected = program.accept(&visitor);
+    const std::string path = (std::filesystem::temp_directory_path() / "cgen_file_writer.c").string();
+
+    // A buffer smaller than most nodes takes the writev path.
+    for (size_t buffer_size : {size_t(1), size_t(7), size_t(1 << 20)})
+    {
+        {
+            cgen::FileWriter writer(path.c_str(), buffer_size);
+            assert(writer.ok());
+            visitor.emit(&program, writer);
+            writer.close();
+            assert(writer.bytes_written() == expected.size());
+        }
+        assert(read_file(path) == expected);
+    }
+
+    std::string decls, defs;
+    cgen::StringSink decls_sink(decls), defs_sink(defs);
+    visitor.emit_sections(&program, decls_sink, defs_sink);
+    assert(decls == program.nodes[0]->accept(&visitor) + ";" + program.nodes[2]->accept(&visitor) + ";");
+    assert(defs == program.nodes[1]->accept(&visitor) + ";" + program.nodes[3]->accept(&visitor) + ";");
+
+    std::filesystem::remove(path);
+
+    cgen::FileWriter missing((std::filesystem::temp_directory_path() / "cgen-missing" / "x.c").string().c_str());
+    assert(!missing.ok());
+}
+
+void test_sharding()
+{
+    cgen::Program program;
+    program.push(cgen::decl_type("point", cgen::decl_local("x", cgen::i32())));
+    program.push(cgen::decl_local("counter", cgen::i32()));
+    for (int i = 0; i < 5; i++)
+    {
+        program.push(make_function("f" + std::to_string(i), i));
+    }
+
+    auto helper = std::make_unique<cgen::Static>();
+    helper->node = make_function("helper", 9);
+    program.push(std::move(helper));
+
+    cgen::CodeGenVisitor visitor;
+
+    std::string prototype;
+    cgen::StringSink prototype_sink(prototype);
+    visitor.emit_prototype(program.nodes[2]->cast<cgen::Function>(), prototype_sink);
+    assert(prototype == "int f0()");
+
+    auto shards = visitor.emit_sharded(&program, 3, "out.h");
+    assert(shards.header == "#pragma once\n" +
+                                program.nodes[0]->accept(&visitor) + ";\n"
+                                "extern int counter;\n"
+                                "int f0();\nint f1();\nint f2();\nint f3();\nint f4();\n");
+
+    assert(shards.units.size() == 3);
+    assert(shards.units[0].starts_with("#include \"out.h\"\nint counter;\n" + program.nodes[7]->accept(&visitor) + ";\n"));
+
+    size_t functions = 0;
+    for (auto &unit : shards.units)
+    {
+        assert(unit.starts_with("#include \"out.h\"\n"));
+        for (size_t at = unit.find("{return"); at != std::string::npos; at = unit.find("{return", at + 1))
+        {
+            functions++;
+        }
+    }
+    assert(functions == 6);
+
+    assert(visitor.emit_sharded(&program, 16).units.size() == 5);
+    assert(program.accept(&visitor).find("int f0(){return g(0);};") != std::string::npos);
+
+    // Only declarations go to the header: an initialized global is defined
+    // once, and a static lives in unit 0 along with the function using it,
+    // which balancing alone would have put in unit 1.
+    cgen::Program globals;
+    auto counter = std::make_unique<cgen::Assign>();
+    counter->lhs = cgen::decl_local("counter", cgen::i32());
+    counter->rhs = cgen::literal(0);
+    globals.push(std::move(counter));
+
+    auto hidden = std::make_unique<cgen::Static>();
+    hidden->node = cgen::decl_local("s", cgen::i32());
+    globals.push(std::move(hidden));
+    globals.push(make_function("h0", 12345));
+
+    auto use = std::make_unique<cgen::Function>();
+    use->name = "use";
+    use->return_type = cgen::i32();
+    use->body = std::make_unique<cgen::Block>();
+    auto ret = std::make_unique<cgen::Return>();
+    ret->node = cgen::local("s");
+    use->body->as<cgen::Block>()->push(std::move(ret));
+    globals.push(std::move(use));
+
+    auto split = visitor.emit_sharded(&globals, 2);
+    assert(split.header == "#pragma once\nextern int counter;\nint h0();\nint use();\n");
+    assert(split.units.size() == 2);
+    assert(split.units[0] == "#include \"program.h\"\nint counter = 0;\nstatic int s;\nint use(){return s;};\n");
+    assert(split.units[1] == "#include \"program.h\"\nint h0(){return g(12345);};\n");
+}
+
+void test_flat_tree()
+{
+    cgen::Program program;
+    program.push(cgen::decl_type("point", cgen::decl_local("x", cgen::i32()), cgen::decl_local("y", cgen::array_of(cgen::f64(), 3))));
+    program.push(cgen::decl_local("origin", cgen::type("point")));
+
+    const uint16_t table[] = {1, 2, 3};
+    program.push(cgen::array_init(std::span<const uint16_t>(table)));
+
+    auto fn = std::make_unique<cgen::Function>();
+    fn->name = "scale";
+    fn->return_type = cgen::pointer_of(cgen::i8());
+    fn->parameters.push_back(cgen::decl_local("p", cgen::pointer_of(cgen::type("point"))));
+    fn->parameters.push_back(cgen::decl_local("k", cgen::f32()));
+
+    auto body = std::make_unique<cgen::Block>();
+    auto assign = std::make_unique<cgen::Assign>();
+    assign->lhs = cgen::field(cgen::local("p"), "x");
+    assign->rhs = cgen::call(cgen::local("mul"), cgen::literal(2.5L), cgen::literal(std::string("s")), cgen::literal('c'));
+    body->push(std::move(assign));
+    auto ret = std::make_unique<cgen::Return>();
+    ret->node = cgen::get_ref(cgen::literal(-7ll));
+    body->push(std::move(ret));
+    fn->body = std::move(body);
+    program.push(std::move(fn));
+
+    auto empty = std::make_unique<cgen::Function>();
+    empty->name = "empty";
+    empty->return_type = cgen::i32();
+    empty->body = std::make_unique<cgen::Block>();
+    program.push(std::move(empty));
+
+    cgen::CodeGenVisitor visitor;
+    const std::string expected = program.accept(&visitor);
+
+    cgen::FlatTree flat(&program);
+    auto view = flat.view();
+    assert(view.kinds[view.root] == cgen::NodeKind::Program);
+    assert(view.children_of(view.root).size() == 5);
+    assert(view.valid());
+    assert(view.str() == expected);
+
+    auto rebuilt = view.to_tree();
+    assert(cgen::structurally_equal(rebuilt.get(), &program));
+    assert(rebuilt->accept(&visitor) == expected);
+    assert(rebuilt->cast<cgen::Program>()->nodes[1]->parent == rebuilt.get());
+
+    // Interned types are stored once however often they are used.
+    cgen::TypeTable types;
+    cgen::Program shared;
+    {
+        cgen::TypeScope scope(types);
+        for (int i = 0; i < 4; i++)
+        {
+            shared.push(cgen::decl_local("v" + std::to_string(i), cgen::pointer_of(cgen::u32())));
+        }
+    }
+
+    cgen::FlatTree flat_shared(&shared);
+    assert(flat_shared.size() == 1 + 4 + 2);
+    assert(flat_shared.view().valid());
+    assert(flat_shared.view().str() == shared.accept(&visitor));
+}
+
+void test_serialize()
+{
+    cgen::Program program;
+    program.push(cgen::decl_type("point", cgen::decl_local("x", cgen::i32())));
+    program.push(make_function("f", 3));
+    program.push(cgen::decl_local("pi", cgen::f64()));
+
+    const uint8_t table[] = {7, 8, 9};
+    program.push(cgen::array_init(std::span<const uint8_t>(table), cgen::ArrayInit::String));
+
+    cgen::CodeGenVisitor visitor;
+    const std::string expected = program.accept(&visitor);
+
+    cgen::FlatTree flat(&program);
+    const std::string path = (std::filesystem::temp_directory_path() / "cgen_serialize.bin").string();
+    {
+        cgen::FileWriter writer(path.c_str());
+        flat.view().write(writer);
+    }
+
+    {
+        cgen::MappedFile file(path.c_str());
+        assert(file.ok());
+
+        auto view = cgen::FlatView::load(file.data(), file.size());
+        assert(view && view->valid());
+        assert(view->size() == flat.size());
+        assert(view->str() == expected);
+        assert(cgen::structurally_equal(view->to_tree().get(), &program));
+
+        assert(!cgen::FlatView::load(file.data(), file.size() - 1));
+        assert(!cgen::FlatView::load(static_cast<const char *>(file.data()) + 8, file.size() - 8));
+    }
+
+    std::string data;
+    cgen::StringSink sink(data);
+    flat.view().write(sink);
+
+    std::vector<uint64_t> aligned(data.size() / 8 + 1);
+    std::memcpy(aligned.data(), data.data(), data.size());
+    assert(cgen::FlatView::load(aligned.data(), data.size())->str() == expected);
+
+    // Indices out of range are caught by valid(), not load().
+    auto *bytes = reinterpret_cast<char *>(aligned.data());
+    size_t children_at = data.size() - flat.bytes.size() - 2 * flat.size() - flat.children.size() * 4;
+    std::memset(bytes + children_at, 0x7F, 4);
+    auto broken = cgen::FlatView::load(aligned.data(), data.size());
+    assert(broken && !broken->valid());
+
+    bytes[0] = 'X';
+    assert(!cgen::FlatView::load(aligned.data(), data.size()));
+
+    std::filesystem::remove(path);
+    assert(!cgen::MappedFile(path.c_str()).ok());
+}
+
+void test_builders()
+{
+    cgen::CodeGenVisitor visitor;
+
+    cgen::Type point;
+    point.name = "point";
+    auto ptr = point.pointer_of();
+    auto arr = point.array_of(2);
+    assert(ptr->accept(&visitor) == "struct point*");
+    assert(arr->accept(&visitor) == "struct point[2]");
+    assert(ptr->cast<cgen::PointerOf>()->node.get() != &point);
+    assert(point.parent == nullptr);
+
+    std::string_view name = "count";
+    auto l = std::make_unique<cgen::Local>();
+    l->name = name;
+    auto c = cgen::call(cgen::local(name), std::move(l), cgen::literal("text"), cgen::literal(std::string_view("view")));
+    assert(c->accept(&visitor) == "count(count,\"text\",\"view\")");
+    assert(c->cast<cgen::Call>()->nodes.capacity() == 3);
+
+    auto s = cgen::decl_type("pair", cgen::decl_local("a", cgen::i32()), cgen::decl_local("b", cgen::i32()));
+    assert(s->cast<cgen::DeclType>()->fields.capacity() == 2);
+}
+
+void test_optimize()
+{
+    cgen::Program program;
+    program.push(cgen::decl_type("used", cgen::decl_local("x", cgen::i32())));
+    program.push(cgen::decl_type("unused", cgen::decl_local("x", cgen::i32())));
+
+    // helper calls leaf; nothing calls orphan, which calls itself.
+    auto leaf = std::make_unique<cgen::Static>();
+    leaf->node = make_function("leaf", 1);
+    program.push(std::move(leaf));
+
+    auto helper = std::make_unique<cgen::Static>();
+    helper->node = make_function("helper", 2);
+    helper->node->cast<cgen::Function>()->body->cast<cgen::Block>()->nodes[0]->cast<cgen::Return>()->node =
+        cgen::call(cgen::local("leaf"));
+    program.push(std::move(helper));
+
+    auto orphan = std::make_unique<cgen::Static>();
+    orphan->node = make_function("orphan", 3);
+    orphan->node->cast<cgen::Function>()->body->cast<cgen::Block>()->nodes[0]->cast<cgen::Return>()->node =
+        cgen::call(cgen::local("orphan"));
+    program.push(std::move(orphan));
+
+    auto fn = std::make_unique<cgen::Function>();
+    fn->name = "main";
+    fn->return_type = cgen::i32();
+    fn->parameters.push_back(cgen::decl_local("p", cgen::pointer_of(cgen::type("used"))));
+    auto body = std::make_unique<cgen::Block>();
+    auto assign = std::make_unique<cgen::Assign>();
+    assign->lhs = cgen::local("y");
+    assign->rhs = cgen::call(cgen::local("helper"), cgen::get_ref(std::make_unique<cgen::Deref>()));
+    assign->rhs->cast<cgen::Call>()->nodes[0]->cast<cgen::GetRef>()->node->cast<cgen::Deref>()->node = cgen::local("q");
+    body->push(std::move(assign));
+    auto ret = std::make_unique<cgen::Return>();
+    ret->node = cgen::literal(0);
+    body->push(std::move(ret));
+    body->push(cgen::call(cgen::local("after")));
+    fn->body = std::move(body);
+    program.push(std::move(fn));
+
+    cgen::link_parents(&program);
+
+    assert(cgen::optimize(&program) == 4);
+    assert(program.nodes.size() == 4);
+
+    cgen::CodeGenVisitor visitor;
+    assert(program.nodes[3]->accept(&visitor) == "int main(struct used* p){y = helper(q);return 0;}");
+    assert(program.nodes[0]->cast<cgen::DeclType>()->name == "used");
+    assert(program.nodes[1]->cast<cgen::Static>()->node->cast<cgen::Function>()->name == "leaf");
+    assert(program.nodes[2]->cast<cgen::Static>()->node->cast<cgen::Function>()->name == "helper");
+
+    auto call = program.nodes[3]->cast<cgen::Function>()->body->cast<cgen::Block>()->nodes[0]->cast<cgen::Assign>()->rhs.get();
+    assert(call->cast<cgen::Call>()->nodes[0]->parent == call);
+
+    assert(cgen::optimize(&program) == 0);
+}
+
+void test_expressions()
+{
+    using B = cgen::BinaryOp;
+    using U = cgen::UnaryOp;
+    auto a = []
+    { return cgen::local("a"); };
+    auto b = []
+    { return cgen::local("b"); };
+    auto c = []
+    { return cgen::local("c"); };
+    auto deref = [](std::unique_ptr<cgen::Node> node)
+    {
+        auto d = std::make_unique<cgen::Deref>();
+        d->node = std::move(node);
+        return d;
+    };
+
+    // Recursive, iterative and flat emission agree on every case.
+    cgen::CodeGenVisitor visitor;
+    cgen::CodeGenVisitor iterative;
+    iterative.max_depth = 0;
+    auto emit = [&](std::unique_ptr<cgen::Node> node)
+    {
+        std::string text = node->accept(&visitor);
+        assert(node->accept(&iterative) == text);
+        cgen::FlatTree flat(node.get());
+        assert(flat.view().valid());
+        assert(flat.view().str() == text);
+        assert(cgen::structurally_equal(flat.view().to_tree().get(), node.get()));
+        return text;
+    };
+
+    assert(emit(cgen::binary(B::Sub, cgen::binary(B::Sub, a(), b()), c())) == "a-b-c");
+    assert(emit(cgen::binary(B::Sub, a(), cgen::binary(B::Sub, b(), c()))) == "a-(b-c)");
+    assert(emit(cgen::binary(B::Mul, cgen::binary(B::Add, a(), b()), c())) == "(a+b)*c");
+    assert(emit(cgen::binary(B::Add, cgen::binary(B::Mul, a(), b()), c())) == "a*b+c");
+    assert(emit(cgen::binary(B::Or, cgen::binary(B::And, a(), b()), cgen::binary(B::Lt, b(), c()))) == "a&&b||b<c");
+    assert(emit(cgen::binary(B::BitAnd, cgen::binary(B::Eq, a(), b()), c())) == "a==b&c");
+    assert(emit(cgen::binary(B::Eq, a(), cgen::binary(B::BitAnd, b(), c()))) == "a==(b&c)");
+
+    // Operators that would lex as another token are spaced apart.
+    assert(emit(cgen::binary(B::Sub, a(), cgen::unary(U::Neg, b()))) == "a- -b");
+    assert(emit(cgen::binary(B::Sub, a(), cgen::literal(-1))) == "a- -1");
+    assert(emit(cgen::binary(B::Div, a(), deref(b()))) == "a/ *b");
+    assert(emit(cgen::binary(B::BitAnd, a(), cgen::get_ref(b()))) == "a& &b");
+    assert(emit(cgen::binary(B::And, a(), cgen::get_ref(b()))) == "a&& &b");
+    assert(emit(cgen::unary(U::Neg, cgen::unary(U::Neg, a()))) == "- -a");
+    assert(emit(cgen::unary(U::Neg, cgen::unary(U::PreDec, a()))) == "- --a");
+    assert(emit(cgen::binary(B::Add, a(), cgen::unary(U::PostInc, b()))) == "a+b++");
+
+    assert(emit(cgen::field(deref(a()), "x")) == "(*a).x");
+    assert(emit(cgen::call(deref(a()), b())) == "(*a)(b)");
+    assert(emit(deref(cgen::call(a(), b()))) == "*a(b)");
+    assert(emit(cgen::get_ref(cgen::index(a(), cgen::binary(B::Add, b(), cgen::literal(1))))) == "&a[b+1]");
+    assert(emit(cgen::index(cgen::binary(B::Add, a(), b()), c())) == "(a+b)[c]");
+    assert(emit(cgen::unary(U::PostInc, deref(a()))) == "(*a)++");
+    assert(emit(cgen::cast(cgen::pointer_of(cgen::u8()), cgen::binary(B::Add, a(), b()))) == "(unsigned char*)(a+b)");
+    assert(emit(cgen::binary(B::Shl, cgen::cast(cgen::i32(), a()), cgen::literal(2))) == "(int)a<<2");
+    assert(emit(cgen::field(cgen::literal(-1), "x")) == "(-1).x");
+
+    // Deep chains take the explicit stack and still match.
+    std::unique_ptr<cgen::Node> chain = a();
+    std::string expected = "a";
+    for (int i = 0; i < 2000; i++)
+    {
+        chain = cgen::binary(i % 2 ? B::Sub : B::Mul, std::move(chain), cgen::unary(U::Neg, b()));
+        expected = i % 2 ? expected + "- -b" : (i ? "(" + expected + ")" : expected) + "*-b";
+    }
+    cgen::CodeGenVisitor deep;
+    assert(chain->accept(&deep) == expected);
+    assert(chain->accept(&iterative) == expected);
+}
+
+void test_fold_operators()
+{
+    using B = cgen::BinaryOp;
+    using U = cgen::UnaryOp;
+    auto folded = [](std::unique_ptr<cgen::Node> expression)
+    {
+        cgen::Program program;
+        auto ret = std::make_unique<cgen::Return>();
+        ret->node = std::move(expression);
+        program.push(std::move(ret));
+        cgen::FoldConstants fold;
+        fold.run(&program);
+        cgen::CodeGenVisitor visitor;
+        return program.nodes[0]->cast<cgen::Return>()->node->accept(&visitor);
+    };
+
+    assert(folded(cgen::binary(B::Add, cgen::binary(B::Mul, cgen::literal(6), cgen::literal(7)), cgen::literal(-2))) == "40");
+    assert(folded(cgen::unary(U::Neg, cgen::binary(B::Shl, cgen::literal(1u), cgen::literal(31u)))) == "2147483648u");
+    assert(folded(cgen::binary(B::Lt, cgen::literal(1.5), cgen::literal(2.0))) == "1");
+    assert(folded(cgen::binary(B::Div, cgen::literal(7.0), cgen::literal(2.0))) == "3.5");
+    assert(folded(cgen::unary(U::Not, cgen::literal(0ll))) == "1");
+
+    // Left as written: undefined, implementation-defined or promoting.
+    const int max = std::numeric_limits<int>::max();
+    const int min = std::numeric_limits<int>::min();
+    assert(folded(cgen::binary(B::Add, cgen::literal(max), cgen::literal(1))).find('+') != std::string::npos);
+    assert(folded(cgen::binary(B::Div, cgen::literal(1), cgen::literal(0))) == "1/0");
+    assert(folded(cgen::binary(B::Mod, cgen::literal(min), cgen::literal(-1))).find('%') != std::string::npos);
+    assert(folded(cgen::binary(B::Shl, cgen::literal(1), cgen::literal(32))) == "1<<32");
+    assert(folded(cgen::binary(B::Shl, cgen::literal(-1), cgen::literal(1))) == "-1<<1");
+    assert(folded(cgen::unary(U::Neg, cgen::literal(min))) == "-(-2147483647-1)");
+    assert(folded(cgen::binary(B::Add, cgen::literal(1), cgen::literal(2u))) == "1+2u");
+    assert(folded(cgen::binary(B::Add, cgen::literal('a'), cgen::literal('b'))) == "'a'+'b'");
+    assert(folded(cgen::binary(B::Add, cgen::local("x"), cgen::literal(0))) == "x+0");
+}
+
+void test_symbol_index()
+{
+    cgen::Program program;
+    program.push(cgen::decl_type("point", cgen::decl_local("x", cgen::i32())));
+    program.push(cgen::decl_type("unused", cgen::decl_local("x", cgen::i32())));
+    program.push(make_function("g", 0));
+
+    auto fn = std::make_unique<cgen::Function>();
+    fn->name = "main";
+    fn->return_type = cgen::i32();
+    fn->parameters.push_back(cgen::decl_local("p", cgen::type("point")));
+    auto body = std::make_unique<cgen::Block>();
+    body->push(cgen::call(cgen::local("g"), cgen::field(cgen::local("p"), "x")));
+    fn->body = std::move(body);
+    program.push(std::move(fn));
+    cgen::link_parents(&program);
+
+    auto &index = program.index_symbols();
+    auto &g = index.lookup("g");
+    assert(g.definitions.size() == 1 && g.definitions[0] == program.nodes[2].get());
+    assert(g.calls.size() == 2 && g.locals.size() == 2);
+    assert(index.lookup("point").types.size() == 1);
+    assert(index.lookup("unused").types.empty());
+    assert(index.lookup("x").definitions.size() == 2 && index.lookup("x").fields.size() == 1);
+    assert(index.lookup("p").locals[0]->parent->is<cgen::Field>());
+    assert(index.lookup("nothing").definitions.empty());
+
+    // Pushes below the program keep it current, in source order.
+    auto main_body = program.nodes[3]->cast<cgen::Function>()->body->cast<cgen::Block>();
+    main_body->push(cgen::call(cgen::local("g"), cgen::literal(2)));
+    assert(g.calls.size() == 3 && g.calls[2] == main_body->nodes[1].get());
+
+    program.push(make_function("h", 1));
+    assert(index.lookup("h").definitions.size() == 1 && g.calls.size() == 4);
+
+    // A block not yet under the program is indexed when it is attached.
+    auto detached = std::make_unique<cgen::Block>();
+    detached->push(cgen::local("later"));
+    assert(index.lookup("later").locals.empty());
+    main_body->push(std::move(detached));
+    assert(index.lookup("later").locals.size() == 1);
+
+    // Passes that change the tree refresh it.
+    auto orphan = std::make_unique<cgen::Static>();
+    orphan->node = make_function("orphan", 3);
+    program.push(std::move(orphan));
+    assert(index.lookup("orphan").definitions.size() == 1);
+    cgen::RemoveUnused unused;
+    assert(unused.run(&program) == 2);
+    assert(index.lookup("orphan").definitions.empty() && index.lookup("unused").definitions.empty());
+    assert(index.lookup("point").definitions.size() == 1 && index.lookup("g").calls.size() == 4);
+}
+
+void test_deep_nesting()
+{
+    const size_t depth = 200000;
+
+    std::unique_ptr<cgen::Node> chain = cgen::local("x");
+    for (size_t i = 0; i < depth; i++)
+    {
+        chain = i % 2 ? cgen::get_ref(std::move(chain)) : cgen::call(cgen::local("f"), std::move(chain), cgen::literal(1));
+    }
+
+    std::unique_ptr<cgen::Node> nested = std::move(chain);
+    for (size_t i = 0; i < depth; i++)
+    {
+        auto block = std::make_unique<cgen::Block>();
+        block->push(std::move(nested));
+        nested = std::move(block);
+    }
+
+    std::string expected(depth, '{');
+    for (size_t i = depth; i-- > 0;)
+    {
+        expected += i % 2 ? "&" : "f(";
+    }
+    expected += 'x';
+    for (size_t i = 0; i < depth; i++)
+    {
+        expected += i % 2 ? "" : ",1)";
+    }
+    for (size_t i = 0; i < depth; i++)
+    {
+        expected += ";}";
+    }
+
+    cgen::CodeGenVisitor visitor;
+    assert(nested->accept(&visitor) == expected);
+    assert(cgen::clone(nested.get())->accept(&visitor) == expected);
+
+    // Forcing the explicit stack everywhere gives the same output.
+    cgen::Program program;
+    program.push(cgen::decl_type("point", cgen::decl_local("x", cgen::array_of(cgen::i32(), 2)), cgen::decl_local("y", cgen::array_of(cgen::i32()))));
+    program.push(make_function("f", 1));
+    auto helper = std::make_unique<cgen::Static>();
+    helper->node = make_function("helper", 2);
+    helper->node->cast<cgen::Function>()->parameters.push_back(cgen::decl_local("a", cgen::pointer_of(cgen::type("point"))));
+    helper->node->cast<cgen::Function>()->parameters.push_back(cgen::decl_local("b", cgen::u8()));
+    program.push(std::move(helper));
+
+    cgen::CodeGenVisitor iterative;
+    iterative.max_depth = 0;
+    assert(program.accept(&iterative) == program.accept(&visitor));
+
+    nested.reset();
+}
+
+void test_sized_emit()
+{
+    cgen::Program program;
+    for (int i = 0; i < 300; i++)
+    {
+        program.push(make_function("f" + std::to_string(i), i * 1000));
+    }
+
+    cgen::CodeGenVisitor visitor;
+    const std::string expected = program.accept(&visitor);
+    assert(visitor.measure(&program) == expected.size());
+
+    std::string out = "// head\n";
+    visitor.emit_sized(&program, out);
+    assert(out == "// head\n" + expected);
+
+    for (unsigned threads : {1u, 3u, 8u})
+    {
+        std::string parallel = "// head\n";
+        visitor.emit_parallel(&program, parallel, threads);
+        assert(parallel == "// head\n" + expected);
+
+        // Written in place: no growth past one allocation of the exact
+        // size, and nothing copied in from intermediate strings (these
+        // nodes have no list long enough to split inside).
+        std::string exact = "// head\n";
+        exact.reserve(exact.size() + expected.size());
+        const char *data = exact.data();
+        visitor.emit_parallel(&program, exact, threads);
+        assert(exact.data() == data && exact == "// head\n" + expected);
+        assert(visitor.parallel_stats.copied == 0);
+    }
+
+    cgen::CountingSink counter;
+    counter << "abc" << 'd';
+    assert(counter.count == 4);
+}
+
+void test_program_writer()
+{
+    std::string expected;
+    for (int i = 0; i < 100; i++)
+    {
+        cgen::CodeGenVisitor visitor;
+        expected += make_function("f" + std::to_string(i), i)->accept(&visitor) + ";";
+    }
+
+    std::string out;
+    cgen::StringSink sink(out);
+    {
+        cgen::ProgramWriter writer(sink, 2);
+        for (int i = 0; i < 100; i++)
+        {
+            bool queued = writer.push(make_function("f" + std::to_string(i), i));
+            assert(queued);
+            // At most capacity queued plus one being written.
+            assert(writer.written() + 3 >= size_t(i + 1));
+        }
+        writer.close();
+        assert(writer.written() == 100);
+    }
+    assert(out == expected);
+}
+
+void test_escape()
+{
+    cgen::CodeGenVisitor visitor;
+
+    assert(cgen::literal("plain text")->accept(&visitor) == "\"plain text\"");
+    assert(cgen::literal("say \"hi\"\\n")->accept(&visitor) == "\"say \\\"hi\\\"\\\\n\"");
+    assert(cgen::literal("a\nb\tc\rd")->accept(&visitor) == "\"a\\nb\\tc\\rd\"");
+    assert(cgen::literal(std::string("\0\x01\x7f\xff", 4))->accept(&visitor) == "\"\\000\\001\\177\\377\"");
+    assert(cgen::literal("what?" "?!")->accept(&visitor) == "\"what?\\?!\"");
+    assert(cgen::literal('\'')->accept(&visitor) == "'\\''");
+    assert(cgen::literal('\n')->accept(&visitor) == "'\\n'");
+    assert(cgen::literal('x')->accept(&visitor) == "'x'");
+
+    // Escapes land at every offset of the vector loops.
+    for (size_t at = 0; at < 70; at++)
+    {
+        std::string text(70, 'a');
+        text[at] = '"';
+        std::string expected = "\"" + text.substr(0, at) + "\\\"" + text.substr(at + 1) + "\"";
+        assert(cgen::literal(text)->accept(&visitor) == expected);
+    }
+
+    std::string big(10000, 'z');
+    std::string split = cgen::literal(big)->accept(&visitor);
+    assert(split == "\"" + big.substr(0, 4000) + "\"\n\"" + big.substr(4000, 4000) + "\"\n\"" + big.substr(8000) + "\"");
+}
+
+#ifdef CGEN_INSTRUMENTATION
+void test_instrumentation()
+{
+    auto &stats = cgen::Instrumentation::global();
+    stats.reset();
+
+    cgen::Program program;
+    program.push(make_function("a", 1));
+    program.push(make_function("b", 2));
+
+    auto &calls = stats.kinds[size_t(cgen::NodeKind::Call)];
+    assert(calls.allocations == 2);
+    assert(calls.allocated_bytes == 2 * sizeof(cgen::Call));
+
+    cgen::CodeGenVisitor visitor;
+    std::string text = program.accept(&visitor);
+
+    auto &programs = stats.kinds[size_t(cgen::NodeKind::Program)];
+    assert(programs.visits == 1);
+    assert(programs.bytes == text.size());
+    assert(programs.self_bytes == 2); // the ';' after each function
+    assert(stats.kinds[size_t(cgen::NodeKind::Function)].visits == 2);
+
+    uint64_t self_bytes = 0;
+    for (auto &kind : stats.kinds)
+    {
+        self_bytes += kind.self_bytes;
+    }
+    assert(self_bytes == text.size());
+
+    std::string json;
+    cgen::StringSink sink(json);
+    stats.write_json(sink);
+    assert(json.starts_with("{\"kinds\":{\"Program\":{\"visits\":1,"));
+    assert(json.find("\"Function\":{\"visits\":2,\"bytes\":") != std::string::npos);
+    assert(json.find("\"Custom\"") == std::string::npos);
+}
+#endif
+
+void test_disk_cache()
+{
+    const std::string path = (std::filesystem::temp_directory_path() / "cgen_emit_cache.bin").string();
+    std::filesystem::remove(path);
+
+    auto build = [](int changed)
+    {
+        cgen::Program program;
+        for (int i = 0; i < 3; i++)
+            program.push(make_function("f" + std::to_string(i), i == 2 ? changed : i));
+        return program;
+    };
+
+    cgen::CodeGenVisitor plain;
+    auto emit = [&](cgen::Program &program, cgen::RenderCache &cache)
+    {
+        cgen::CodeGenVisitor visitor;
+        visitor.cache = &cache;
+        std::string text = program.accept(&visitor);
+        assert(text == program.accept(&plain));
+    };
+
+    {
+        cgen::RenderCache cache(cgen::RenderCache::Structural);
+        cache.cache_kind(cgen::NodeKind::Function);
+        assert(!cache.load(path.c_str()));
+
+        auto program = build(2);
+        emit(program, cache);
+        assert(cache.hits() == 0);
+        assert(cache.save(path.c_str()));
+
+        // Still served from the new file once saved.
+        cache.clear();
+        assert(cache.load(path.c_str()));
+        emit(program, cache);
+        assert(cache.misses() == 6);
+    }
+
+    {
+        // Next run: only the edited function is rendered.
+        cgen::RenderCache cache(cgen::RenderCache::Structural);
+        cache.cache_kind(cgen::NodeKind::Function);
+        assert(cache.load(path.c_str()));
+
+        auto program = build(20);
+        emit(program, cache);
+        assert(cache.hits() == 2);
+        assert(cache.misses() == 2);
+        assert(cache.save(path.c_str()));
+    }
+
+    {
+        cgen::RenderCache cache(cgen::RenderCache::Structural);
+        cache.cache_kind(cgen::NodeKind::Function);
+        assert(cache.load(path.c_str()));
+
+        auto current = build(20);
+        emit(current, cache);
+        assert(cache.misses() == 0);
+
+        // Entries not used by the previous run were dropped.
+        auto old = build(2);
+        emit(old, cache);
+        assert(cache.misses() == 2);
+    }
+
+    // Custom nodes hash by address and are kept out of the file.
+    cgen::RenderCache cache(cgen::RenderCache::Structural);
+    auto block = cgen::make<cgen::Block>();
+    block->push(std::make_unique<cgen::Node>());
+    assert(!cache.key(block.get()).portable);
+    assert(cache.key(make_function("f", 1).get()).portable);
+
+    {
+        cgen::FileWriter garbage(path.c_str());
+        garbage << std::string_view("CGENEMIT but not really a cache file");
+    }
+    assert(!cache.load(path.c_str()));
+    std::filesystem::remove(path);
+}
+
+// Hand-written views of the sort a corrupt or hostile file yields.
+struct MalformedView
+{
+    std::vector<cgen::NodeKind> kinds;
+    std::vector<uint8_t> tags;
+    std::vector<uint32_t> first;
+    std::vector<uint32_t> counts;
+    std::vector<uint64_t> values;
+    std::vector<cgen::FlatView::Index> children;
+    std::string bytes;
+
+    // Children go into one block per node, in the order nodes are added.
+    uint32_t add(cgen::NodeKind kind, std::vector<cgen::FlatView::Index> list = {}, uint8_t tag = 0, uint64_t value = 0)
+    {
+        kinds.push_back(kind);
+        tags.push_back(tag);
+        first.push_back((uint32_t)children.size());
+        counts.push_back((uint32_t)list.size());
+        values.push_back(value);
+        children.insert(children.end(), list.begin(), list.end());
+        return (uint32_t)kinds.size() - 1;
+    }
+
+    // Whether valid() lets the view through; if it does, emits and rebuilds
+    // it, so anything wrongly accepted fails here rather than passing.
+    bool accepted(uint32_t root) const
+    {
+        cgen::FlatView view{kinds, tags, first, counts, values, children, bytes, root};
+        if (!view.valid())
+        {
+            return false;
+        }
+        view.str();
+        view.to_tree();
+        return true;
+    }
+};
+
+void test_flat_validate()
+{
+    using K = cgen::NodeKind;
+    using List = std::vector<cgen::FlatView::Index>;
+    constexpr auto none = cgen::FlatView::none;
+
+    // valid() checks the whole view, so each case gets one of its own:
+    // a node over a literal 1 at index 0.
+    auto over_one = [](K kind, List list, uint8_t tag = 0)
+    {
+        MalformedView v;
+        v.add(K::Literal, {}, cgen::LiteralBase::Int, 1);
+        return v.accepted(v.add(kind, list, tag));
+    };
+
+    assert(over_one(K::Call, {0, none}));
+    assert(over_one(K::Function, {0, 0}));
+    assert(over_one(K::BinaryOp, {0, 0}, cgen::BinaryOp::Add));
+
+    assert(!over_one(K::Call, {}));
+    assert(!over_one(K::Function, {0}));
+    assert(!over_one(K::Function, {0, none}));
+    assert(!over_one(K::Assign, {0}));
+    assert(!over_one(K::BinaryOp, {0, 0, 0}));
+    assert(!over_one(K::Cast, {none, 0}));
+    assert(!over_one(K::Deref, {none}));
+    assert(!over_one(K::Primitive, {0}, cgen::Primitive::i32));
+    assert(!over_one(K::BinaryOp, {0, 0}, 0xFF));
+
+    if constexpr (sizeof(long double) > sizeof(uint64_t))
+    {
+        MalformedView v;
+        v.bytes = std::string(sizeof(long double) - 1, '\0');
+        assert(!v.accepted(v.add(K::Literal, {}, cgen::LiteralBase::LongDouble, v.bytes.size())));
+
+        MalformedView good;
+        good.bytes = std::string(sizeof(long double), '\0');
+        assert(good.accepted(good.add(K::Literal, {}, cgen::LiteralBase::LongDouble, good.bytes.size())));
+    }
+
+    {
+        MalformedView v;
+        v.bytes = "abc";
+        assert(!v.accepted(v.add(K::ArrayInit, {}, cgen::Primitive::u16, v.bytes.size())));
+    }
+
+    // A node reaching itself, directly or through a descendant, even when
+    // the root does not lead there.
+    {
+        MalformedView v;
+        assert(!v.accepted(v.add(K::Deref, {0})));
+    }
+    {
+        MalformedView v;
+        uint32_t outer = v.add(K::GetRef, {1});
+        v.add(K::UnaryOp, {outer}, cgen::UnaryOp::Neg);
+        assert(!v.accepted(none));
+    }
+}
+
+void test_write_if_changed()
+{
+    cgen::Program program;
+    for (int i = 0; i < 4; i++)
+        program.push(make_function("f" + std::to_string(i), i));
+
+    cgen::CodeGenVisitor visitor;
+    auto units = visitor.emit_sharded(&program, 2);
+    const std::string path = (std::filesystem::temp_directory_path() / "cgen_unit0.c").string();
+    std::filesystem::remove(path);
+
+    assert(cgen::write_if_changed(path.c_str(), units.units[0]) == cgen::WriteStatus::Written);
+    auto time = std::filesystem::last_write_time(path);
+    assert(cgen::write_if_changed(path.c_str(), units.units[0]) == cgen::WriteStatus::Unchanged);
+    assert(std::filesystem::last_write_time(path) == time);
+    assert(read_file(path) == units.units[0]);
+
+    assert(cgen::write_if_changed(path.c_str(), units.units[1]) == cgen::WriteStatus::Written);
+    assert(read_file(path) == units.units[1]);
+    assert(cgen::write_if_changed(path.c_str(), "") == cgen::WriteStatus::Written);
+    assert(cgen::write_if_changed(path.c_str(), "") == cgen::WriteStatus::Unchanged);
+    std::filesystem::remove(path);
+
+    auto missing = (std::filesystem::temp_directory_path() / "cgen-missing" / "x.c").string();
+    assert(cgen::write_if_changed(missing.c_str(), "x") == cgen::WriteStatus::Failed);
+}
+
+bool parents_linked(cgen::Node *node)
+{
+    bool linked = true;
+    cgen::for_each_child(node, [&](std::unique_ptr<cgen::Node> &child)
+                         {
+                             if (child && !(child->flags & (cgen::Node::Interned | cgen::Node::Shared)))
+                                 linked = linked && child->parent == node && parents_linked(child.get()); });
+    return linked;
+}
+
+void test_clone()
+{
+    cgen::CodeGenVisitor visitor;
+    cgen::TypeTable types;
+    cgen::Arena arena(256);
+
+    cgen::Program program;
+    program.push(cgen::decl_type("point", cgen::decl_local("x", cgen::i32()), cgen::decl_local("y", cgen::array_of(cgen::u8(), 4))));
+    program.push(make_function("f", 1));
+    program.push(cgen::decl_local("table", cgen::array_of(cgen::i32(), 2)));
+    program.push(cgen::literal(std::string("text")));
+    const int values[] = {1, 2, 3};
+    program.push(cgen::array_init(std::span<const int>(values)));
+    {
+        cgen::TypeScope scope(types);
+        program.push(cgen::decl_local("p", cgen::pointer_of(cgen::type("point"))));
+    }
+
+    auto copy = cgen::clone(&program);
+    assert(copy->accept(&visitor) == program.accept(&visitor));
+    assert(cgen::structurally_equal(copy.get(), &program));
+    assert(parents_linked(copy.get()));
+    assert(copy->as<cgen::Program>()->nodes[1].get() != program.nodes[1].get());
+
+    // Interned types are shared, everything else is copied.
+    auto &decl = *copy->as<cgen::Program>()->nodes[5]->as<cgen::DeclLocal>();
+    assert(decl.type.get() == program.nodes[5]->as<cgen::DeclLocal>()->type.get());
+
+    {
+        cgen::ArenaScope scope(arena);
+        auto in_arena = cgen::clone(&program);
+        assert(in_arena->flags & cgen::Node::ArenaOwned);
+        assert(in_arena->accept(&visitor) == program.accept(&visitor));
+        assert(in_arena->as<cgen::Program>()->nodes.get_allocator().resource() == &arena);
+    }
+    arena.reset();
+
+    // A custom node without copy() leaves its slot empty.
+    auto block = cgen::make<cgen::Block>();
+    block->push(std::make_unique<cgen::Node>());
+    assert(cgen::clone(block.get())->as<cgen::Block>()->nodes[0] == nullptr);
+}
+
+void test_share()
+{
+    cgen::CodeGenVisitor visitor;
+    auto base = make_function("base", 1);
+    cgen::Node *body = base->as<cgen::Function>()->body.get();
+
+    // Variants differ in name only and share the body.
+    std::vector<std::unique_ptr<cgen::Node>> variants;
+    for (int i = 0; i < 3; i++)
+    {
+        auto variant = cgen::share(base.get());
+        auto fn = cgen::mutate(variant)->as<cgen::Function>();
+        assert(fn != base.get());
+        fn->name = "v" + std::to_string(i);
+        assert(fn->body.get() == body);
+        variants.push_back(std::move(variant));
+    }
+    assert(base->flags & cgen::Node::Shared);
+    assert(body->flags & cgen::Node::Shared);
+    assert(base->accept(&visitor) == "int base(){return g(1);}");
+    base.reset();
+    assert(variants[1]->accept(&visitor) == "int v1(){return g(1);}");
+
+    // Editing under a shared node copies the path down to the edit.
+    auto fn = variants[0]->as<cgen::Function>();
+    auto edited = cgen::mutate(fn->body, fn)->as<cgen::Block>();
+    assert(edited != body && edited->parent == fn);
+    edited->nodes[0] = cgen::call(cgen::local("h"));
+    assert(variants[0]->accept(&visitor) == "int v0(){h();}");
+    assert(variants[2]->accept(&visitor) == "int v2(){return g(1);}");
+
+    // The last owner edits in place.
+    variants[1].reset();
+    fn = variants[2]->as<cgen::Function>();
+    assert(cgen::mutate(fn->body, fn) == body);
+    assert(!(body->flags & cgen::Node::Shared));
+    assert(body->as<cgen::Block>()->nodes[0]->flags & cgen::Node::Shared);
+
+    // Passes leave shared subtrees alone.
+    cgen::Program program;
+    for (int i = 0; i < 2; i++)
+    {
+        auto block = cgen::make<cgen::Block>();
+        block->push(cgen::make<cgen::Return>());
+        block->push(cgen::local("dead"));
+        program.push(std::move(block));
+    }
+    auto shared = cgen::share(program.nodes[1].get());
+    cgen::RemoveUnreachable pass;
+    assert(pass.run(&program) == 1);
+    assert(program.nodes[0]->as<cgen::Block>()->nodes.size() == 1);
+    assert(program.nodes[1]->as<cgen::Block>()->nodes.size() == 2);
+}
+
+std::unique_ptr<cgen::Node> make_counter(int index)
+{
+    auto fn = cgen::make<cgen::Function>();
+    fn->name = "count" + std::to_string(index);
+    fn->return_type = cgen::pointer_of(cgen::i32());
+    fn->parameters.push_back(cgen::decl_local("n", cgen::i32()));
+
+    auto body = cgen::make<cgen::Block>();
+    auto ret = cgen::make<cgen::Return>();
+    ret->node = cgen::call(cgen::local("g"), cgen::local("n"), cgen::literal(index));
+    body->push(std::move(ret));
+    fn->body = std::move(body);
+
+    return fn;
+}
+
+void test_concurrent_build()
+{
+    const int threads = 4;
+    const int count = 200;
+
+    cgen::SymbolTable symbols;
+    cgen::TypeTable types;
+    cgen::ProgramBuilder builder;
+    std::vector<std::vector<cgen::Symbol>> interned(threads);
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t]
+                             {
+                                 cgen::SymbolScope symbol_scope(symbols);
+                                 cgen::TypeScope type_scope(types);
+                                 auto &producer = builder.producer();
+                                 auto scope = producer.scope();
+
+                                 // Keys interleave across threads, so only sorting restores the order.
+                                 for (int i = t; i < count; i += threads)
+                                     producer.attach(i, make_counter(i));
+                                 for (int i = 0; i < count; i++)
+                                     interned[t].push_back("count" + std::to_string(i)); });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    auto program = builder.build();
+    assert(program->arenas.size() == threads);
+    assert(program->nodes.size() == count);
+    assert(program->nodes[0]->flags & cgen::Node::ArenaOwned);
+    assert(program->nodes[0]->parent == program.get());
+
+    cgen::CodeGenVisitor visitor;
+    std::string expected;
+    {
+        cgen::SymbolScope symbol_scope(symbols);
+        for (int i = 0; i < count; i++)
+            expected += make_counter(i)->accept(&visitor) + ";";
+    }
+    assert(program->accept(&visitor) == expected);
+
+    // Every thread saw the same symbols, with dense ids that round-trip.
+    for (int t = 1; t < threads; t++)
+        assert(interned[t] == interned[0]);
+    std::vector<bool> seen(symbols.size() + 1);
+    for (auto symbol : interned[0])
+    {
+        assert(symbol.id() >= 1 && symbol.id() <= symbols.size());
+        assert(!seen[symbol.id()]);
+        seen[symbol.id()] = true;
+        assert(symbols.lookup(symbol.id()) == symbol);
+    }
+    assert(symbols.lookup(uint32_t(symbols.size() + 1)).empty());
+
+    // The interned pointer type is shared by every producer.
+    assert(program->nodes[0]->as<cgen::Function>()->return_type.get() ==
+           program->nodes[1]->as<cgen::Function>()->return_type.get());
+
+    assert(builder.build()->nodes.empty());
+}
+
 int main()
 {
     RUN_TEST(test_primitive);
@@ -140,4 +1812,38 @@ int main()
     RUN_TEST(test_function);
     RUN_TEST(test_struct);
     RUN_TEST(test_call);
+    RUN_TEST(test_sink);
+    RUN_TEST(test_arena);
+    RUN_TEST(test_node_kind);
+    RUN_TEST(test_static_visitor);
+    RUN_TEST(test_parallel_emit);
+    RUN_TEST(test_symbol);
+    RUN_TEST(test_type_table);
+    RUN_TEST(test_structural_hash);
+    RUN_TEST(test_render_cache);
+    RUN_TEST(test_incremental_emit);
+    RUN_TEST(test_literal);
+    RUN_TEST(test_array_init);
+    RUN_TEST(test_file_writer);
+    RUN_TEST(test_sharding);
+    RUN_TEST(test_flat_tree);
+    RUN_TEST(test_serialize);
+    RUN_TEST(test_flat_validate);
+    RUN_TEST(test_builders);
+    RUN_TEST(test_optimize);
+    RUN_TEST(test_symbol_index);
+    RUN_TEST(test_expressions);
+    RUN_TEST(test_fold_operators);
+    RUN_TEST(test_deep_nesting);
+    RUN_TEST(test_sized_emit);
+    RUN_TEST(test_program_writer);
+    RUN_TEST(test_escape);
+    RUN_TEST(test_concurrent_build);
+    RUN_TEST(test_disk_cache);
+    RUN_TEST(test_write_if_changed);
+    RUN_TEST(test_clone);
+    RUN_TEST(test_share);
+#ifdef CGEN_INSTRUMENTATION
+    RUN_TEST(test_instrumentation);
+#endif
 }